@@ -113,6 +113,41 @@ int pam_set_item(pam_handle_t *pamh, int item_type,
   }
 }
 
+// Data that the module stores in its PAM handle. The demo only has one.
+static struct {
+  const char *name;
+  void       *data;
+  void       (*cleanup)(pam_handle_t *pamh, void *data, int error_status);
+} pam_data[4];
+
+int pam_set_data(pam_handle_t *pamh, const char *module_data_name,
+                 void *data, void (*cleanup)(pam_handle_t *pamh, void *data,
+                                             int error_status)) {
+  for (int i = 0; i < sizeof(pam_data)/sizeof(*pam_data); ++i) {
+    if (!pam_data[i].name || !strcmp(pam_data[i].name, module_data_name)) {
+      if (pam_data[i].cleanup) {
+        pam_data[i].cleanup(pamh, pam_data[i].data, 0);
+      }
+      pam_data[i].name = module_data_name;
+      pam_data[i].data = data;
+      pam_data[i].cleanup = cleanup;
+      return PAM_SUCCESS;
+    }
+  }
+  return PAM_BUF_ERR;
+}
+
+int pam_get_data(const pam_handle_t *pamh, const char *module_data_name,
+                 const void **data) {
+  for (int i = 0; i < sizeof(pam_data)/sizeof(*pam_data); ++i) {
+    if (pam_data[i].name && !strcmp(pam_data[i].name, module_data_name)) {
+      *data = pam_data[i].data;
+      return PAM_SUCCESS;
+    }
+  }
+  return PAM_NO_MODULE_DATA;
+}
+
 static void print_diagnostics(int signo) {
   extern const char *get_error_msg(void);
   assert(!tcsetattr(0, TCSAFLUSH, &old_termios));
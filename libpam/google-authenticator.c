@@ -34,16 +34,21 @@
 #include "base32.h"
 #include "hmac.h"
 #include "sha1.h"
+#include "sha256.h"
+#include "sha512.h"
+#include "secret_state.h"
 
 #define SECRET                    "/.google_authenticator"
 #define SECRET_BITS               80          // Must be divisible by eight
-#define VERIFICATION_CODE_MODULUS (1000*1000) // Six digits
 #define SCRATCHCODES              5           // Number of initial scratchcodes
 #define SCRATCHCODE_LENGTH        8           // Eight digits per scratchcode
 #define BYTES_PER_SCRATCHCODE     4           // 32bit of randomness is enough
 #define BITS_PER_BASE32_CHAR      5           // Base32 expands space by 8/5
 
 static enum { QR_UNSET=0, QR_NONE, QR_ANSI, QR_UTF8 } qr_mode = QR_UNSET;
+static enum { ALGO_UNSET=0, SHA1, SHA256, SHA512 } algorithm = ALGO_UNSET;
+static const char *algorithm_names[] = { "", "SHA1", "SHA256", "SHA512" };
+static int digits = 0;
 
 static int generateCode(const char *key, unsigned long tm) {
   uint8_t challenge[8];
@@ -69,13 +74,27 @@ static int generateCode(const char *key, unsigned long tm) {
     return -1;
   }
 
-  // Compute the HMAC_SHA1 of the secrete and the challenge.
-  uint8_t hash[SHA1_DIGEST_LENGTH];
-  hmac_sha1(secret, secretLen, challenge, 8, hash, SHA1_DIGEST_LENGTH);
+  // Compute the HMAC of the secrete and the challenge.
+  uint8_t hash[SHA512_DIGEST_LENGTH];
+  int hashLen;
+  if (algorithm == SHA256) {
+    hmac_sha256(secret, secretLen, challenge, 8, hash, SHA256_DIGEST_LENGTH);
+    hashLen = SHA256_DIGEST_LENGTH;
+  } else if (algorithm == SHA512) {
+    hmac_sha512(secret, secretLen, challenge, 8, hash, SHA512_DIGEST_LENGTH);
+    hashLen = SHA512_DIGEST_LENGTH;
+  } else {
+    HMAC_SHA1_KEY ctx;
+    hmac_sha1_init_key(&ctx, secret, secretLen);
+    hmac_sha1_compute(&ctx, challenge, 8, hash, SHA1_DIGEST_LENGTH);
+    hmac_sha1_clear_key(&ctx);
+    hashLen = SHA1_DIGEST_LENGTH;
+  }
+  memset(secret, 0, sizeof(secret));
 
   // Pick the offset where to sample our hash value for the actual verification
   // code.
-  int offset = hash[SHA1_DIGEST_LENGTH - 1] & 0xF;
+  int offset = hash[hashLen - 1] & 0xF;
 
   // Compute the truncated hash in a byte-order independent loop.
   unsigned int truncatedHash = 0;
@@ -85,8 +104,13 @@ static int generateCode(const char *key, unsigned long tm) {
   }
 
   // Truncate to a smaller number of digits.
+  unsigned int modulus = 1;
+  for (int i = 0; i < digits; ++i) {
+    modulus *= 10;
+  }
   truncatedHash &= 0x7FFFFFFF;
-  truncatedHash %= VERIFICATION_CODE_MODULUS;
+  truncatedHash %= modulus;
+  memset(hash, 0, sizeof(hash));
 
   return truncatedHash;
 }
@@ -146,12 +170,22 @@ static const char *urlEncode(const char *s) {
 static const char *getURL(const char *secret, const char *label,
                           char **encoderURL, const int use_totp) {
   const char *encodedLabel = urlEncode(label);
-  char *url = malloc(strlen(encodedLabel) + strlen(secret) + 80);
+  char *url = malloc(strlen(encodedLabel) + strlen(secret) + 120);
   char totp = 'h';
   if (use_totp) {
     totp = 't';
   }
   sprintf(url, "otpauth://%cotp/%s?secret=%s", totp, encodedLabel, secret);
+
+  // Only mention non-default parameters. Not all authenticator apps know
+  // about them.
+  if (algorithm != SHA1) {
+    sprintf(strrchr(url, '\000'), "&algorithm=%s",
+            algorithm_names[algorithm]);
+  }
+  if (digits != 6) {
+    sprintf(strrchr(url, '\000'), "&digits=%d", digits);
+  }
   if (encoderURL) {
     const char *encoder = "https://www.google.com/chart?chs=200x200&"
                           "chld=M|0&cht=qr&chl=";
@@ -327,16 +361,140 @@ static char *maybeAddOption(const char *msg, char *buf, size_t nbuf,
   return buf;
 }
 
+static char *defaultSecretFilename(void) {
+  char *home = getenv("HOME");
+  if (!home || *home != '/') {
+    fprintf(stderr, "Cannot determine home directory\n");
+    return NULL;
+  }
+  char *secret_fn = malloc(strlen(home) + strlen(SECRET) + 1);
+  if (!secret_fn) {
+    perror("malloc()");
+    _exit(1);
+  }
+  return strcat(strcpy(secret_fn, home), SECRET);
+}
+
+// Rewrites an existing secret file in the text or in the binary format.
+// Binary files are updated in place by the PAM module, so they must be
+// writable by their owner.
+static int convertFile(const char *secret_fn, int to_binary) {
+  int rc = 1;
+  char *buf = NULL, *contents = NULL, *tmp_fn = NULL;
+  SecretState state = { 0 };
+  struct stat sb;
+  int fd = open(secret_fn, O_RDONLY|O_NOFOLLOW);
+  if (fd < 0 || fstat(fd, &sb) < 0) {
+    fprintf(stderr, "Failed to read \"%s\" (%s)\n",
+            secret_fn, strerror(errno));
+    goto cleanup;
+  }
+  if (sb.st_size < 1 || sb.st_size > 64*1024) {
+    fprintf(stderr, "Invalid file size for \"%s\"\n", secret_fn);
+    goto cleanup;
+  }
+  size_t len = sb.st_size;
+  if (!(buf = malloc(len + 1))) {
+    perror("malloc()");
+    goto cleanup;
+  }
+  if (read(fd, buf, len) != (ssize_t)len) {
+    fprintf(stderr, "Failed to read \"%s\"\n", secret_fn);
+    goto cleanup;
+  }
+  buf[len] = '\000';
+  int parsed;
+  if (secret_state_is_binary(buf, len)) {
+    parsed = secret_state_parse_binary(&state, buf, len);
+  } else if (memchr(buf, 0, len)) {
+    parsed = 1;
+  } else {
+    parsed = secret_state_parse(&state, buf);
+  }
+  if (parsed) {
+    if (parsed > 0) {
+      fprintf(stderr, "Invalid file contents in \"%s\"\n", secret_fn);
+    } else {
+      perror("malloc()");
+    }
+    goto cleanup;
+  }
+  if (state.binary == to_binary) {
+    printf("\"%s\" already uses the %s format\n", secret_fn,
+           to_binary ? "binary" : "text");
+    rc = 0;
+    goto cleanup;
+  }
+
+  if (to_binary) {
+    contents = secret_state_serialize_binary(&state, &len);
+  } else if ((contents = secret_state_serialize(&state)) != NULL) {
+    len = strlen(contents);
+  }
+  if (!contents) {
+    if (errno == EINVAL) {
+      fprintf(stderr, "\"%s\" has options that cannot be stored in the "
+              "binary format\n", secret_fn);
+    } else {
+      perror("malloc()");
+    }
+    goto cleanup;
+  }
+
+  if (!(tmp_fn = malloc(strlen(secret_fn) + 2))) {
+    perror("malloc()");
+    goto cleanup;
+  }
+  strcat(strcpy(tmp_fn, secret_fn), "~");
+  close(fd);
+  fd = open(tmp_fn, O_WRONLY|O_EXCL|O_CREAT|O_NOFOLLOW|O_TRUNC,
+            to_binary ? 0600 : 0400);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to create \"%s\" (%s)\n",
+            tmp_fn, strerror(errno));
+    goto cleanup;
+  }
+  if (write(fd, contents, len) != (ssize_t)len ||
+      fsync(fd) ||
+      rename(tmp_fn, secret_fn)) {
+    perror("Failed to write converted secret");
+    unlink(tmp_fn);
+    goto cleanup;
+  }
+  rc = 0;
+
+ cleanup:
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (buf) {
+    memset(buf, 0, sb.st_size);
+    free(buf);
+  }
+  if (contents) {
+    memset(contents, 0, len);
+    free(contents);
+  }
+  free(tmp_fn);
+  secret_state_clear(&state);
+  return rc;
+}
+
 static void usage(void) {
   puts(
  "google-authenticator [<options>]\n"
  " -h, --help               Print this message\n"
+ " -a, --algorithm={SHA1,SHA256,SHA512}\n"
+ "                          Select the HMAC algorithm (default SHA1)\n"
  " -c, --counter-based      Set up counter-based (HOTP) verification\n"
+ " -C, --convert={TEXT,BINARY}\n"
+ "                          Convert an existing secret file, and exit\n"
  " -t, --time-based         Set up time-based (TOTP) verification\n"
  " -d, --disallow-reuse     Disallow reuse of previously used TOTP tokens\n"
  " -D, --allow-reuse        Allow reuse of previously used TOTP tokens\n"
  " -f, --force              Write file without first confirming with user\n"
  " -l, --label=<label>      Override the default label in \"otpauth://\" URL\n"
+ " -n, --digits=N           Use N digit verification codes (6..8)\n"
  " -q, --quiet              Quiet mode\n"
  " -Q, --qr-mode={NONE,ANSI,UTF8}\n"
  " -r, --rate-limit=N       Limit logins to N per every M seconds\n"
@@ -354,17 +512,22 @@ int main(int argc, char *argv[]) {
   static const char disallow[]  = "\" DISALLOW_REUSE\n";
   static const char window[]    = "\" WINDOW_SIZE 17\n";
   static const char ratelimit[] = "\" RATE_LIMIT 3 30\n";
+  static const char algo[]      = "\" ALGORITHM SHA512\n";
+  static const char ndigits[]   = "\" DIGITS 8\n";
   char secret[(SECRET_BITS + BITS_PER_BASE32_CHAR-1)/BITS_PER_BASE32_CHAR +
               1 /* newline */ +
               sizeof(hotp) +  // hotp and totp are mutually exclusive.
               sizeof(disallow) +
               sizeof(window) +
               sizeof(ratelimit) + 5 + // NN MMM (total of five digits)
+              sizeof(algo) +
+              sizeof(ndigits) +
               SCRATCHCODE_LENGTH*(SCRATCHCODES + 1 /* newline */) +
               1 /* NUL termination character */];
 
   enum { ASK_MODE, HOTP_MODE, TOTP_MODE } mode = ASK_MODE;
   enum { ASK_REUSE, DISALLOW_REUSE, ALLOW_REUSE } reuse = ASK_REUSE;
+  enum { CONVERT_NONE, CONVERT_TEXT, CONVERT_BINARY } convert = CONVERT_NONE;
   int force = 0, quiet = 0;
   int r_limit = 0, r_time = 0;
   char *secret_fn = NULL;
@@ -372,7 +535,7 @@ int main(int argc, char *argv[]) {
   int window_size = 0;
   int idx;
   for (;;) {
-    static const char optstring[] = "+hctdDfl:qQ:r:R:us:w:W";
+    static const char optstring[] = "+hctdDfl:qQ:r:R:us:w:Wa:n:C:";
     static struct option options[] = {
       { "help",             0, 0, 'h' },
       { "counter-based",    0, 0, 'c' },
@@ -389,6 +552,9 @@ int main(int argc, char *argv[]) {
       { "secret",           1, 0, 's' },
       { "window-size",      1, 0, 'w' },
       { "minimal-window",   0, 0, 'W' },
+      { "algorithm",        1, 0, 'a' },
+      { "digits",           1, 0, 'n' },
+      { "convert",          1, 0, 'C' },
       { 0,                  0, 0,  0  }
     };
     idx = -1;
@@ -570,6 +736,50 @@ int main(int argc, char *argv[]) {
         _exit(1);
       }
       window_size = -1;
+    } else if (!idx--) {
+      // algorithm
+      if (algorithm != ALGO_UNSET) {
+        fprintf(stderr, "Duplicate -a option detected\n");
+        _exit(1);
+      }
+      if (!strcasecmp(optarg, "sha1")) {
+        algorithm = SHA1;
+      } else if (!strcasecmp(optarg, "sha256")) {
+        algorithm = SHA256;
+      } else if (!strcasecmp(optarg, "sha512")) {
+        algorithm = SHA512;
+      } else {
+        fprintf(stderr, "Invalid algorithm \"%s\"\n", optarg);
+        _exit(1);
+      }
+    } else if (!idx--) {
+      // digits
+      if (digits) {
+        fprintf(stderr, "Duplicate -n option detected\n");
+        _exit(1);
+      }
+      char *endptr;
+      errno = 0;
+      long l = strtol(optarg, &endptr, 10);
+      if (errno || endptr == optarg || *endptr || l < 6 || l > 8) {
+        fprintf(stderr, "-n requires an argument in the range 6..8\n");
+        _exit(1);
+      }
+      digits = (int)l;
+    } else if (!idx--) {
+      // convert
+      if (convert != CONVERT_NONE) {
+        fprintf(stderr, "Duplicate -C option detected\n");
+        _exit(1);
+      }
+      if (!strcasecmp(optarg, "text")) {
+        convert = CONVERT_TEXT;
+      } else if (!strcasecmp(optarg, "binary")) {
+        convert = CONVERT_BINARY;
+      } else {
+        fprintf(stderr, "Invalid file format \"%s\"\n", optarg);
+        _exit(1);
+      }
     } else {
       fprintf(stderr, "Error\n");
       _exit(1);
@@ -579,6 +789,14 @@ int main(int argc, char *argv[]) {
   if (optind != argc) {
     goto err;
   }
+  if (convert != CONVERT_NONE) {
+    if (!secret_fn && !(secret_fn = defaultSecretFilename())) {
+      return 1;
+    }
+    int rc = convertFile(secret_fn, convert == CONVERT_BINARY);
+    free(secret_fn);
+    return rc;
+  }
   if (reuse != ASK_REUSE && mode != TOTP_MODE) {
     fprintf(stderr, "Must select time-based mode, when using -d or -D\n");
     _exit(1);
@@ -587,6 +805,12 @@ int main(int argc, char *argv[]) {
     fprintf(stderr, "Must set -r when setting -R, and vice versa\n");
     _exit(1);
   }
+  if (algorithm == ALGO_UNSET) {
+    algorithm = SHA1;
+  }
+  if (!digits) {
+    digits = 6;
+  }
   if (!label) {
     uid_t uid = getuid();
     const char *user = getUserName(uid);
@@ -619,7 +843,8 @@ int main(int argc, char *argv[]) {
   if (!quiet) {
     displayQRCode(secret, label, use_totp);
     printf("Your new secret key is: %s\n", secret);
-    printf("Your verification code is %06d\n", generateCode(secret, 0));
+    printf("Your verification code is %0*d\n", digits,
+           generateCode(secret, 0));
     printf("Your emergency scratch codes are:\n");
   }
   free(label);
@@ -629,6 +854,14 @@ int main(int argc, char *argv[]) {
   } else {
     strcat(secret, hotp);
   }
+  if (algorithm != SHA1) {
+    snprintf(strrchr(secret, '\000'), sizeof(secret) - strlen(secret),
+             "\" ALGORITHM %s\n", algorithm_names[algorithm]);
+  }
+  if (digits != 6) {
+    snprintf(strrchr(secret, '\000'), sizeof(secret) - strlen(secret),
+             "\" DIGITS %d\n", digits);
+  }
   for (int i = 0; i < SCRATCHCODES; ++i) {
   new_scratch_code:;
     int scratch = 0;
@@ -656,18 +889,8 @@ int main(int argc, char *argv[]) {
              "%08d\n", scratch);
   }
   close(fd);
-  if (!secret_fn) {
-    char *home = getenv("HOME");
-    if (!home || *home != '/') {
-      fprintf(stderr, "Cannot determine home directory\n");
-      return 1;
-    }
-    secret_fn = malloc(strlen(home) + strlen(SECRET) + 1);
-    if (!secret_fn) {
-      perror("malloc()");
-      _exit(1);
-    }
-    strcat(strcpy(secret_fn, home), SECRET);
+  if (!secret_fn && !(secret_fn = defaultSecretFilename())) {
+    return 1;
   }
   if (!force) {
     printf("\nDo you want me to update your \"%s\" file (y/n) ", secret_fn);
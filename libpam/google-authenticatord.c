@@ -0,0 +1,370 @@
+// Daemon that verifies codes on behalf of pam_google_authenticator
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <security/pam_appl.h>
+
+#include "google-authenticatord.h"
+
+#if !defined(LOG_AUTHPRIV) && defined(LOG_AUTH)
+#define LOG_AUTHPRIV LOG_AUTH
+#endif
+
+// Users have this many seconds to answer all prompts of a PAM call.
+#define REQUEST_TIMEOUT 120
+#define NUM_BUCKETS     256
+
+// Cached state for one user. The entry's mutex serializes access to it. It is
+// only held while handling a single packet, never while waiting for the next
+// one. Otherwise, a login that is waiting for the user to type would lock out
+// all other logins for the same user.
+typedef struct Entry {
+  struct Entry    *next;
+  char            *username;
+  pthread_mutex_t mutex;
+  CachedUser      *user;
+} Entry;
+
+static pthread_mutex_t entries_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Entry *entries[NUM_BUCKETS];
+static const char *socket_name = DAEMON_SOCKET;
+static volatile sig_atomic_t flush_passwd_cache;
+
+// Returns the locked entry for "username", creating it if necessary.
+static Entry *lock_entry(const char *username) {
+  unsigned hash = 0;
+  for (const char *ptr = username; *ptr; ++ptr) {
+    hash = 31*hash + (unsigned char)*ptr;
+  }
+  Entry **bucket = &entries[hash % NUM_BUCKETS];
+
+  pthread_mutex_lock(&entries_mutex);
+  Entry *entry;
+  for (entry = *bucket; entry; entry = entry->next) {
+    if (!strcmp(entry->username, username)) {
+      break;
+    }
+  }
+  if (!entry) {
+    entry = calloc(1, sizeof(Entry));
+    if (!entry ||
+        !(entry->username = strdup(username)) ||
+        !(entry->user = cached_user_new())) {
+      if (entry) {
+        free(entry->username);
+        free(entry);
+      }
+      pthread_mutex_unlock(&entries_mutex);
+      syslog(LOG_ERR, "Out of memory");
+      return NULL;
+    }
+    pthread_mutex_init(&entry->mutex, NULL);
+    entry->next = *bucket;
+    *bucket = entry;
+  }
+  pthread_mutex_unlock(&entries_mutex);
+
+  // Entries are never deleted, so it is safe to wait for the lock without
+  // holding "entries_mutex".
+  pthread_mutex_lock(&entry->mutex);
+  return entry;
+}
+
+// Reads one packet and splits it into its NUL terminated strings. Returns the
+// number of strings, or -1 on EOF and on errors.
+static int read_request(int fd, char *buf, const char **fields) {
+  ssize_t len = recv(fd, buf, DAEMON_MAX_PACKET, 0);
+  if (len <= 0 || buf[len - 1]) {
+    return -1;
+  }
+  int num_fields = 0;
+  for (char *ptr = buf; ptr < buf + len; ptr += strlen(ptr) + 1) {
+    if (num_fields == DAEMON_MAX_FIELDS) {
+      return -1;
+    }
+    fields[num_fields++] = ptr;
+  }
+  return num_fields;
+}
+
+// Sends "status", followed by the NULL terminated list of its arguments.
+static void send_reply(int fd, const char *status, ...) {
+  char buf[DAEMON_MAX_PACKET];
+  size_t len = strlen(status) + 1;
+  memcpy(buf, status, len);
+  va_list args;
+  va_start(args, status);
+  for (const char *arg; len < sizeof(buf) &&
+                        (arg = va_arg(args, const char *)) != NULL; ) {
+    snprintf(buf + len, sizeof(buf) - len, "%s", *arg ? arg : "Error");
+    len += strlen(buf + len) + 1;
+  }
+  va_end(args);
+  send(fd, buf, len, MSG_NOSIGNAL);
+}
+
+// Handles a "CHECK" request. The PAM module only sends the end of the
+// password, so we stand in for the rest with placeholder characters. This
+// way, all checks see a password of the original length. Returns the result
+// of cached_user_check(), the number of characters used by the code, and
+// the time step or counter value that it was valid for.
+static int check_code(Entry *entry, CachedRequest *request,
+                      const char **fields, int *consumed, long *verified) {
+  char *endptr;
+  long mode = strtol(fields[1], &endptr, 10);
+  if (*endptr || mode < 0 || mode > 3) {
+    return -1;
+  }
+  long pw_len = strtol(fields[2], &endptr, 10);
+  size_t tail_len = strlen(fields[3]);
+  if (*endptr || pw_len < (long)tail_len || pw_len > DAEMON_MAX_PACKET ||
+      tail_len > DAEMON_TAIL_LENGTH ||
+      (tail_len < DAEMON_TAIL_LENGTH && (long)tail_len != pw_len)) {
+    return -1;
+  }
+  char *pw = malloc(pw_len + 1);
+  if (!pw) {
+    return -1;
+  }
+  memset(pw, '*', pw_len - tail_len);
+  strcpy(pw + pw_len - tail_len, fields[3]);
+  pthread_mutex_lock(&entry->mutex);
+  int rc = cached_user_check(entry->user, request, (int)mode, pw, verified);
+  pthread_mutex_unlock(&entry->mutex);
+  *consumed = pw_len - strlen(pw);
+  memset(pw, 0, pw_len);
+  free(pw);
+  return rc;
+}
+
+static void *handle_connection(void *arg) {
+  int fd = (int)(intptr_t)arg;
+  char buf[DAEMON_MAX_PACKET];
+  const char *fields[DAEMON_MAX_FIELDS];
+
+  // Only root, and the user that we are running as, get to ask for verdicts.
+  struct ucred cred;
+  socklen_t cred_len = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 ||
+      (cred.uid != 0 && cred.uid != geteuid())) {
+    syslog(LOG_ERR, "Rejected connection from unauthorized peer");
+    close(fd);
+    return NULL;
+  }
+  struct timeval tv = { REQUEST_TIMEOUT, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  Entry *entry;
+  CachedRequest *request = NULL;
+  int num_fields = read_request(fd, buf, fields);
+  if (num_fields < 2 || strcmp(fields[0], "AUTH") || !*fields[1] ||
+      !(request = cached_request_new()) ||
+      !(entry = lock_entry(fields[1]))) {
+    cached_request_free(request);
+    close(fd);
+    return NULL;
+  }
+  int rc = PAM_SESSION_ERR, verified = 0, ended = 0;
+  int begin_rc = cached_user_begin(entry->user, request, fields[1],
+                                   num_fields - 2, fields + 2);
+  pthread_mutex_unlock(&entry->mutex);
+  switch (begin_rc) {
+  case 0:
+    send_reply(fd, "OK", NULL);
+    while ((num_fields = read_request(fd, buf, fields)) > 0) {
+      if (!strcmp(fields[0], "CHECK") && num_fields == 4) {
+        int consumed;
+        long step;
+        switch (check_code(entry, request, fields, &consumed, &step)) {
+        case 0: {
+          char consumed_str[12], step_str[24];
+          sprintf(consumed_str, "%d", consumed);
+          sprintf(step_str, "%ld", step);
+          verified = 1;
+          send_reply(fd, "OK", consumed_str, step_str, NULL);
+          break; }
+        case 1:
+          send_reply(fd, "INVALID", NULL);
+          break;
+        default:
+          send_reply(fd, "ERR", cached_user_error(), NULL);
+          break;
+        }
+        memset((char *)fields[3], 0, strlen(fields[3]));
+      } else if (!strcmp(fields[0], "END") && num_fields == 2) {
+        pthread_mutex_lock(&entry->mutex);
+        rc = cached_user_end(entry->user, request,
+                             verified && !strcmp(fields[1], "0")
+                             ? PAM_SUCCESS : PAM_SESSION_ERR);
+        pthread_mutex_unlock(&entry->mutex);
+        ended = 1;
+        if (rc == PAM_SUCCESS) {
+          send_reply(fd, "OK", NULL);
+        } else {
+          send_reply(fd, "ERR", cached_user_error(), NULL);
+        }
+        break;
+      } else {
+        break;
+      }
+    }
+    break;
+  case 1:
+    send_reply(fd, "NOSECRET", NULL);
+    break;
+  default:
+    send_reply(fd, "ERR", cached_user_error(), NULL);
+    break;
+  }
+
+  // Connections that end early never grant access, but might still have to
+  // persist a failed attempt.
+  if (!ended) {
+    pthread_mutex_lock(&entry->mutex);
+    cached_user_end(entry->user, request, rc);
+    pthread_mutex_unlock(&entry->mutex);
+  }
+  cached_request_free(request);
+  close(fd);
+  return NULL;
+}
+
+static void remove_socket(int signo) {
+  unlink(socket_name);
+  _exit(0);
+}
+
+static void request_flush(int signo) {
+  flush_passwd_cache = 1;
+}
+
+static void usage(void) {
+  puts(
+ "google-authenticatord [<options>]\n"
+ " -f, --foreground           Do not detach from the terminal\n"
+ " -h, --help                 Print this message\n"
+ " -s, --socket=<file>        Listen on this socket (default: "
+                              DAEMON_SOCKET ")\n"
+ "\n"
+ "Use \"daemon=<file>\" in the PAM configuration to verify codes through\n"
+ "this daemon.");
+}
+
+int main(int argc, char *argv[]) {
+  static const struct option options[] = {
+    { "foreground", 0, 0, 'f' },
+    { "help",       0, 0, 'h' },
+    { "socket",     1, 0, 's' },
+    { 0,            0, 0,  0  }
+  };
+  int foreground = 0;
+  for (;;) {
+    int c = getopt_long(argc, argv, "fhs:", options, NULL);
+    if (c == -1) {
+      break;
+    }
+    switch (c) {
+    case 'f':
+      foreground = 1;
+      break;
+    case 'h':
+      usage();
+      exit(0);
+    case 's':
+      socket_name = optarg;
+      break;
+    default:
+      usage();
+      exit(1);
+    }
+  }
+  if (optind != argc) {
+    usage();
+    exit(1);
+  }
+
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(socket_name) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket name \"%s\" is too long\n", socket_name);
+    exit(1);
+  }
+  strcpy(addr.sun_path, socket_name);
+
+  // The socket is only accessible to its owner. We also check the peer's
+  // credentials for each connection.
+  umask(077);
+  unlink(socket_name);
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (fd < 0 ||
+      bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(fd, SOMAXCONN) < 0) {
+    perror("google-authenticatord");
+    exit(1);
+  }
+  if (!foreground && daemon(0, 0) < 0) {
+    perror("google-authenticatord");
+    unlink(socket_name);
+    exit(1);
+  }
+  signal(SIGTERM, remove_socket);
+  signal(SIGINT, remove_socket);
+  signal(SIGHUP, request_flush);
+  signal(SIGPIPE, SIG_IGN);
+  openlog("google-authenticatord", LOG_PID, LOG_AUTHPRIV);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (;;) {
+    int conn = accept(fd, NULL, NULL);
+
+    // SIGHUP makes us look up users in the user database again.
+    if (flush_passwd_cache) {
+      flush_passwd_cache = 0;
+      passwd_cache_flush();
+    }
+    if (conn < 0) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+        syslog(LOG_ERR, "accept() failed: %m");
+        sleep(1);
+      }
+      continue;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, handle_connection,
+                       (void *)(intptr_t)conn)) {
+      syslog(LOG_ERR, "Failed to start thread");
+      close(conn);
+    }
+  }
+}
@@ -0,0 +1,83 @@
+// Interface between pam_google_authenticator and google-authenticatord
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GOOGLE_AUTHENTICATORD_H__
+#define GOOGLE_AUTHENTICATORD_H__
+
+// The PAM module talks to the daemon over a SOCK_SEQPACKET Unix domain
+// socket. Each packet is a list of NUL terminated strings, the first of which
+// names the request or the reply. A connection lasts for one PAM call:
+//
+//   AUTH user arg...        ->  OK | NOSECRET | ERR message
+//   CHECK mode length tail  ->  OK consumed verified | INVALID | ERR message
+//   ...
+//   END status              ->  OK | ERR message
+//
+// "arg..." are the PAM module's arguments. "mode" tells the daemon whether to
+// look for a verification code or for a scratch code, "length" is the length
+// of the password, and "tail" holds its last few characters. The rest of the
+// password never leaves the PAM module. "consumed" is the number of
+// characters that the code took up, and "verified" is its time step or
+// counter value. "status" is zero, if the PAM module wants to grant access. The daemon persists its state before it replies to "END".
+#define DAEMON_SOCKET      "/run/google-authenticatord.sock"
+#define DAEMON_MAX_PACKET  4096
+#define DAEMON_MAX_FIELDS  64
+#define DAEMON_TAIL_LENGTH 8
+#define DAEMON_TIMEOUT     30
+
+// The daemon reuses the PAM module's code, built with -DDAEMON, for
+// everything that touches the secret file. A request consists of a call to
+// cached_user_begin(), any number of calls to cached_user_check(), and a
+// final call to cached_user_end(). The CachedUser is shared by all requests
+// for the same user, and calls that use it must be serialized. But requests
+// can overlap, as the CachedRequest keeps track of each one of them. This
+// way, no lock has to be held while waiting for the user to type.
+typedef struct CachedUser CachedUser;
+typedef struct CachedRequest CachedRequest;
+
+CachedUser *cached_user_new(void) __attribute__((visibility("hidden")));
+void cached_user_free(CachedUser *user) __attribute__((visibility("hidden")));
+CachedRequest *cached_request_new(void)
+  __attribute__((visibility("hidden")));
+void cached_request_free(CachedRequest *request)
+  __attribute__((visibility("hidden")));
+
+// Returns the first error message of the current thread's request.
+const char *cached_user_error(void) __attribute__((visibility("hidden")));
+
+// Reads the secret file, unless the cached copy is still current, and applies
+// the rate limit. Returns 0 on success, 1 if there is no secret file and the
+// "nullok" argument was given, and -1 on error. cached_user_end() must be
+// called in either case.
+int cached_user_begin(CachedUser *user, CachedRequest *request,
+                      const char *username, int argc, const char **argv)
+  __attribute__((visibility("hidden")));
+
+// Checks the code at the end of "pw". Works like check_code() in the PAM
+// module. Fails, if another request had to read the secret file again, since
+// this request began.
+int cached_user_check(CachedUser *user, CachedRequest *request,
+                      int mode, char *pw, long *verified)
+  __attribute__((visibility("hidden")));
+
+// Writes back any changes, and returns the final PAM result.
+int cached_user_end(CachedUser *user, CachedRequest *request, int rc)
+  __attribute__((visibility("hidden")));
+
+// Forgets all cached user database entries.
+void passwd_cache_flush(void) __attribute__((visibility("hidden")));
+
+#endif
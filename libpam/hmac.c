@@ -19,18 +19,17 @@
 
 #include "hmac.h"
 #include "sha1.h"
+#include "sha1_mb.h"
 
-void hmac_sha1(const uint8_t *key, int keyLength,
-               const uint8_t *data, int dataLength,
-               uint8_t *result, int resultLength) {
-  SHA1_INFO ctx;
+void hmac_sha1_init_key(HMAC_SHA1_KEY *ctx, const uint8_t *key,
+                        int keyLength) {
   uint8_t hashed_key[SHA1_DIGEST_LENGTH];
   if (keyLength > 64) {
     // The key can be no bigger than 64 bytes. If it is, we'll hash it down to
     // 20 bytes.
-    sha1_init(&ctx);
-    sha1_update(&ctx, key, keyLength);
-    sha1_final(&ctx, hashed_key);
+    sha1_init(&ctx->inner);
+    sha1_update(&ctx->inner, key, keyLength);
+    sha1_final(&ctx->inner, hashed_key);
     key = hashed_key;
     keyLength = SHA1_DIGEST_LENGTH;
   }
@@ -42,13 +41,8 @@ void hmac_sha1(const uint8_t *key, int keyLength,
     tmp_key[i] = key[i] ^ 0x36;
   }
   memset(tmp_key + keyLength, 0x36, 64 - keyLength);
-
-  // Compute inner digest
-  sha1_init(&ctx);
-  sha1_update(&ctx, tmp_key, 64);
-  sha1_update(&ctx, data, dataLength);
-  uint8_t sha[SHA1_DIGEST_LENGTH];
-  sha1_final(&ctx, sha);
+  sha1_init(&ctx->inner);
+  sha1_update(&ctx->inner, tmp_key, 64);
 
   // The key for the outer digest is derived from our key, by padding the key
   // the full length of 64 bytes, and then XOR'ing each byte with 0x5C.
@@ -56,12 +50,27 @@ void hmac_sha1(const uint8_t *key, int keyLength,
     tmp_key[i] = key[i] ^ 0x5C;
   }
   memset(tmp_key + keyLength, 0x5C, 64 - keyLength);
+  sha1_init(&ctx->outer);
+  sha1_update(&ctx->outer, tmp_key, 64);
 
-  // Compute outer digest
-  sha1_init(&ctx);
-  sha1_update(&ctx, tmp_key, 64);
-  sha1_update(&ctx, sha, SHA1_DIGEST_LENGTH);
-  sha1_final(&ctx, sha);
+  // Zero out all internal data structures
+  memset(hashed_key, 0, sizeof(hashed_key));
+  memset(tmp_key, 0, sizeof(tmp_key));
+}
+
+void hmac_sha1_compute(const HMAC_SHA1_KEY *ctx,
+                       const uint8_t *data, int dataLength,
+                       uint8_t *result, int resultLength) {
+  // Compute inner digest, resuming from the cached state after the ipad block
+  SHA1_INFO sha1_info = ctx->inner;
+  sha1_update(&sha1_info, data, dataLength);
+  uint8_t sha[SHA1_DIGEST_LENGTH];
+  sha1_final(&sha1_info, sha);
+
+  // Compute outer digest, resuming from the cached state after the opad block
+  sha1_info = ctx->outer;
+  sha1_update(&sha1_info, sha, SHA1_DIGEST_LENGTH);
+  sha1_final(&sha1_info, sha);
 
   // Copy result to output buffer and truncate or pad as necessary
   memset(result, 0, resultLength);
@@ -70,8 +79,185 @@ void hmac_sha1(const uint8_t *key, int keyLength,
   }
   memcpy(result, sha, resultLength);
 
+  // Zero out all internal data structures
+  memset(sha, 0, sizeof(sha));
+  memset(&sha1_info, 0, sizeof(sha1_info));
+}
+
+void hmac_sha1_counter(const HMAC_SHA1_KEY *ctx, uint64_t counter,
+                       uint8_t result[SHA1_DIGEST_LENGTH]) {
+  // Both the counter and the inner digest are a whole number of words. So,
+  // each hash only needs its final block, and nothing has to be buffered.
+  uint32_t words[5] = { (uint32_t)(counter >> 32), (uint32_t)counter };
+  sha1_final_words(&ctx->inner, words, 2, words);
+  sha1_final_words(&ctx->outer, words, 5, words);
+  for (int i = 0; i < SHA1_DIGEST_LENGTH; ++i) {
+    result[i] = (uint8_t)(words[i/4] >> (24 - 8*(i%4)));
+  }
+
+  // Zero out all internal data structures
+  memset(words, 0, sizeof(words));
+}
+
+void hmac_sha1_counters(const HMAC_SHA1_KEY *ctx, uint64_t counter, int count,
+                        uint8_t (*result)[SHA1_DIGEST_LENGTH]) {
+  sha1_mb_hmac_counters(&ctx->inner, &ctx->outer, counter, count, result);
+}
+
+void hmac_sha1_clear_key(HMAC_SHA1_KEY *ctx) {
+  memset(ctx, 0, sizeof(*ctx));
+}
+
+void hmac_sha1(const uint8_t *key, int keyLength,
+               const uint8_t *data, int dataLength,
+               uint8_t *result, int resultLength) {
+  HMAC_SHA1_KEY ctx;
+  hmac_sha1_init_key(&ctx, key, keyLength);
+  hmac_sha1_compute(&ctx, data, dataLength, result, resultLength);
+  hmac_sha1_clear_key(&ctx);
+}
+
+// Derives the padded key block for the inner (pad = 0x36) or the outer
+// (pad = 0x5C) hash. "key" must already have been hashed, if it is longer
+// than "blockSize".
+static void pad_key(const uint8_t *key, int keyLength, uint8_t pad,
+                    uint8_t *block, int blockSize) {
+  for (int i = 0; i < keyLength; ++i) {
+    block[i] = key[i] ^ pad;
+  }
+  memset(block + keyLength, pad, blockSize - keyLength);
+}
+
+void hmac_sha256_init_key(HMAC_SHA256_KEY *ctx, const uint8_t *key,
+                          int keyLength) {
+  uint8_t hashed_key[SHA256_DIGEST_LENGTH];
+  if (keyLength > SHA256_BLOCKSIZE) {
+    sha256_init(&ctx->inner);
+    sha256_update(&ctx->inner, key, keyLength);
+    sha256_final(&ctx->inner, hashed_key);
+    key = hashed_key;
+    keyLength = SHA256_DIGEST_LENGTH;
+  }
+  uint8_t tmp_key[SHA256_BLOCKSIZE];
+  pad_key(key, keyLength, 0x36, tmp_key, sizeof(tmp_key));
+  sha256_init(&ctx->inner);
+  sha256_update(&ctx->inner, tmp_key, sizeof(tmp_key));
+  pad_key(key, keyLength, 0x5C, tmp_key, sizeof(tmp_key));
+  sha256_init(&ctx->outer);
+  sha256_update(&ctx->outer, tmp_key, sizeof(tmp_key));
+
   // Zero out all internal data structures
   memset(hashed_key, 0, sizeof(hashed_key));
+  memset(tmp_key, 0, sizeof(tmp_key));
+}
+
+void hmac_sha256_compute(const HMAC_SHA256_KEY *ctx,
+                         const uint8_t *data, int dataLength,
+                         uint8_t *result, int resultLength) {
+  SHA256_INFO sha256_info = ctx->inner;
+  sha256_update(&sha256_info, data, dataLength);
+  uint8_t sha[SHA256_DIGEST_LENGTH];
+  sha256_final(&sha256_info, sha);
+  sha256_info = ctx->outer;
+  sha256_update(&sha256_info, sha, sizeof(sha));
+  sha256_final(&sha256_info, sha);
+
+  memset(result, 0, resultLength);
+  if (resultLength > SHA256_DIGEST_LENGTH) {
+    resultLength = SHA256_DIGEST_LENGTH;
+  }
+  memcpy(result, sha, resultLength);
+
+  // Zero out all internal data structures
   memset(sha, 0, sizeof(sha));
+  memset(&sha256_info, 0, sizeof(sha256_info));
+}
+
+void hmac_sha256_counter(const HMAC_SHA256_KEY *ctx, uint64_t counter,
+                         uint8_t result[SHA256_DIGEST_LENGTH]) {
+  uint32_t words[8] = { (uint32_t)(counter >> 32), (uint32_t)counter };
+  sha256_final_words(&ctx->inner, words, 2, words);
+  sha256_final_words(&ctx->outer, words, 8, words);
+  for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
+    result[i] = (uint8_t)(words[i/4] >> (24 - 8*(i%4)));
+  }
+
+  // Zero out all internal data structures
+  memset(words, 0, sizeof(words));
+}
+
+void hmac_sha256(const uint8_t *key, int keyLength,
+                 const uint8_t *data, int dataLength,
+                 uint8_t *result, int resultLength) {
+  HMAC_SHA256_KEY ctx;
+  hmac_sha256_init_key(&ctx, key, keyLength);
+  hmac_sha256_compute(&ctx, data, dataLength, result, resultLength);
+  memset(&ctx, 0, sizeof(ctx));
+}
+
+void hmac_sha512_init_key(HMAC_SHA512_KEY *ctx, const uint8_t *key,
+                          int keyLength) {
+  uint8_t hashed_key[SHA512_DIGEST_LENGTH];
+  if (keyLength > SHA512_BLOCKSIZE) {
+    sha512_init(&ctx->inner);
+    sha512_update(&ctx->inner, key, keyLength);
+    sha512_final(&ctx->inner, hashed_key);
+    key = hashed_key;
+    keyLength = SHA512_DIGEST_LENGTH;
+  }
+  uint8_t tmp_key[SHA512_BLOCKSIZE];
+  pad_key(key, keyLength, 0x36, tmp_key, sizeof(tmp_key));
+  sha512_init(&ctx->inner);
+  sha512_update(&ctx->inner, tmp_key, sizeof(tmp_key));
+  pad_key(key, keyLength, 0x5C, tmp_key, sizeof(tmp_key));
+  sha512_init(&ctx->outer);
+  sha512_update(&ctx->outer, tmp_key, sizeof(tmp_key));
+
+  // Zero out all internal data structures
+  memset(hashed_key, 0, sizeof(hashed_key));
   memset(tmp_key, 0, sizeof(tmp_key));
 }
+
+void hmac_sha512_compute(const HMAC_SHA512_KEY *ctx,
+                         const uint8_t *data, int dataLength,
+                         uint8_t *result, int resultLength) {
+  SHA512_INFO sha512_info = ctx->inner;
+  sha512_update(&sha512_info, data, dataLength);
+  uint8_t sha[SHA512_DIGEST_LENGTH];
+  sha512_final(&sha512_info, sha);
+  sha512_info = ctx->outer;
+  sha512_update(&sha512_info, sha, sizeof(sha));
+  sha512_final(&sha512_info, sha);
+
+  memset(result, 0, resultLength);
+  if (resultLength > SHA512_DIGEST_LENGTH) {
+    resultLength = SHA512_DIGEST_LENGTH;
+  }
+  memcpy(result, sha, resultLength);
+
+  // Zero out all internal data structures
+  memset(sha, 0, sizeof(sha));
+  memset(&sha512_info, 0, sizeof(sha512_info));
+}
+
+void hmac_sha512_counter(const HMAC_SHA512_KEY *ctx, uint64_t counter,
+                         uint8_t result[SHA512_DIGEST_LENGTH]) {
+  uint64_t words[8] = { counter };
+  sha512_final_words(&ctx->inner, words, 1, words);
+  sha512_final_words(&ctx->outer, words, 8, words);
+  for (int i = 0; i < SHA512_DIGEST_LENGTH; ++i) {
+    result[i] = (uint8_t)(words[i/8] >> (56 - 8*(i%8)));
+  }
+
+  // Zero out all internal data structures
+  memset(words, 0, sizeof(words));
+}
+
+void hmac_sha512(const uint8_t *key, int keyLength,
+                 const uint8_t *data, int dataLength,
+                 uint8_t *result, int resultLength) {
+  HMAC_SHA512_KEY ctx;
+  hmac_sha512_init_key(&ctx, key, keyLength);
+  hmac_sha512_compute(&ctx, data, dataLength, result, resultLength);
+  memset(&ctx, 0, sizeof(ctx));
+}
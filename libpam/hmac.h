@@ -20,9 +20,95 @@
 
 #include <stdint.h>
 
+#include "sha1.h"
+#include "sha256.h"
+#include "sha512.h"
+
+// A key that has been prepared for repeated use. It caches the SHA1 states
+// after absorbing the inner and outer padded key blocks. Each subsequent
+// HMAC_SHA1 of a short message then only costs two SHA1 compressions,
+// instead of four.
+typedef struct {
+  SHA1_INFO inner;
+  SHA1_INFO outer;
+} HMAC_SHA1_KEY;
+
+void hmac_sha1_init_key(HMAC_SHA1_KEY *ctx, const uint8_t *key, int keyLength)
+ __attribute__((visibility("hidden")));
+
+void hmac_sha1_compute(const HMAC_SHA1_KEY *ctx,
+                       const uint8_t *data, int dataLength,
+                       uint8_t *result, int resultLength)
+ __attribute__((visibility("hidden")));
+
+// Computes the HMAC_SHA1 of a single counter value, hashed as an 8-byte
+// big-endian number. This is equivalent to calling hmac_sha1_compute(), but
+// builds the padded final blocks of both hashes directly.
+void hmac_sha1_counter(const HMAC_SHA1_KEY *ctx, uint64_t counter,
+                       uint8_t result[SHA1_DIGEST_LENGTH])
+ __attribute__((visibility("hidden")));
+
+// Computes the HMAC_SHA1 of "count" consecutive counter values, starting at
+// "counter". Each counter is hashed as an 8-byte big-endian number, which is
+// what both HOTP and TOTP use. The 20-byte results are stored in "result".
+void hmac_sha1_counters(const HMAC_SHA1_KEY *ctx, uint64_t counter, int count,
+                        uint8_t (*result)[SHA1_DIGEST_LENGTH])
+ __attribute__((visibility("hidden")));
+
+// Zeros out all key material.
+void hmac_sha1_clear_key(HMAC_SHA1_KEY *ctx)
+ __attribute__((visibility("hidden")));
+
 void hmac_sha1(const uint8_t *key, int keyLength,
                const uint8_t *data, int dataLength,
                uint8_t *result, int resultLength)
  __attribute__((visibility("hidden")));
 
+// The same interface for HMAC_SHA256 and HMAC_SHA512, as used by RFC 6238.
+typedef struct {
+  SHA256_INFO inner;
+  SHA256_INFO outer;
+} HMAC_SHA256_KEY;
+
+void hmac_sha256_init_key(HMAC_SHA256_KEY *ctx, const uint8_t *key,
+                          int keyLength)
+ __attribute__((visibility("hidden")));
+
+void hmac_sha256_compute(const HMAC_SHA256_KEY *ctx,
+                         const uint8_t *data, int dataLength,
+                         uint8_t *result, int resultLength)
+ __attribute__((visibility("hidden")));
+
+void hmac_sha256_counter(const HMAC_SHA256_KEY *ctx, uint64_t counter,
+                         uint8_t result[SHA256_DIGEST_LENGTH])
+ __attribute__((visibility("hidden")));
+
+void hmac_sha256(const uint8_t *key, int keyLength,
+                 const uint8_t *data, int dataLength,
+                 uint8_t *result, int resultLength)
+ __attribute__((visibility("hidden")));
+
+typedef struct {
+  SHA512_INFO inner;
+  SHA512_INFO outer;
+} HMAC_SHA512_KEY;
+
+void hmac_sha512_init_key(HMAC_SHA512_KEY *ctx, const uint8_t *key,
+                          int keyLength)
+ __attribute__((visibility("hidden")));
+
+void hmac_sha512_compute(const HMAC_SHA512_KEY *ctx,
+                         const uint8_t *data, int dataLength,
+                         uint8_t *result, int resultLength)
+ __attribute__((visibility("hidden")));
+
+void hmac_sha512_counter(const HMAC_SHA512_KEY *ctx, uint64_t counter,
+                         uint8_t result[SHA512_DIGEST_LENGTH])
+ __attribute__((visibility("hidden")));
+
+void hmac_sha512(const uint8_t *key, int keyLength,
+                 const uint8_t *data, int dataLength,
+                 uint8_t *result, int resultLength)
+ __attribute__((visibility("hidden")));
+
 #endif /* _HMAC_H_ */
@@ -0,0 +1,454 @@
+// Load generator for the PAM module. This is part of the Google Authenticator
+// project.
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Forks a number of workers that all log in as the same user at the same
+// time, and reports how many of these logins failed for no good reason. This
+// is what happens, when a user opens many sessions at once.
+
+#include <assert.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pwd.h>
+#include <security/pam_appl.h>
+#include <security/pam_modules.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "base32.h"
+#include "hmac.h"
+#include "sha1.h"
+
+#if !defined(PAM_BAD_ITEM)
+#define PAM_BAD_ITEM PAM_SYMBOL_ERR
+#endif
+
+#define MAX_ARGS    16
+#define MAX_WORKERS 1024
+
+static const char secret[] = "2SH3V3GDW7ZNMGYE";
+static char username[256];
+static char response[16];
+
+// Outcomes of a login attempt. "Spurious" failures are logins with a valid
+// code that were denied, because another login was updating the secret file
+// at the same time.
+enum { SUCCESS, SPURIOUS, RATE_LIMITED, OTHER, NUM_OUTCOMES };
+static const char *outcome_names[] = {
+  "succeeded", "failed spuriously", "were rate limited", "failed otherwise"
+};
+
+// Results that a worker sends back to the parent process.
+typedef struct Summary {
+  unsigned long counts[NUM_OUTCOMES];
+  unsigned long num_latencies;
+  char          first_error[128];
+} Summary;
+
+static int conversation(int num_msg, const struct pam_message **msg,
+                        struct pam_response **resp, void *appdata_ptr) {
+  if (num_msg == 1 && msg[0]->msg_style == PAM_PROMPT_ECHO_OFF) {
+    *resp = malloc(sizeof(struct pam_response));
+    assert(*resp);
+    (*resp)->resp = strdup(response);
+    (*resp)->resp_retcode = 0;
+    return PAM_SUCCESS;
+  }
+  return PAM_CONV_ERR;
+}
+
+#ifdef sun
+#define PAM_CONST
+#else
+#define PAM_CONST const
+#endif
+int pam_get_item(const pam_handle_t *pamh, int item_type,
+                 PAM_CONST void **item) {
+  switch (item_type) {
+    case PAM_SERVICE: {
+      static const char *service = "google_authenticator_loadtest";
+      memcpy(item, &service, sizeof(service));
+      return PAM_SUCCESS;
+    }
+    case PAM_USER: {
+      char *user = username;
+      memcpy(item, &user, sizeof(user));
+      return PAM_SUCCESS;
+    }
+    case PAM_CONV: {
+      static struct pam_conv conv = { .conv = conversation }, *p_conv = &conv;
+      memcpy(item, &p_conv, sizeof(p_conv));
+      return PAM_SUCCESS;
+    }
+    default:
+      return PAM_BAD_ITEM;
+  }
+}
+
+int pam_set_item(pam_handle_t *pamh, int item_type,
+                 PAM_CONST void *item) {
+  switch (item_type) {
+    case PAM_AUTHTOK:
+      return PAM_SUCCESS;
+    default:
+      return PAM_BAD_ITEM;
+  }
+}
+
+// Each worker is a single PAM transaction that gets repeated many times.
+static struct {
+  const char *name;
+  void       *data;
+  void       (*cleanup)(pam_handle_t *pamh, void *data, int error_status);
+} pam_data[4];
+
+int pam_set_data(pam_handle_t *pamh, const char *module_data_name,
+                 void *data, void (*cleanup)(pam_handle_t *pamh, void *data,
+                                             int error_status)) {
+  for (int i = 0; i < sizeof(pam_data)/sizeof(*pam_data); ++i) {
+    if (!pam_data[i].name || !strcmp(pam_data[i].name, module_data_name)) {
+      if (pam_data[i].cleanup) {
+        pam_data[i].cleanup(pamh, pam_data[i].data, 0);
+      }
+      pam_data[i].name = module_data_name;
+      pam_data[i].data = data;
+      pam_data[i].cleanup = cleanup;
+      return PAM_SUCCESS;
+    }
+  }
+  return PAM_BUF_ERR;
+}
+
+int pam_get_data(const pam_handle_t *pamh, const char *module_data_name,
+                 const void **data) {
+  for (int i = 0; i < sizeof(pam_data)/sizeof(*pam_data); ++i) {
+    if (pam_data[i].name && !strcmp(pam_data[i].name, module_data_name)) {
+      *data = pam_data[i].data;
+      return PAM_SUCCESS;
+    }
+  }
+  return PAM_NO_MODULE_DATA;
+}
+
+static unsigned long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+// Computes the verification code for the current time.
+static int current_code(const uint8_t *key, int keyLen) {
+  uint8_t hash[SHA1_DIGEST_LENGTH];
+  HMAC_SHA1_KEY ctx;
+  hmac_sha1_init_key(&ctx, key, keyLen);
+  hmac_sha1_counter(&ctx, time(NULL)/30, hash);
+  hmac_sha1_clear_key(&ctx);
+  int offset = hash[SHA1_DIGEST_LENGTH - 1] & 0xF;
+  unsigned int truncatedHash = 0;
+  for (int i = 0; i < 4; ++i) {
+    truncatedHash = (truncatedHash << 8) | hash[offset + i];
+  }
+  return (truncatedHash & 0x7FFFFFFF) % 1000000;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+  for (const char *ptr = buf; len > 0; ) {
+    ssize_t rc = write(fd, ptr, len);
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    ptr += rc;
+    len -= rc;
+  }
+  return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+  for (char *ptr = buf; len > 0; ) {
+    ssize_t rc = read(fd, ptr, len);
+    if (rc <= 0) {
+      if (rc < 0 && errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    ptr += rc;
+    len -= rc;
+  }
+  return 0;
+}
+
+// Logs in over and over again until the deadline, then sends a Summary and
+// all latencies (in nanoseconds) to "out".
+static void worker(int start, int out, int argc, const char **argv,
+                   double duration, double pause) {
+  extern int pam_sm_open_session(pam_handle_t *, int, int, const char **);
+  extern const char *get_error_msg(void);
+  uint8_t key[sizeof(secret)];
+  int keyLen = base32_decode((const uint8_t *)secret, key, sizeof(key));
+  Summary summary = { { 0 } };
+  size_t max_latencies = 1024;
+  unsigned long long *latencies = malloc(max_latencies*sizeof(*latencies));
+  assert(latencies);
+
+  // Wait for all workers to be ready.
+  char ch;
+  read(start, &ch, 1);
+  close(start);
+
+  unsigned long long deadline = now_ns() + duration*1e9;
+  for (unsigned long long t = now_ns(); t < deadline; ) {
+    sprintf(response, "%06d", current_code(key, keyLen));
+    int rc = pam_sm_open_session(NULL, 0, argc, argv);
+    unsigned long long done = now_ns();
+    int outcome;
+    if (rc == PAM_SUCCESS) {
+      outcome = SUCCESS;
+    } else if (strstr(get_error_msg(), "changed while") ||
+               strstr(get_error_msg(), "Failed to update") ||
+               strstr(get_error_msg(), "Timed out waiting")) {
+      outcome = SPURIOUS;
+    } else if (strstr(get_error_msg(), "Too many concurrent")) {
+      outcome = RATE_LIMITED;
+    } else {
+      outcome = OTHER;
+      if (!*summary.first_error) {
+        snprintf(summary.first_error, sizeof(summary.first_error), "%s",
+                 get_error_msg());
+      }
+    }
+    ++summary.counts[outcome];
+    if (summary.num_latencies == max_latencies) {
+      max_latencies *= 2;
+      latencies = realloc(latencies, max_latencies*sizeof(*latencies));
+      assert(latencies);
+    }
+    latencies[summary.num_latencies++] = done - t;
+    if (pause > 0) {
+      struct timespec ts = { (time_t)pause, (pause - (time_t)pause)*1e9 };
+      nanosleep(&ts, NULL);
+      done = now_ns();
+    }
+    t = done;
+  }
+  if (write_all(out, &summary, sizeof(summary)) ||
+      write_all(out, latencies, summary.num_latencies*sizeof(*latencies))) {
+    _exit(1);
+  }
+  _exit(0);
+}
+
+static int compare_latencies(const void *a, const void *b) {
+  unsigned long long x = *(const unsigned long long *)a;
+  unsigned long long y = *(const unsigned long long *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void usage(void) {
+  puts(
+ "loadtest [<options>]\n"
+ " -a, --arg=<arg>            Pass an argument to the PAM module\n"
+ " -d, --duration=<seconds>   Run for this long (default 10)\n"
+ " -h, --help                 Print this message\n"
+ " -n, --workers=<N>          Number of concurrent processes (default 8)\n"
+ " -o, --option=<option>      Add an option to the secret file\n"
+ "                            (default \"RATE_LIMIT 100 1\")\n"
+ " -p, --pause=<seconds>      Time each worker waits between logins\n"
+ "\n"
+ "All workers log in as the current user. The secret file is created in a\n"
+ "temporary location, and \"secret=\" is passed to the PAM module.");
+}
+
+int main(int argc, char *argv[]) {
+  static const struct option options[] = {
+    { "arg",      1, 0, 'a' },
+    { "duration", 1, 0, 'd' },
+    { "help",     0, 0, 'h' },
+    { "workers",  1, 0, 'n' },
+    { "option",   1, 0, 'o' },
+    { "pause",    1, 0, 'p' },
+    { 0,          0, 0,  0  }
+  };
+  const char *args[MAX_ARGS + 1];
+  const char *file_options[MAX_ARGS];
+  int num_args = 1, num_options = 0, num_workers = 8;
+  double duration = 10, pause = 0;
+  for (;;) {
+    int c = getopt_long(argc, argv, "a:d:hn:o:p:", options, NULL);
+    if (c == -1) {
+      break;
+    }
+    char *endptr;
+    switch (c) {
+    case 'a':
+      if (num_args == MAX_ARGS) {
+        fprintf(stderr, "Too many arguments\n");
+        exit(1);
+      }
+      args[num_args++] = optarg;
+      break;
+    case 'd':
+      duration = strtod(optarg, &endptr);
+      if (*endptr || duration <= 0) {
+        fprintf(stderr, "Invalid duration \"%s\"\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'h':
+      usage();
+      exit(0);
+    case 'n':
+      num_workers = (int)strtol(optarg, &endptr, 10);
+      if (*endptr || num_workers < 1 || num_workers > MAX_WORKERS) {
+        fprintf(stderr, "-n requires an argument in the range 1..%d\n",
+                MAX_WORKERS);
+        exit(1);
+      }
+      break;
+    case 'o':
+      if (num_options == MAX_ARGS) {
+        fprintf(stderr, "Too many options\n");
+        exit(1);
+      }
+      file_options[num_options++] = optarg;
+      break;
+    case 'p':
+      pause = strtod(optarg, &endptr);
+      if (*endptr || pause < 0) {
+        fprintf(stderr, "Invalid pause \"%s\"\n", optarg);
+        exit(1);
+      }
+      break;
+    default:
+      usage();
+      exit(1);
+    }
+  }
+  if (optind != argc) {
+    usage();
+    exit(1);
+  }
+  if (!num_options) {
+    file_options[num_options++] = "RATE_LIMIT 100 1";
+  }
+  struct passwd *pw = getpwuid(getuid());
+  if (!pw || strlen(pw->pw_name) >= sizeof(username)) {
+    fprintf(stderr, "Cannot determine user name\n");
+    exit(1);
+  }
+  strcpy(username, pw->pw_name);
+
+  // Create a secret file, and tell the PAM module where to find it.
+  char fn[] = "/tmp/.google_authenticator_loadtest_XXXXXX";
+  int fd = mkstemp(fn);
+  if (fd < 0) {
+    perror("mkstemp()");
+    exit(1);
+  }
+  FILE *file = fdopen(fd, "w");
+  fprintf(file, "%s\n\" TOTP_AUTH\n", secret);
+  for (int i = 0; i < num_options; ++i) {
+    fprintf(file, "\" %s\n", file_options[i]);
+  }
+  if (fclose(file) || chmod(fn, 0400)) {
+    perror(fn);
+    unlink(fn);
+    exit(1);
+  }
+  char secret_arg[sizeof(fn) + 8];
+  args[0] = strcat(strcpy(secret_arg, "secret="), fn);
+  args[num_args] = NULL;
+
+  // Start all workers, then release them at the same time.
+  int start[2];
+  assert(!pipe(start));
+  int results[MAX_WORKERS];
+  pid_t pids[MAX_WORKERS];
+  for (int i = 0; i < num_workers; ++i) {
+    int out[2];
+    assert(!pipe(out));
+    fflush(stdout);
+    if (!(pids[i] = fork())) {
+      close(start[1]);
+      close(out[0]);
+      worker(start[0], out[1], num_args, args, duration, pause);
+    }
+    assert(pids[i] > 0);
+    close(out[1]);
+    results[i] = out[0];
+  }
+  close(start[0]);
+  unsigned long long begin = now_ns();
+  close(start[1]);
+
+  // Collect the results.
+  Summary total = { { 0 } };
+  unsigned long long *latencies = NULL;
+  for (int i = 0; i < num_workers; ++i) {
+    Summary summary;
+    if (read_all(results[i], &summary, sizeof(summary))) {
+      fprintf(stderr, "Worker %d failed\n", i);
+      exit(1);
+    }
+    latencies = realloc(latencies, (total.num_latencies +
+                                    summary.num_latencies)*sizeof(*latencies));
+    assert(latencies || !(total.num_latencies + summary.num_latencies));
+    if (read_all(results[i], latencies + total.num_latencies,
+                 summary.num_latencies*sizeof(*latencies))) {
+      fprintf(stderr, "Worker %d failed\n", i);
+      exit(1);
+    }
+    close(results[i]);
+    for (int j = 0; j < NUM_OUTCOMES; ++j) {
+      total.counts[j] += summary.counts[j];
+    }
+    total.num_latencies += summary.num_latencies;
+    if (!*total.first_error) {
+      memcpy(total.first_error, summary.first_error,
+             sizeof(total.first_error));
+    }
+    waitpid(pids[i], NULL, 0);
+  }
+  double elapsed = (now_ns() - begin)/1e9;
+  unlink(fn);
+
+  unsigned long n = total.num_latencies;
+  printf("%lu logins by %d workers in %.1fs: %.0f logins/s\n",
+         n, num_workers, elapsed, n/elapsed);
+  for (int i = 0; i < NUM_OUTCOMES; ++i) {
+    printf("  %8lu (%5.1f%%) %s\n", total.counts[i],
+           n ? 100.0*total.counts[i]/n : 0.0, outcome_names[i]);
+  }
+  if (*total.first_error) {
+    printf("  First other failure: %s\n", total.first_error);
+  }
+  if (n) {
+    qsort(latencies, n, sizeof(*latencies), compare_latencies);
+    printf("Latency: p50 %.3fms, p99 %.3fms, max %.3fms\n",
+           latencies[n/2]/1e6, latencies[n*99/100]/1e6, latencies[n - 1]/1e6);
+  }
+  free(latencies);
+  return 0;
+}
@@ -19,13 +19,19 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <syslog.h>
 #include <time.h>
 #include <unistd.h>
@@ -45,18 +51,61 @@
 #define LOG_AUTHPRIV LOG_AUTH
 #endif
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#ifndef MSG_DONTWAIT
+#define MSG_DONTWAIT 0
+#endif
+
+#ifndef _PATH_LOG
+#define _PATH_LOG "/dev/log"
+#endif
+
+#ifndef O_DIRECTORY
+#define O_DIRECTORY 0
+#endif
+
+// Opening a directory with O_RDONLY requires read permission, but we only
+// need to search it.
+#if defined(O_PATH)
+#define O_DIR_SEARCH (O_PATH|O_DIRECTORY)
+#elif defined(O_SEARCH)
+#define O_DIR_SEARCH (O_SEARCH|O_DIRECTORY)
+#else
+#define O_DIR_SEARCH (O_RDONLY|O_DIRECTORY)
+#endif
+
 #define PAM_SM_AUTH
 #define PAM_SM_SESSION
 #include <security/pam_appl.h>
 #include <security/pam_modules.h>
 
 #include "base32.h"
+#include "google-authenticatord.h"
 #include "hmac.h"
+#include "secret_state.h"
 #include "sha1.h"
+#include "sha1_mb.h"
+#include "sha256.h"
+#include "sha512.h"
 
 #define MODULE_NAME "pam_google_authenticator"
 #define SECRET      "~/.google_authenticator"
 
+// Long-lived processes (e.g. sshd, or google-authenticatord) remember user
+// database lookups for PASSWD_CACHE_TTL seconds. Looking up users can be
+// slow, if NSS talks to a directory server.
+#define PASSWD_CACHE_SIZE 16
+#define PASSWD_CACHE_TTL  60
+
+// Concurrent logins take turns updating the secret file. Nobody waits longer
+// than LOCK_TIMEOUT_MS for the lock, and a login that lost the race to an
+// uncooperative writer is only re-evaluated MAX_PASSES times.
+#define LOCK_TIMEOUT_MS 2000
+#define MAX_PASSES      3
+
 typedef struct Params {
   const char *secret_filename_spec;
   enum { NULLERR=0, NULLOK, SECRETNOTFOUND } nullok;
@@ -66,9 +115,65 @@ typedef struct Params {
   uid_t      uid;
   enum { PROMPT = 0, TRY_FIRST_PASS, USE_FIRST_PASS } pass_mode;
   int        forward_pass;
+  const char *daemon_socket;
+  int        timing;
+  int        log_rate_limit;
+  int        verify_session;
+  int        skew_search_range;
+  int        hotp_resync;
 } Params;
 
-static char oom;
+// With the "timing" option, we measure how long each phase of a login takes,
+// and report all of them in a single log message. Phases that run more than
+// once, e.g. when the secret file has to be read again, accumulate.
+enum { T_USER, T_PRIVS, T_READ, T_SETUP, T_PROMPT, T_VERIFY, T_WRITE,
+       NUM_PHASES };
+static const char *phase_names[NUM_PHASES] = {
+  "user", "privs", "read", "setup", "prompt", "verify", "write"
+};
+
+typedef struct Timing {
+  int             enabled;
+  struct timespec start, last;
+  long long       ns[NUM_PHASES];
+} Timing;
+
+// Identifies a particular version of the secret file. Two logins within the
+// same second can easily leave a file with the same size and st_mtime, so
+// we also look at the sub-second timestamps, at the inode (text files get
+// replaced by rename()), and at the ctime (which cannot be set from user
+// space).
+typedef struct FileStamp {
+  off_t           size;
+  dev_t           dev;
+  ino_t           ino;
+  struct timespec mtime;
+  struct timespec ctime;
+} FileStamp;
+
+// The HMAC key and the code format that are used to compute verification
+// codes. SHA1 with six digits is the default. RFC 6238 also allows SHA256
+// and SHA512, and codes that are up to eight digits long.
+typedef struct CodeTable CodeTable;
+
+typedef struct OtpKey {
+  enum { OTP_SHA1 = 0, OTP_SHA256, OTP_SHA512 } algorithm;
+  int        digits;
+  int        modulus;
+  union {
+    HMAC_SHA1_KEY   sha1;
+    HMAC_SHA256_KEY sha256;
+    HMAC_SHA512_KEY sha512;
+  } hmac;
+
+  // Identifies the secret, without revealing it. Used as the key for the
+  // cache of precomputed codes.
+  uint8_t    fingerprint[SHA256_DIGEST_LENGTH];
+
+  // Precomputed codes for this key, if the caller owns SKEW_WINDOWS tables.
+  // Otherwise, the tables shared by the whole process are used.
+  CodeTable  *table;
+} OtpKey;
 
 #if defined(DEMO) || defined(TESTING)
 static char error_msg[128];
@@ -77,25 +182,171 @@ const char *get_error_msg(void) __attribute__((visibility("default")));
 const char *get_error_msg(void) {
   return error_msg;
 }
+#elif defined(DAEMON)
+// google-authenticatord handles each request in its own thread, and sends
+// the first error message back to the PAM module.
+static __thread char error_msg[128];
 #endif
 
-static void log_message(int priority, pam_handle_t *pamh,
-                        const char *format, ...) {
-  char *service = NULL;
-  if (pamh)
-    pam_get_item(pamh, PAM_SERVICE, (void *)&service);
-  if (!service)
-    service = "";
+#if !defined(DEMO) && !defined(TESTING)
+// Log messages go straight to the local syslog socket. It is opened once, and
+// then stays open until the module gets unloaded. Unlike openlog(), this
+// does not change how the application's own messages get logged. Sending
+// never blocks; if syslogd cannot keep up, messages get dropped rather than
+// slowing down authentication.
+static int      log_fd = -1;
+static dev_t    log_dev;
+static ino_t    log_ino;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Optionally, we log at most "log_rate_limit" messages per second. This is
+// a property of the process, as log storms affect all logins equally.
+static int      log_rate_limit;
+static time_t   log_second;
+static unsigned log_count, log_suppressed;
+
+// Returns non-zero, if "log_fd" still is the socket that we opened. The
+// application might have closed all of its file descriptors, and then reused
+// the number for something else. Must be called with "log_mutex" held.
+static int is_log_socket(void) {
+  struct stat sb;
+  return log_fd >= 0 && !fstat(log_fd, &sb) && S_ISSOCK(sb.st_mode) &&
+         sb.st_dev == log_dev && sb.st_ino == log_ino;
+}
+
+// Must be called with "log_mutex" held.
+static void close_log_socket_locked(void) {
+  if (is_log_socket()) {
+    close(log_fd);
+  }
+  log_fd = -1;
+}
+
+// Returns our syslog socket, opening it if necessary. Must be called with
+// "log_mutex" held.
+static int get_log_socket(void) {
+  if (!is_log_socket()) {
+    log_fd = -1;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, _PATH_LOG, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd < 0) {
+      return -1;
+    }
+    struct stat sb;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        fstat(fd, &sb) < 0) {
+      close(fd);
+      return -1;
+    }
+    log_fd  = fd;
+    log_dev = sb.st_dev;
+    log_ino = sb.st_ino;
+  }
+  return log_fd;
+}
+
+// Linux-PAM unloads the module in pam_end(). Long-running applications
+// would otherwise leak a socket for each PAM transaction.
+static void close_log_socket(void) __attribute__((destructor));
+static void close_log_socket(void) {
+  pthread_mutex_lock(&log_mutex);
+  close_log_socket_locked();
+  pthread_mutex_unlock(&log_mutex);
+}
+
+static void send_log_message(int priority, const char *logname,
+                             const char *msg) {
+  // Format the message the same way that syslog() would.
+  char buf[1024], timestamp[32];
+  time_t now = time(NULL);
+  struct tm tm;
+  strftime(timestamp, sizeof(timestamp), "%h %e %T", localtime_r(&now, &tm));
+  int len = snprintf(buf, sizeof(buf), "<%d>%s %s[%d]: %s",
+                     LOG_AUTHPRIV | priority, timestamp, logname,
+                     (int)getpid(), msg);
+  if (len >= (int)sizeof(buf)) {
+    len = sizeof(buf) - 1;
+  }
+
+  // If syslogd was restarted, connect to the new socket and try again.
+  pthread_mutex_lock(&log_mutex);
+  for (int i = 0; i < 2; ++i) {
+    int fd = get_log_socket();
+    if (fd < 0) {
+      break;
+    }
+    if (send(fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) >= 0 ||
+        errno == EAGAIN || errno == EWOULDBLOCK) {
+      pthread_mutex_unlock(&log_mutex);
+      return;
+    }
+    close_log_socket_locked();
+  }
+  pthread_mutex_unlock(&log_mutex);
+
+  // There is no usable syslog socket. Let the C library deal with it.
+  openlog(logname, LOG_CONS | LOG_PID, LOG_AUTHPRIV);
+  syslog(priority, "%s", msg);
+  closelog();
+}
 
-  char logname[80];
-  snprintf(logname, sizeof(logname), "%s(" MODULE_NAME ")", service);
+// Returns the number of messages that were suppressed in the previous
+// second, plus one, if the current message can be logged; or zero if it has
+// to be suppressed.
+static unsigned check_log_rate_limit(void) {
+  if (log_rate_limit <= 0) {
+    return 1;
+  }
+  time_t now = time(NULL);
+  time_t second = log_second;
+  if (now != second &&
+      __sync_bool_compare_and_swap(&log_second, second, now)) {
+    // Other threads might be counting their messages at the same time.
+    __sync_lock_test_and_set(&log_count, 1);
+    return __sync_fetch_and_and(&log_suppressed, 0) + 1;
+  }
+  if (__sync_add_and_fetch(&log_count, 1) > (unsigned)log_rate_limit) {
+    __sync_fetch_and_add(&log_suppressed, 1);
+    return 0;
+  }
+  return 1;
+}
+#endif
 
+static void log_message(int priority, pam_handle_t *pamh,
+                        const char *format, ...) {
   va_list args;
   va_start(args, format);
 #if !defined(DEMO) && !defined(TESTING)
-  openlog(logname, LOG_CONS | LOG_PID, LOG_AUTHPRIV);
-  vsyslog(priority, format, args);
-  closelog();
+#ifdef DAEMON
+  if (!*error_msg) {
+    va_list copy;
+    va_copy(copy, args);
+    vsnprintf(error_msg, sizeof(error_msg), format, copy);
+    va_end(copy);
+  }
+#endif
+  unsigned rate = priority == LOG_EMERG ? 1 : check_log_rate_limit();
+  if (rate) {
+    char *service = NULL;
+    if (pamh)
+      pam_get_item(pamh, PAM_SERVICE, (void *)&service);
+    if (!service)
+      service = "";
+
+    char logname[80];
+    snprintf(logname, sizeof(logname), "%s(" MODULE_NAME ")", service);
+
+    char msg[512];
+    if (rate > 1) {
+      snprintf(msg, sizeof(msg), "Suppressed %u log messages", rate - 1);
+      send_log_message(LOG_WARNING, logname, msg);
+    }
+    vsnprintf(msg, sizeof(msg), format, args);
+    send_log_message(priority, logname, msg);
+  }
 #else
   if (!*error_msg) {
     vsnprintf(error_msg, sizeof(error_msg), format, args);
@@ -110,6 +361,51 @@ static void log_message(int priority, pam_handle_t *pamh,
   }
 }
 
+static long long elapsed_ns(const struct timespec *from,
+                            const struct timespec *to) {
+  return (to->tv_sec - from->tv_sec)*1000000000LL +
+         (to->tv_nsec - from->tv_nsec);
+}
+
+static void timing_start(Timing *timing) {
+  clock_gettime(CLOCK_MONOTONIC, &timing->start);
+  timing->last = timing->start;
+  timing->enabled = 1;
+}
+
+// Charges the time since the previous call to "phase". Always returns 1, so
+// that it can be used in the middle of a chain of conditions.
+static int timing_mark(Timing *timing, int phase) {
+  if (timing->enabled) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timing->ns[phase] += elapsed_ns(&timing->last, &now);
+    timing->last = now;
+  }
+  return 1;
+}
+
+// Logs all phases in microseconds, as "key=value" pairs. Time that was not
+// attributed to any phase (e.g. after an error) only shows up in "total".
+static void timing_report(pam_handle_t *pamh, const Timing *timing,
+                          int retries, int rc) {
+  if (!timing->enabled) {
+    return;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  char buf[256];
+  int len = snprintf(buf, sizeof(buf), "timing result=%s retries=%d",
+                     rc == PAM_SUCCESS ? "success" : "failure", retries);
+  for (int i = 0; i < NUM_PHASES; ++i) {
+    len += snprintf(buf + len, sizeof(buf) - len, " %s=%lld",
+                    phase_names[i], timing->ns[i]/1000);
+  }
+  snprintf(buf + len, sizeof(buf) - len, " total=%lld",
+           elapsed_ns(&timing->start, &now)/1000);
+  log_message(LOG_INFO, pamh, "%s", buf);
+}
+
 static int converse(pam_handle_t *pamh, int nargs,
                     const struct pam_message **message,
                     struct pam_response **response) {
@@ -133,6 +429,134 @@ static const char *get_user_name(pam_handle_t *pamh) {
   return username;
 }
 
+// The parts of a "struct passwd" that we care about. All strings are owned
+// by the UserInfo.
+typedef struct UserInfo {
+  char   *name;
+  uid_t  uid;
+  gid_t  gid;
+  char   *dir;
+  time_t expires;
+} UserInfo;
+
+static UserInfo passwd_cache[PASSWD_CACHE_SIZE];
+static pthread_mutex_t passwd_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static time_t get_time(void);
+
+static void clear_user_info(UserInfo *info) {
+  free(info->name);
+  free(info->dir);
+  memset(info, 0, sizeof(*info));
+}
+
+static int copy_user_info(UserInfo *dst, const char *name, uid_t uid,
+                          gid_t gid, const char *dir, time_t expires) {
+  memset(dst, 0, sizeof(*dst));
+  if (!(dst->name = strdup(name)) || !(dst->dir = strdup(dir ? dir : ""))) {
+    clear_user_info(dst);
+    return -1;
+  }
+  dst->uid = uid;
+  dst->gid = gid;
+  dst->expires = expires;
+  return 0;
+}
+
+// Forgets all cached user database entries. google-authenticatord calls
+// this, when it receives SIGHUP.
+void passwd_cache_flush(void) {
+  pthread_mutex_lock(&passwd_cache_mutex);
+  for (int i = 0; i < PASSWD_CACHE_SIZE; ++i) {
+    clear_user_info(&passwd_cache[i]);
+  }
+  pthread_mutex_unlock(&passwd_cache_mutex);
+}
+
+#ifdef TESTING
+static int passwd_lookups;
+
+// Returns the number of times that we had to ask the user database, and
+// optionally empties the cache.
+int get_passwd_lookups(int flush) __attribute__((visibility("default")));
+int get_passwd_lookups(int flush) {
+  if (flush) {
+    passwd_cache_flush();
+  }
+  return passwd_lookups;
+}
+#endif
+
+/* Looks up a user by "name", or by "uid" if "name" is NULL. On success,
+ * fills in "info", which the caller must release with clear_user_info().
+ * Returns -1, if the user cannot be found.
+ */
+static int get_user_info(const char *name, uid_t uid, UserInfo *info) {
+  // Entries are valid for PASSWD_CACHE_TTL seconds, even if the clock jumps.
+  time_t now = get_time();
+  pthread_mutex_lock(&passwd_cache_mutex);
+  for (int i = 0; i < PASSWD_CACHE_SIZE; ++i) {
+    UserInfo *entry = &passwd_cache[i];
+    if (entry->name && now < entry->expires &&
+        entry->expires - now <= PASSWD_CACHE_TTL &&
+        (name ? !strcmp(name, entry->name) : uid == entry->uid)) {
+      int rc = copy_user_info(info, entry->name, entry->uid, entry->gid,
+                              entry->dir, entry->expires);
+      pthread_mutex_unlock(&passwd_cache_mutex);
+      return rc;
+    }
+  }
+  pthread_mutex_unlock(&passwd_cache_mutex);
+
+  // Not in the cache. Ask the user database.
+  #ifdef _SC_GETPW_R_SIZE_MAX
+  int len = sysconf(_SC_GETPW_R_SIZE_MAX);
+  if (len <= 0) {
+    len = 4096;
+  }
+  #else
+  int len = 4096;
+  #endif
+  char *buf = malloc(len);
+  if (!buf) {
+    return -1;
+  }
+  struct passwd pwbuf, *pw = NULL;
+#ifdef TESTING
+  __sync_fetch_and_add(&passwd_lookups, 1);
+#endif
+  if ((name ? getpwnam_r(name, &pwbuf, buf, len, &pw)
+            : getpwuid_r(uid, &pwbuf, buf, len, &pw)) || !pw ||
+      copy_user_info(info, name ? name : pw->pw_name, pw->pw_uid,
+                     pw->pw_gid, pw->pw_dir, now + PASSWD_CACHE_TTL) < 0) {
+    free(buf);
+    return -1;
+  }
+  free(buf);
+
+  // Replace an empty or expired entry, or else the one that expires first.
+  // Failed lookups are never cached, so that new users can log in
+  // immediately.
+  pthread_mutex_lock(&passwd_cache_mutex);
+  UserInfo *victim = &passwd_cache[0];
+  for (int i = 0; i < PASSWD_CACHE_SIZE; ++i) {
+    UserInfo *entry = &passwd_cache[i];
+    if (!entry->name || now >= entry->expires ||
+        entry->expires - now > PASSWD_CACHE_TTL) {
+      victim = entry;
+      break;
+    }
+    if (entry->expires < victim->expires) {
+      victim = entry;
+    }
+  }
+  clear_user_info(victim);
+  copy_user_info(victim, info->name, info->uid, info->gid, info->dir,
+                 info->expires);
+  pthread_mutex_unlock(&passwd_cache_mutex);
+  return 0;
+}
+
 static char *get_secret_filename(pam_handle_t *pamh, const Params *params,
                                  const char *username, int *uid) {
   // Check whether the administrator decided to override the default location
@@ -141,28 +565,15 @@ static char *get_secret_filename(pam_handle_t *pamh, const Params *params,
     ? params->secret_filename_spec : SECRET;
 
   // Obtain the user's id and home directory
-  struct passwd pwbuf, *pw = NULL;
-  char *buf = NULL;
+  UserInfo info = { 0 }, *pw = NULL;
   char *secret_filename = NULL;
   if (!params->fixed_uid) {
-    #ifdef _SC_GETPW_R_SIZE_MAX
-    int len = sysconf(_SC_GETPW_R_SIZE_MAX);
-    if (len <= 0) {
-      len = 4096;
-    }
-    #else
-    int len = 4096;
-    #endif
-    buf = malloc(len);
     *uid = -1;
-    if (buf == NULL ||
-        getpwnam_r(username, &pwbuf, buf, len, &pw) ||
-        !pw ||
-        !pw->pw_dir ||
-        *pw->pw_dir != '/') {
+    if (get_user_info(username, 0, &info) < 0 ||
+        *(pw = &info)->dir != '/') {
     err:
       log_message(LOG_ERR, pamh, "Failed to compute location of secret file");
-      free(buf);
+      clear_user_info(&info);
       free(secret_filename);
       return NULL;
     }
@@ -183,7 +594,7 @@ static char *get_secret_filename(pam_handle_t *pamh, const Params *params,
       if (!pw) {
         goto err;
       }
-      subst = pw->pw_dir;
+      subst = pw->dir;
       var = cur;
     } else if (secret_filename[offset] == '$') {
       if (!memcmp(cur, "${HOME}", 7)) {
@@ -191,7 +602,7 @@ static char *get_secret_filename(pam_handle_t *pamh, const Params *params,
         if (!pw) {
           goto err;
         }
-        subst = pw->pw_dir;
+        subst = pw->dir;
         var = cur;
       } else if (!memcmp(cur, "${USER}", 7)) {
         var_len = 7;
@@ -218,8 +629,8 @@ static char *get_secret_filename(pam_handle_t *pamh, const Params *params,
     }
   }
 
-  *uid = params->fixed_uid ? params->uid : pw->pw_uid;
-  free(buf);
+  *uid = params->fixed_uid ? params->uid : pw->uid;
+  clear_user_info(&info);
   return secret_filename;
 }
 
@@ -266,27 +677,13 @@ static int drop_privileges(pam_handle_t *pamh, const char *username, int uid,
   // directories.
 
   // First, look up the user's default group
-  #ifdef _SC_GETPW_R_SIZE_MAX
-  int len = sysconf(_SC_GETPW_R_SIZE_MAX);
-  if (len <= 0) {
-    len = 4096;
-  }
-  #else
-  int len = 4096;
-  #endif
-  char *buf = malloc(len);
-  if (!buf) {
-    log_message(LOG_ERR, pamh, "Out of memory");
-    return -1;
-  }
-  struct passwd pwbuf, *pw;
-  if (getpwuid_r(uid, &pwbuf, buf, len, &pw) || !pw) {
+  UserInfo info;
+  if (get_user_info(NULL, uid, &info) < 0) {
     log_message(LOG_ERR, pamh, "Cannot look up user id %d", uid);
-    free(buf);
     return -1;
   }
-  gid_t gid = pw->pw_gid;
-  free(buf);
+  gid_t gid = info.gid;
+  clear_user_info(&info);
 
   int gid_o = setgroup(gid);
   int uid_o = setuser(uid);
@@ -322,15 +719,97 @@ static int drop_privileges(pam_handle_t *pamh, const char *username, int uid,
   return 0;
 }
 
+static void restore_privileges(pam_handle_t *pamh, int old_uid, int old_gid,
+                               int uid) {
+  if (old_gid >= 0) {
+    if (setgroup(old_gid) >= 0 && setgroup(old_gid) == old_gid) {
+      old_gid = -1;
+    }
+  }
+  if (old_uid >= 0) {
+    if (setuser(old_uid) < 0 || setuser(old_uid) != old_uid) {
+      log_message(LOG_EMERG, pamh, "We switched users from %d to %d, "
+                  "but can't switch back", old_uid, uid);
+    }
+  }
+}
+
+static void get_file_stamp(const struct stat *sb, FileStamp *stamp) {
+  memset(stamp, 0, sizeof(*stamp));
+  stamp->size  = sb->st_size;
+  stamp->dev   = sb->st_dev;
+  stamp->ino   = sb->st_ino;
+#if defined(__APPLE__)
+  stamp->mtime = sb->st_mtimespec;
+  stamp->ctime = sb->st_ctimespec;
+#else
+  stamp->mtime = sb->st_mtim;
+  stamp->ctime = sb->st_ctim;
+#endif
+}
+
+static int same_file_stamp(const FileStamp *a, const FileStamp *b) {
+  return a->size == b->size &&
+         a->dev == b->dev &&
+         a->ino == b->ino &&
+         a->mtime.tv_sec == b->mtime.tv_sec &&
+         a->mtime.tv_nsec == b->mtime.tv_nsec &&
+         a->ctime.tv_sec == b->ctime.tv_sec &&
+         a->ctime.tv_nsec == b->ctime.tv_nsec;
+}
+
+// Returns the name of the secret file relative to "dir_fd". This is the last
+// component of "secret_filename", unless open_secret_dir() had to fall back
+// to AT_FDCWD.
+static const char *secret_file_name(int dir_fd, const char *secret_filename) {
+  const char *slash = strrchr(secret_filename, '/');
+  return slash && dir_fd != AT_FDCWD ? slash + 1 : secret_filename;
+}
+
+// Opens the directory that holds the secret file. All other file operations
+// are relative to this directory. That way, the kernel only has to resolve
+// the (possibly automounted) path once per login, and somebody replacing one
+// of the parent directories half-way through cannot redirect us to a
+// different file.
+// Without O_PATH or O_SEARCH, directories that we may search, but not read,
+// cannot be opened. We then return AT_FDCWD, and use the full path name.
+static int open_secret_dir(const char *secret_filename) {
+  const char *slash = strrchr(secret_filename, '/');
+  char *dir = !slash
+    ? strdup(".")
+    : strndup(secret_filename,
+              slash > secret_filename ? slash - secret_filename : 1);
+  if (!dir) {
+    return -1;
+  }
+  int fd = open(dir, O_DIR_SEARCH);
+  int err = errno;
+  free(dir);
+  if (fd >= 0) {
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  } else if (err == EACCES) {
+    return AT_FDCWD;
+  }
+  errno = err;
+  return fd;
+}
+
+// Opens the secret file, and checks its permissions. The caller passes in
+// a "dir_fd" of -1, and must close the directory that is returned in it,
+// even if opening the file failed.
 static int open_secret_file(pam_handle_t *pamh, const char *secret_filename,
-                            struct Params *params, const char *username,
-                            int uid, off_t *size, time_t *mtime) {
+                            int *dir_fd, struct Params *params,
+                            const char *username, int uid, FileStamp *stamp) {
   // Try to open "~/.google_authenticator"
-  *size = 0;
-  *mtime = 0;
-  int fd = open(secret_filename, O_RDONLY);
+  memset(stamp, 0, sizeof(*stamp));
+  int fd = -1;
   struct stat sb;
-  if (fd < 0 ||
+  if (*dir_fd == -1) {
+    *dir_fd = open_secret_dir(secret_filename);
+  }
+  if (*dir_fd == -1 ||
+      (fd = openat(*dir_fd, secret_file_name(*dir_fd, secret_filename),
+                   O_RDONLY)) < 0 ||
       fstat(fd, &sb) < 0) {
     if (params->nullok != NULLERR && errno == ENOENT) {
       // The user doesn't have a state file, but the admininistrator said
@@ -369,30 +848,51 @@ static int open_secret_file(pam_handle_t *pamh, const char *secret_filename,
     goto error;
   }
 
-  *size = sb.st_size;
-  *mtime = sb.st_mtime;
+  get_file_stamp(&sb, stamp);
   return fd;
 }
 
-static char *read_file_contents(pam_handle_t *pamh,
-                                const char *secret_filename, int *fd,
-                                off_t filesize) {
-  // Read file contents
-  char *buf = malloc(filesize + 1);
-  if (!buf ||
-      read(*fd, buf, filesize) != filesize) {
-    close(*fd);
-    *fd = -1;
+/* Reads the secret file, and parses it into "state". Returns -1 on error,
+ * and 0 on success. "state" must be cleared in either case.
+ */
+static int read_file_contents(pam_handle_t *pamh, SecretState *state,
+                              const char *secret_filename, int *fd,
+                              off_t filesize) {
+  // Map the file into memory. Binary files can be parsed in place, text
+  // files need a copy that is NUL terminated.
+  char *buf = NULL;
+  char *map = mmap(NULL, filesize, PROT_READ, MAP_SHARED, *fd, 0);
+  close(*fd);
+  *fd = -1;
+  if (map == MAP_FAILED) {
     log_message(LOG_ERR, pamh, "Could not read \"%s\"", secret_filename);
+    return -1;
+  }
+  if (secret_state_is_binary(map, filesize)) {
+    int rc = secret_state_parse_binary(state, map, filesize);
+    munmap(map, filesize);
+    if (rc > 0) {
+      log_message(LOG_ERR, pamh, "Invalid file contents in \"%s\"",
+                  secret_filename);
+    } else if (rc < 0) {
+      log_message(LOG_ERR, pamh, "Out of memory");
+    }
+    return rc ? -1 : 0;
+  }
+  buf = malloc(filesize + 1);
+  if (buf) {
+    memcpy(buf, map, filesize);
+  }
+  munmap(map, filesize);
+  if (!buf) {
+    log_message(LOG_ERR, pamh, "Out of memory");
  error:
     if (buf) {
       memset(buf, 0, filesize);
       free(buf);
     }
-    return NULL;
+    return -1;
   }
-  close(*fd);
-  *fd = -1;
 
   // The rest of the code assumes that there are no NUL bytes in the file.
   if (memchr(buf, 0, filesize)) {
@@ -404,61 +904,185 @@ static char *read_file_contents(pam_handle_t *pamh,
   // Terminate the buffer with a NUL byte.
   buf[filesize] = '\000';
 
-  return buf;
+  // Parse all lines in a single pass. From here on, we only work with the
+  // parsed state.
+  if (secret_state_parse(state, buf) < 0) {
+    log_message(LOG_ERR, pamh, "Out of memory");
+    goto error;
+  }
+  memset(buf, 0, filesize);
+  free(buf);
+  return 0;
 }
 
-static int is_totp(const char *buf) {
-  return !!strstr(buf, "\" TOTP_AUTH");
+// Acquires an exclusive advisory lock on the secret file, and returns the
+// file descriptor that holds it. Text files get replaced by rename(), so
+// once we have the lock, we have to check that it still belongs to the file
+// that is currently installed. Returns -1 on error, or if the lock could not
+// be acquired within LOCK_TIMEOUT_MS.
+static int lock_secret_file(pam_handle_t *pamh, int dir_fd,
+                            const char *secret_filename) {
+  const char *name = secret_file_name(dir_fd, secret_filename);
+  long waited = 0, delay = 1000000;
+  int fd;
+  while ((fd = openat(dir_fd, name, O_RDONLY|O_NOFOLLOW)) >= 0) {
+    // flock() cannot time out by itself, and a PAM module should not mess
+    // with signals. Poll with exponential backoff instead.
+    while (flock(fd, LOCK_EX|LOCK_NB) < 0) {
+      if (errno != EWOULDBLOCK && errno != EINTR) {
+        goto error;
+      }
+      if (waited >= LOCK_TIMEOUT_MS*1000000L) {
+        log_message(LOG_ERR, pamh,
+                    "Timed out waiting to lock secret file \"%s\"",
+                    secret_filename);
+        close(fd);
+        return -1;
+      }
+      struct timespec ts = { 0, delay };
+      nanosleep(&ts, NULL);
+      waited += delay;
+      if (delay < 64000000) {
+        delay *= 2;
+      }
+    }
+    struct stat fd_sb, sb;
+    if (fstat(fd, &fd_sb) < 0 || fstatat(dir_fd, name, &sb, 0) < 0) {
+      goto error;
+    }
+    if (fd_sb.st_dev == sb.st_dev && fd_sb.st_ino == sb.st_ino) {
+      return fd;
+    }
+
+    // The file was replaced, while we were waiting. Lock the new one.
+    close(fd);
+  }
+ error:
+  if (fd >= 0) {
+    close(fd);
+  }
+  log_message(LOG_ERR, pamh, "Failed to lock secret file \"%s\"",
+              secret_filename);
+  return -1;
 }
 
-static int write_file_contents(pam_handle_t *pamh, const char *secret_filename,
-                               off_t old_size, time_t old_mtime,
-                               const char *buf) {
-  // Safely overwrite the old secret file.
-  char *tmp_filename = malloc(strlen(secret_filename) + 2);
-  if (tmp_filename == NULL) {
- removal_failure:
+// Binary files are updated in place. They keep track of their own sequence
+// number, which takes the place of the FileStamp checks for text files.
+static int write_binary_file(pam_handle_t *pamh, int dir_fd,
+                             const char *secret_filename,
+                             SecretState *state, FileStamp *new_stamp) {
+  int fd = openat(dir_fd, secret_file_name(dir_fd, secret_filename),
+                  O_RDWR|O_NOFOLLOW);
+  if (fd < 0) {
     log_message(LOG_ERR, pamh, "Failed to update secret file \"%s\"",
                 secret_filename);
     return -1;
   }
+  int rc = secret_state_update_binary(state, fd);
+  struct stat sb;
+  if (!rc && new_stamp) {
+    if (fstat(fd, &sb) < 0) {
+      rc = -1;
+    } else {
+      get_file_stamp(&sb, new_stamp);
+    }
+  }
+  close(fd);
+  if (rc < 0) {
+    log_message(LOG_ERR, pamh, "Failed to update secret file \"%s\"",
+                secret_filename);
+  }
+  return rc;
+}
 
-  strcat(strcpy(tmp_filename, secret_filename), "~");
-  int fd = open(tmp_filename,
-                O_WRONLY|O_CREAT|O_NOFOLLOW|O_TRUNC|O_EXCL, 0400);
-  if (fd < 0) {
-    goto removal_failure;
+/* Writes "state" back to the secret file, while holding the lock in
+ * "lock_fd". The lock is acquired first, if the caller doesn't hold it yet;
+ * either way, it stays held until the caller closes "lock_fd". Returns 0 on
+ * success, -1 on error, and 1 if somebody else changed the file after we
+ * read it. In the latter case, the caller must read the file again, and
+ * re-evaluate the login attempt. "dir_fd" is the directory returned by
+ * open_secret_file(). On success, "new_stamp" (if not NULL) describes the
+ * file that was written.
+ */
+static int write_file_contents(pam_handle_t *pamh, int dir_fd,
+                               const char *secret_filename,
+                               int *lock_fd, const FileStamp *old_stamp,
+                               SecretState *state, FileStamp *new_stamp) {
+  if (*lock_fd < 0 &&
+      (*lock_fd = lock_secret_file(pamh, dir_fd, secret_filename)) < 0) {
+    return -1;
+  }
+  if (state->binary) {
+    return write_binary_file(pamh, dir_fd, secret_filename, state,
+                             new_stamp);
   }
 
   // Make sure the secret file is still the same. This prevents attackers
   // from opening a lot of pending sessions and then reusing the same
   // scratch code multiple times.
+  const char *name = secret_file_name(dir_fd, secret_filename);
   struct stat sb;
-  if (stat(secret_filename, &sb) != 0 ||
-      sb.st_size != old_size ||
-      sb.st_mtime != old_mtime) {
-    log_message(LOG_ERR, pamh,
-                "Secret file \"%s\" changed while trying to use "
-                "scratch code\n", secret_filename);
-    unlink(tmp_filename);
-    free(tmp_filename);
-    close(fd);
+  if (fstatat(dir_fd, name, &sb, 0) != 0) {
+    log_message(LOG_ERR, pamh, "Failed to update secret file \"%s\"",
+                secret_filename);
     return -1;
   }
+  FileStamp stamp;
+  get_file_stamp(&sb, &stamp);
+  if (!same_file_stamp(&stamp, old_stamp)) {
+    return 1;
+  }
+
+  // Serialize the parsed state. Unchanged lines are written back verbatim.
+  char *buf = secret_state_serialize(state);
+  if (buf == NULL) {
+    log_message(LOG_ERR, pamh, "Out of memory");
+    return -1;
+  }
+
+  // Safely overwrite the old secret file.
+  int rc = -1;
+  char *tmp_filename = malloc(strlen(name) + 2);
+  if (tmp_filename == NULL) {
+ removal_failure:
+    log_message(LOG_ERR, pamh, "Failed to update secret file \"%s\"",
+                secret_filename);
+    goto cleanup;
+  }
+
+  strcat(strcpy(tmp_filename, name), "~");
+  int fd = openat(dir_fd, tmp_filename,
+                  O_WRONLY|O_CREAT|O_NOFOLLOW|O_TRUNC|O_EXCL, 0400);
+  if (fd < 0) {
+    goto removal_failure;
+  }
 
   // Write the new file contents
   if (write(fd, buf, strlen(buf)) != (ssize_t)strlen(buf) ||
-      rename(tmp_filename, secret_filename) != 0) {
-    unlink(tmp_filename);
-    free(tmp_filename);
+      renameat(dir_fd, tmp_filename, dir_fd, name) != 0) {
+    unlinkat(dir_fd, tmp_filename, 0);
     close(fd);
     goto removal_failure;
   }
 
-  free(tmp_filename);
+  // Once renamed, the file is no longer covered by "lock_fd". Somebody else
+  // could replace it right away. Describe the file that we wrote, rather
+  // than whatever the name refers to now. A replacement has another inode.
+  if (new_stamp) {
+    if (fstat(fd, &sb) < 0) {
+      close(fd);
+      goto removal_failure;
+    }
+    get_file_stamp(&sb, new_stamp);
+  }
   close(fd);
+  rc = 0;
 
-  return 0;
+ cleanup:
+  free(tmp_filename);
+  memset(buf, 0, strlen(buf));
+  free(buf);
+  return rc;
 }
 
 static uint8_t *get_shared_secret(pam_handle_t *pamh,
@@ -506,246 +1130,32 @@ static int get_timestamp(void) {
   return get_time()/30;
 }
 
-static int comparator(const void *a, const void *b) {
-  return *(unsigned int *)a - *(unsigned int *)b;
-}
-
-static char *get_cfg_value(pam_handle_t *pamh, const char *key,
-                           const char *buf) {
-  size_t key_len = strlen(key);
-  for (const char *line = buf; *line; ) {
-    const char *ptr;
-    if (line[0] == '"' && line[1] == ' ' && !memcmp(line+2, key, key_len) &&
-        (!*(ptr = line+2+key_len) || *ptr == ' ' || *ptr == '\t' ||
-         *ptr == '\r' || *ptr == '\n')) {
-      ptr += strspn(ptr, " \t");
-      size_t val_len = strcspn(ptr, "\r\n");
-      char *val = malloc(val_len + 1);
-      if (!val) {
-        log_message(LOG_ERR, pamh, "Out of memory");
-        return &oom;
-      } else {
-        memcpy(val, ptr, val_len);
-        val[val_len] = '\000';
-        return val;
-      }
-    } else {
-      line += strcspn(line, "\r\n");
-      line += strspn(line, "\r\n");
-    }
-  }
-  return NULL;
-}
-
-static int set_cfg_value(pam_handle_t *pamh, const char *key, const char *val,
-                         char **buf) {
-  size_t key_len = strlen(key);
-  char *start = NULL;
-  char *stop = NULL;
-
-  // Find an existing line, if any.
-  for (char *line = *buf; *line; ) {
-    char *ptr;
-    if (line[0] == '"' && line[1] == ' ' && !memcmp(line+2, key, key_len) &&
-        (!*(ptr = line+2+key_len) || *ptr == ' ' || *ptr == '\t' ||
-         *ptr == '\r' || *ptr == '\n')) {
-      start = line;
-      stop  = start + strcspn(start, "\r\n");
-      stop += strspn(stop, "\r\n");
-      break;
-    } else {
-      line += strcspn(line, "\r\n");
-      line += strspn(line, "\r\n");
-    }
-  }
-
-  // If no existing line, insert immediately after the first line.
-  if (!start) {
-    start  = *buf + strcspn(*buf, "\r\n");
-    start += strspn(start, "\r\n");
-    stop   = start;
-  }
-  
-  // Replace [start..stop] with the new contents.
-  size_t val_len = strlen(val);
-  size_t total_len = key_len + val_len + 4;
-  if (total_len <= stop - start) {
-    // We are decreasing out space requirements. Shrink the buffer and pad with
-    // NUL characters.
-    size_t tail_len = strlen(stop);
-    memmove(start + total_len, stop, tail_len + 1);
-    memset(start + total_len + tail_len, 0, stop - start - total_len + 1);
-  } else {
-    // Must resize existing buffer. We cannot call realloc(), as it could
-    // leave parts of the buffer content in unused parts of the heap.
-    size_t buf_len = strlen(*buf);
-    size_t tail_len = buf_len - (stop - *buf);
-    char *resized = malloc(buf_len - (stop - start) + total_len + 1);
-    if (!resized) {
-      log_message(LOG_ERR, pamh, "Out of memory");
-      return -1;
-    }
-    memcpy(resized, *buf, start - *buf);
-    memcpy(resized + (start - *buf) + total_len, stop, tail_len + 1);
-    memset(*buf, 0, buf_len);
-    free(*buf);
-    start = start - *buf + resized;
-    *buf = resized;
-  }
-
-  // Fill in new contents.
-  start[0] = '"';
-  start[1] = ' ';
-  memcpy(start + 2, key, key_len);
-  start[2+key_len] = ' ';
-  memcpy(start+3+key_len, val, val_len);
-  start[3+key_len+val_len] = '\n';
-
-  // Check if there are any other occurrences of "value". If so, delete them.
-  for (char *line = start + 4 + key_len + val_len; *line; ) {
-    char *ptr;
-    if (line[0] == '"' && line[1] == ' ' && !memcmp(line+2, key, key_len) &&
-        (!*(ptr = line+2+key_len) || *ptr == ' ' || *ptr == '\t' ||
-         *ptr == '\r' || *ptr == '\n')) {
-      start = line;
-      stop = start + strcspn(start, "\r\n");
-      stop += strspn(stop, "\r\n");
-      size_t tail_len = strlen(stop);
-      memmove(start, stop, tail_len + 1);
-      memset(start + tail_len, 0, stop - start);
-      line = start;
-    } else {
-      line += strcspn(line, "\r\n");
-      line += strspn(line, "\r\n");
-    }
-  }
-
-  return 0;
-}
-
-static long get_hotp_counter(pam_handle_t *pamh, const char *buf) {
-  const char *counter_str = get_cfg_value(pamh, "HOTP_COUNTER", buf);
-  if (counter_str == &oom) {
-    // Out of memory. This is a fatal error
-    return -1;
-  }
-
-  long counter = 0;
-  if (counter_str) {
-    counter = strtol(counter_str, NULL, 10);
-  }
-  free((void *)counter_str);
-
-  return counter;
-}
-
 static int rate_limit(pam_handle_t *pamh, const char *secret_filename,
-                      int *updated, char **buf) {
-  const char *value = get_cfg_value(pamh, "RATE_LIMIT", *buf);
-  if (!value) {
+                      int *updated, SecretState *state) {
+  if (state->status[OPT_RATE_LIMIT] == OPT_ABSENT) {
     // Rate limiting is not enabled for this account
     return 0;
-  } else if (value == &oom) {
-    // Out of memory. This is a fatal error.
-    return -1;
-  }
-
-  // Parse both the maximum number of login attempts and the time interval
-  // that we are looking at.
-  const char *endptr = value, *ptr;
-  int attempts, interval;
-  errno = 0;
-  if (((attempts = (int)strtoul(ptr = endptr, (char **)&endptr, 10)) < 1) ||
-      ptr == endptr ||
-      attempts > 100 ||
-      errno ||
-      (*endptr != ' ' && *endptr != '\t') ||
-      ((interval = (int)strtoul(ptr = endptr, (char **)&endptr, 10)) < 1) ||
-      ptr == endptr ||
-      interval > 3600 ||
-      errno) {
-    free((void *)value);
-    log_message(LOG_ERR, pamh, "Invalid RATE_LIMIT option. Check \"%s\".",
-                secret_filename);
-    return -1;
-  }
-
-  // Parse the time stamps of all previous login attempts.
-  unsigned int now = get_time();
-  unsigned int *timestamps = malloc(sizeof(int));
-  if (!timestamps) {
-  oom:
-    free((void *)value);
-    log_message(LOG_ERR, pamh, "Out of memory");
-    return -1;
-  }
-  timestamps[0] = now;
-  int num_timestamps = 1;
-  while (*endptr && *endptr != '\r' && *endptr != '\n') {
-    unsigned int timestamp;
-    errno = 0;
-    if ((*endptr != ' ' && *endptr != '\t') ||
-        ((timestamp = (int)strtoul(ptr = endptr, (char **)&endptr, 10)),
-         errno) ||
-        ptr == endptr) {
-      free((void *)value);
-      free(timestamps);
+  } else if (state->status[OPT_RATE_LIMIT] == OPT_INVALID) {
+    // The parser only fills in the limits, if they were valid.
+    if (state->rate_limit_attempts) {
       log_message(LOG_ERR, pamh, "Invalid list of timestamps in RATE_LIMIT. "
                   "Check \"%s\".", secret_filename);
-      return -1;
-    }
-    num_timestamps++;
-    unsigned int *tmp = (unsigned int *)realloc(timestamps,
-                                                sizeof(int) * num_timestamps);
-    if (!tmp) {
-      free(timestamps);
-      goto oom;
-    }
-    timestamps = tmp;
-    timestamps[num_timestamps-1] = timestamp;
-  }
-  free((void *)value);
-  value = NULL;
-
-  // Sort time stamps, then prune all entries outside of the current time
-  // interval.
-  qsort(timestamps, num_timestamps, sizeof(int), comparator);
-  int start = 0, stop = -1;
-  for (int i = 0; i < num_timestamps; ++i) {
-    if (timestamps[i] < now - interval) {
-      start = i+1;
-    } else if (timestamps[i] > now) {
-      break;
+    } else {
+      log_message(LOG_ERR, pamh, "Invalid RATE_LIMIT option. Check \"%s\".",
+                  secret_filename);
     }
-    stop = i;
-  }
-
-  // Error out, if there are too many login attempts.
-  int exceeded = 0;
-  if (stop - start + 1 > attempts) {
-    exceeded = 1;
-    start = stop - attempts + 1;
+    return -1;
   }
 
-  // Construct new list of timestamps within the current time interval.
-  char *list = malloc(25 * (2 + (stop - start + 1)) + 4);
-  if (!list) {
-    free(timestamps);
-    goto oom;
-  }
-  sprintf(list, "%d %d", attempts, interval);
-  char *prnt = strchr(list, '\000');
-  for (int i = start; i <= stop; ++i) {
-    prnt += sprintf(prnt, " %u", timestamps[i]);
-  }
-  free(timestamps);
+  // Add the current login attempt to the time stamps of all previous ones,
+  // and prune all entries outside of the current time interval.
+  int exceeded = secret_state_rate_limit(state, get_time());
 
   // Try to update RATE_LIMIT line.
-  if (set_cfg_value(pamh, "RATE_LIMIT", list, buf) < 0) {
-    free(list);
+  if (secret_state_update(state, OPT_RATE_LIMIT) < 0) {
+    log_message(LOG_ERR, pamh, "Out of memory");
     return -1;
   }
-  free(list);
 
   // Mark the state file as changed.
   *updated = 1;
@@ -804,88 +1214,85 @@ static char *request_pass(pam_handle_t *pamh, int echocode,
  * applied.
  */
 static int check_scratch_codes(pam_handle_t *pamh, const char *secret_filename,
-                               int *updated, char *buf, int code) {
-  // Skip the first line. It contains the shared secret.
-  char *ptr = buf + strcspn(buf, "\n");
-
-  // Check if this is one of the scratch codes
-  char *endptr = NULL;
-  for (;;) {
-    // Skip newlines and blank lines
-    while (*ptr == '\r' || *ptr == '\n') {
-      ptr++;
-    }
-
-    // Skip any lines starting with double-quotes. They contain option fields
-    if (*ptr == '"') {
-      ptr += strcspn(ptr, "\n");
-      continue;
-    }
-
-    // Try to interpret the line as a scratch code
-    errno = 0;
-    int scratchcode = (int)strtoul(ptr, &endptr, 10);
-
-    // Sanity check that we read a valid scratch code. Scratchcodes are all
-    // numeric eight-digit codes. There must not be any other information on
-    // that line.
-    if (errno ||
-        ptr == endptr ||
-        (*endptr != '\r' && *endptr != '\n' && *endptr) ||
-        scratchcode  <  10*1000*1000 ||
-        scratchcode >= 100*1000*1000) {
-      break;
-    }
-
-    // Check if the code matches
-    if (scratchcode == code) {
-      // Remove scratch code after using it
-      while (*endptr == '\n' || *endptr == '\r') {
-        ++endptr;
-      }
-      memmove(ptr, endptr, strlen(endptr) + 1);
-      memset(strrchr(ptr, '\000'), 0, endptr - ptr + 1);
-
-      // Mark the state file as changed
-      *updated = 1;
-
-      // Successfully removed scratch code. Allow user to log in.
-      return 0;
-    }
-    ptr = endptr;
+                               int *updated, SecretState *state, int code) {
+  // Remove scratch code after using it
+  if (secret_state_remove_scratch_code(state, code)) {
+    // No scratch code has been used. Continue checking other types of codes.
+    return 1;
   }
 
-  // No scratch code has been used. Continue checking other types of codes.
-  return 1;
+  // Mark the state file as changed
+  *updated = 1;
+
+  // Successfully removed scratch code. Allow user to log in.
+  return 0;
 }
 
 static int window_size(pam_handle_t *pamh, const char *secret_filename,
-                       const char *buf) {
-  const char *value = get_cfg_value(pamh, "WINDOW_SIZE", buf);
-  if (!value) {
+                       const SecretState *state) {
+  if (state->status[OPT_WINDOW_SIZE] == OPT_ABSENT) {
     // Default window size is 3. This gives us one 30s window before and
     // after the current one.
-    free((void *)value);
     return 3;
-  } else if (value == &oom) {
-    // Out of memory. This is a fatal error.
+  } else if (state->status[OPT_WINDOW_SIZE] == OPT_INVALID) {
+    log_message(LOG_ERR, pamh, "Invalid WINDOW_SIZE option in \"%s\"",
+                secret_filename);
     return 0;
   }
+  return state->window_size;
+}
 
-  char *endptr;
-  errno = 0;
-  int window = (int)strtoul(value, &endptr, 10);
-  if (errno || !*value || value == endptr ||
-      (*endptr && *endptr != ' ' && *endptr != '\t' &&
-       *endptr != '\n' && *endptr != '\r') ||
-      window < 1 || window > 100) {
-    free((void *)value);
-    log_message(LOG_ERR, pamh, "Invalid WINDOW_SIZE option in \"%s\"",
+/* Returns how many steps away from the expected time skew the search for a
+ * new skew looks, or -1 on error. Both the module argument and the secret
+ * file can shrink the range.
+ */
+static int skew_search_range(pam_handle_t *pamh, const char *secret_filename,
+                             const SecretState *state, const Params *params) {
+  int range = params->skew_search_range
+    ? params->skew_search_range : MAX_SKEW_SEARCH_RANGE;
+  if (state->status[OPT_SKEW_SEARCH_RANGE] == OPT_INVALID) {
+    log_message(LOG_ERR, pamh, "Invalid SKEW_SEARCH_RANGE option in \"%s\"",
                 secret_filename);
-    return 0;
+    return -1;
+  } else if (state->status[OPT_SKEW_SEARCH_RANGE] == OPT_VALID &&
+             state->skew_search_range < range) {
+    range = state->skew_search_range;
+  }
+  return range;
+}
+
+/* Reads the ALGORITHM and DIGITS options, if any. Returns -1 on error, and 0
+ * on success.
+ */
+static int otp_parameters(pam_handle_t *pamh, const char *secret_filename,
+                          const SecretState *state, OtpKey *key) {
+  if (state->status[OPT_ALGORITHM] == OPT_INVALID) {
+    log_message(LOG_ERR, pamh, "Invalid ALGORITHM option in \"%s\"",
+                secret_filename);
+    return -1;
+  }
+  if (state->status[OPT_DIGITS] == OPT_INVALID) {
+    log_message(LOG_ERR, pamh, "Invalid DIGITS option in \"%s\"",
+                secret_filename);
+    return -1;
   }
-  free((void *)value);
-  return window;
+  switch (state->algorithm) {
+  case ALGORITHM_SHA256:
+    key->algorithm = OTP_SHA256;
+    break;
+  case ALGORITHM_SHA512:
+    key->algorithm = OTP_SHA512;
+    break;
+  default:
+    key->algorithm = OTP_SHA1;
+    break;
+  }
+  key->digits = state->digits;
+  key->modulus = 1;
+  for (int i = 0; i < key->digits; ++i) {
+    key->modulus *= 10;
+  }
+  return 0;
 }
 
 /* If the DISALLOW_REUSE option has been set, record timestamps have been
@@ -895,86 +1302,46 @@ static int window_size(pam_handle_t *pamh, const char *secret_filename,
  */
 static int invalidate_timebased_code(int tm, pam_handle_t *pamh,
                                      const char *secret_filename,
-                                     int *updated, char **buf) {
-  char *disallow = get_cfg_value(pamh, "DISALLOW_REUSE", *buf);
-  if (!disallow) {
+                                     int *updated, SecretState *state) {
+  if (state->status[OPT_DISALLOW_REUSE] == OPT_ABSENT) {
     // Reuse of tokens is not explicitly disallowed. Allow the login request
     // to proceed.
     return 0;
-  } else if (disallow == &oom) {
-    // Out of memory. This is a fatal error.
-    return -1;
   }
 
   // Allow the user to customize the window size parameter.
-  int window = window_size(pamh, secret_filename, *buf);
+  int window = window_size(pamh, secret_filename, state);
   if (!window) {
     // The user configured a non-standard window size, but there was some
     // error with the value of this parameter.
-    free((void *)disallow);
     return -1;
   }
 
   // The DISALLOW_REUSE option is followed by all known timestamps that are
   // currently unavailable for login.
-  for (char *ptr = disallow; *ptr;) {
-    // Skip white-space, if any
-    ptr += strspn(ptr, " \t\r\n");
-    if (!*ptr) {
-      break;
-    }
-
-    // Parse timestamp value.
-    char *endptr;
-    errno = 0;
-    int blocked = (int)strtoul(ptr, &endptr, 10);
-
-    // Treat syntactically invalid options as an error
-    if (errno ||
-        ptr == endptr ||
-        (*endptr != ' ' && *endptr != '\t' &&
-         *endptr != '\r' && *endptr != '\n' && *endptr)) {
-      free((void *)disallow);
-      return -1;
-    }
-
-    if (tm == blocked) {
-      // The code is currently blocked from use. Disallow login.
-      free((void *)disallow);
-      log_message(LOG_ERR, pamh,
-                  "Trying to reuse a previously used time-based code. "
-                  "Retry again in 30 seconds. "
-                  "Warning! This might mean, you are currently subject to a "
-                  "man-in-the-middle attack.");
-      return -1;
-    }
-
-    // If the blocked code is outside of the possible window of timestamps,
-    // remove it from the file.
-    if (blocked - tm >= window || tm - blocked >= window) {
-      endptr += strspn(endptr, " \t");
-      memmove(ptr, endptr, strlen(endptr) + 1);
-    } else {
-      ptr = endptr;
-    }
+  if (secret_state_is_disallowed(state, tm)) {
+    // The code is currently blocked from use. Disallow login.
+    log_message(LOG_ERR, pamh,
+                "Trying to reuse a previously used time-based code. "
+                "Retry again in 30 seconds. "
+                "Warning! This might mean, you are currently subject to a "
+                "man-in-the-middle attack.");
+    return -1;
   }
 
-  // Add the current timestamp to the list of disallowed timestamps.
-  char *resized = realloc(disallow, strlen(disallow) + 40);
-  if (!resized) {
-    free((void *)disallow);
-    log_message(LOG_ERR, pamh,
-                "Failed to allocate memory when updating \"%s\"",
-                secret_filename);
+  // Treat syntactically invalid options as an error
+  if (state->status[OPT_DISALLOW_REUSE] == OPT_INVALID) {
     return -1;
   }
-  disallow = resized;
-  sprintf(strrchr(disallow, '\000'), " %d" + !*disallow, tm);
-  if (set_cfg_value(pamh, "DISALLOW_REUSE", disallow, buf) < 0) {
-    free((void *)disallow);
+
+  // Add the current timestamp to the list of disallowed timestamps. If a
+  // blocked code is outside of the possible window of timestamps, remove it
+  // from the file.
+  secret_state_disallow(state, tm, window);
+  if (secret_state_update(state, OPT_DISALLOW_REUSE) < 0) {
+    log_message(LOG_ERR, pamh, "Out of memory");
     return -1;
   }
-  free((void *)disallow);
 
   // Mark the state file as changed
   *updated = 1;
@@ -983,103 +1350,338 @@ static int invalidate_timebased_code(int tm, pam_handle_t *pamh,
   return 0;
 }
 
-/* Given an input value, this function computes the hash code that forms the
- * expected authentication token.
+/* Applies the dynamic truncation from RFC 4226 to an HMAC value, and reduces
+ * the result to the configured number of digits.
  */
-#ifdef TESTING
-int compute_code(const uint8_t *secret, int secretLen, unsigned long value)
-  __attribute__((visibility("default")));
-#else
-static
-#endif
-int compute_code(const uint8_t *secret, int secretLen, unsigned long value) {
-  uint8_t val[8];
-  for (int i = 8; i--; value >>= 8) {
-    val[i] = value;
-  }
-  uint8_t hash[SHA1_DIGEST_LENGTH];
-  hmac_sha1(secret, secretLen, val, 8, hash, SHA1_DIGEST_LENGTH);
-  memset(val, 0, sizeof(val));
-  int offset = hash[SHA1_DIGEST_LENGTH - 1] & 0xF;
+static int truncate_hash(const OtpKey *key, const uint8_t *hash, int len) {
+  int offset = hash[len - 1] & 0xF;
   unsigned int truncatedHash = 0;
   for (int i = 0; i < 4; ++i) {
     truncatedHash <<= 8;
     truncatedHash  |= hash[offset + i];
   }
-  memset(hash, 0, sizeof(hash));
   truncatedHash &= 0x7FFFFFFF;
-  truncatedHash %= 1000000;
+  truncatedHash %= key->modulus;
   return truncatedHash;
 }
 
+/* Absorbs the shared secret into the HMAC state. "key->algorithm" must
+ * already be set.
+ */
+static void init_otp_key(OtpKey *key, const uint8_t *secret, int secretLen) {
+  switch (key->algorithm) {
+  case OTP_SHA256:
+    hmac_sha256_init_key(&key->hmac.sha256, secret, secretLen);
+    break;
+  case OTP_SHA512:
+    hmac_sha512_init_key(&key->hmac.sha512, secret, secretLen);
+    break;
+  default:
+    hmac_sha1_init_key(&key->hmac.sha1, secret, secretLen);
+    break;
+  }
+  static const uint8_t label[] = "google-authenticator skew codes";
+  hmac_sha256(secret, secretLen, label, sizeof(label) - 1, key->fingerprint,
+              sizeof(key->fingerprint));
+}
+
+static void clear_otp_key(OtpKey *key) {
+  memset(key, 0, sizeof(*key));
+}
+
+/* Given an input value, this function computes the hash code that forms the
+ * expected authentication token.
+ */
+static int compute_keyed_code(const OtpKey *key, unsigned long value) {
+  uint8_t hash[SHA512_DIGEST_LENGTH];
+  int len;
+  switch (key->algorithm) {
+  case OTP_SHA256:
+    hmac_sha256_counter(&key->hmac.sha256, value, hash);
+    len = SHA256_DIGEST_LENGTH;
+    break;
+  case OTP_SHA512:
+    hmac_sha512_counter(&key->hmac.sha512, value, hash);
+    len = SHA512_DIGEST_LENGTH;
+    break;
+  default:
+    hmac_sha1_counter(&key->hmac.sha1, value, hash);
+    len = SHA1_DIGEST_LENGTH;
+    break;
+  }
+  int code = truncate_hash(key, hash, len);
+  memset(hash, 0, sizeof(hash));
+  return code;
+}
+
+/* Computes the hash codes for "count" consecutive input values, starting at
+ * "value". This produces the same results as calling compute_keyed_code() for
+ * each value, but it is a lot faster when checking large ranges of values.
+ */
+static void compute_keyed_codes(const OtpKey *key, unsigned long value,
+                                int count, int *codes) {
+  if (key->algorithm != OTP_SHA1) {
+    // Only SHA1 has a multi-buffer implementation. The SHA256 and SHA512
+    // code paths still benefit from the cached key and the fixed-length
+    // final blocks.
+    for (int i = 0; i < count; ++i) {
+      codes[i] = compute_keyed_code(key, value + i);
+    }
+    return;
+  }
+  uint8_t hashes[4*SHA1_MB_MAX_LANES][SHA1_DIGEST_LENGTH];
+  const int batch = sizeof(hashes)/sizeof(*hashes);
+  while (count > 0) {
+    int n = count < batch ? count : batch;
+    hmac_sha1_counters(&key->hmac.sha1, value, n, hashes);
+    for (int i = 0; i < n; ++i) {
+      codes[i] = truncate_hash(key, hashes[i], SHA1_DIGEST_LENGTH);
+    }
+    value += n;
+    codes += n;
+    count -= n;
+  }
+  memset(hashes, 0, sizeof(hashes));
+}
+
+#ifdef TESTING
+int compute_code(const uint8_t *secret, int secretLen, unsigned long value)
+  __attribute__((visibility("default")));
+int compute_code(const uint8_t *secret, int secretLen, unsigned long value) {
+  OtpKey key = { .algorithm = OTP_SHA1, .digits = 6, .modulus = 1000000 };
+  init_otp_key(&key, secret, secretLen);
+  int code = compute_keyed_code(&key, value);
+  clear_otp_key(&key);
+  return code;
+}
+
+void compute_codes(const uint8_t *secret, int secretLen, unsigned long value,
+                   int count, int *codes)
+  __attribute__((visibility("default")));
+void compute_codes(const uint8_t *secret, int secretLen, unsigned long value,
+                   int count, int *codes) {
+  OtpKey key = { .algorithm = OTP_SHA1, .digits = 6, .modulus = 1000000 };
+  init_otp_key(&key, secret, secretLen);
+  compute_keyed_codes(&key, value, count, codes);
+  clear_otp_key(&key);
+}
+#endif
+
+/* The search for time skew compares the user's input against all codes within
+ * the search range around the expected skew. Users that mistype their code,
+ * and attackers that guess, usually try again within the same 30s step. And
+ * as the clock advances by one step, all but one of the codes stay the same.
+ * Long-lived processes therefore keep tables of codes in memory. Each table
+ * is a ring buffer indexed by the counter value, so advancing it only
+ * computes the codes for the new steps, and nothing has to be moved.
+ * There is one table for the search around the expected skew, and one for
+ * the search around the current time.
+ * The daemon keeps its own tables for each user. Everybody else (e.g. sshd
+ * allowing several attempts per connection) shares a few tables per process.
+ * Tables are deliberately private to the process. A shared memory segment
+ * would be readable by anybody who can attach to it, and valid codes are
+ * about as sensitive as the secrets themselves.
+ */
+#define SKEW_CODES      (2*MAX_SKEW_SEARCH_RANGE + 1)
+#define SKEW_WINDOWS    2
+#define SKEW_CACHE_SIZE 8
+
+struct CodeTable {
+  uint8_t       fingerprint[SHA256_DIGEST_LENGTH];
+  int           algorithm;
+  int           modulus;
+  unsigned long value;                // The table holds the codes for
+  int           count;                // "count" values from "value" onwards
+  unsigned      last_used;
+  int           window;               // Index of the search that uses it
+  int           codes[SKEW_CODES];
+};
+
+static CodeTable skew_cache[SKEW_CACHE_SIZE];
+static unsigned skew_cache_clock;
+static pthread_mutex_t skew_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef TESTING
+static int skew_codes_computed;
+
+int get_skew_codes_computed(void) __attribute__((visibility("default")));
+int get_skew_codes_computed(void) {
+  return skew_codes_computed;
+}
+#endif
+
+static int code_table_matches(const CodeTable *table, const OtpKey *key) {
+  return table->count &&
+         table->algorithm == key->algorithm &&
+         table->modulus == key->modulus &&
+         !memcmp(table->fingerprint, key->fingerprint,
+                 sizeof(table->fingerprint));
+}
+
+// Computes the codes for "count" values starting at "value", and stores them
+// in their slots of the ring buffer.
+static void fill_code_table(CodeTable *table, const OtpKey *key,
+                            unsigned long value, int count) {
+#ifdef TESTING
+  skew_codes_computed += count;
+#endif
+  while (count > 0) {
+    int slot = value % SKEW_CODES;
+    int n = SKEW_CODES - slot < count ? SKEW_CODES - slot : count;
+    compute_keyed_codes(key, value, n, table->codes + slot);
+    value += n;
+    count -= n;
+  }
+}
+
+// Makes sure that "table" holds the "count" codes starting at "value". Codes
+// that the table already holds are not computed again. Others are dropped, if
+// there is not enough room for all of them.
+static void update_code_table(CodeTable *table, const OtpKey *key,
+                              unsigned long value, int count) {
+  unsigned long end = value + count;
+  unsigned long old_end = table->value + table->count;
+  if (!code_table_matches(table, key) ||
+      value >= old_end || end <= table->value) {
+    memcpy(table->fingerprint, key->fingerprint, sizeof(table->fingerprint));
+    table->algorithm = key->algorithm;
+    table->modulus = key->modulus;
+    fill_code_table(table, key, value, count);
+    table->value = value;
+    table->count = count;
+    return;
+  }
+  if (value < table->value) {
+    fill_code_table(table, key, value, table->value - value);
+  }
+  if (end > old_end) {
+    fill_code_table(table, key, old_end, end - old_end);
+  }
+
+  // Keep as much of the old range as fits next to the new one.
+  unsigned long first = value < table->value ? value : table->value;
+  unsigned long last = end > old_end ? end : old_end;
+  if (last - first > SKEW_CODES) {
+    if (end > old_end) {
+      first = end - SKEW_CODES;
+    } else {
+      last = value + SKEW_CODES;
+    }
+  }
+  table->value = first;
+  table->count = last - first;
+}
+
+// Returns the code for "value", if "table" holds it, or -1 otherwise.
+static int get_table_code(const CodeTable *table, const OtpKey *key,
+                          unsigned long value) {
+  if (code_table_matches(table, key) &&
+      value >= table->value && value - table->value < table->count) {
+    return table->codes[value % SKEW_CODES];
+  }
+  return -1;
+}
+
+// Copies the "count" codes starting at "value" from the table, which must
+// hold them.
+static void copy_code_table(const CodeTable *table, unsigned long value,
+                            int count, int *codes) {
+  int slot = value % SKEW_CODES;
+  int n = SKEW_CODES - slot < count ? SKEW_CODES - slot : count;
+  memcpy(codes, table->codes + slot, n*sizeof(int));
+  memcpy(codes + n, table->codes, (count - n)*sizeof(int));
+}
+
+static CodeTable *find_skew_cache(const OtpKey *key, int window) {
+  for (int i = 0; i < SKEW_CACHE_SIZE; ++i) {
+    if (code_table_matches(&skew_cache[i], key) &&
+        skew_cache[i].window == window) {
+      return &skew_cache[i];
+    }
+  }
+  return NULL;
+}
+
+/* Fills "codes" with the "count" codes starting at "value". This produces the
+ * same results as compute_keyed_codes(), but reuses earlier results of the
+ * same "window" of the search.
+ */
+static void get_skew_codes(const OtpKey *key, int window, unsigned long value,
+                           int count, int *codes) {
+  if (key->table) {
+    update_code_table(key->table + window, key, value, count);
+    copy_code_table(key->table + window, value, count, codes);
+    return;
+  }
+
+  // If the secret is not in the shared tables (anymore), it replaces the
+  // least recently used one.
+  pthread_mutex_lock(&skew_cache_mutex);
+  CodeTable *table = find_skew_cache(key, window);
+  if (!table) {
+    table = &skew_cache[0];
+    for (int i = 1; i < SKEW_CACHE_SIZE; ++i) {
+      if (skew_cache[i].last_used < table->last_used) {
+        table = &skew_cache[i];
+      }
+    }
+    table->count = 0;
+    table->window = window;
+  }
+  table->last_used = ++skew_cache_clock;
+  update_code_table(table, key, value, count);
+  copy_code_table(table, value, count, codes);
+  pthread_mutex_unlock(&skew_cache_mutex);
+}
+
+/* Returns the code for "value". Looks it up in the tables of precomputed
+ * codes first.
+ */
+static int get_code(const OtpKey *key, unsigned long value) {
+  int code = -1;
+  if (key->table) {
+    for (int i = 0; i < SKEW_WINDOWS && code < 0; ++i) {
+      code = get_table_code(key->table + i, key, value);
+    }
+  } else {
+    pthread_mutex_lock(&skew_cache_mutex);
+    for (int i = 0; i < SKEW_CACHE_SIZE && code < 0; ++i) {
+      code = get_table_code(&skew_cache[i], key, value);
+    }
+    pthread_mutex_unlock(&skew_cache_mutex);
+  }
+  return code >= 0 ? code : compute_keyed_code(key, value);
+}
+
 /* If a user repeated attempts to log in with the same time skew, remember
  * this skew factor for future login attempts.
  */
 static int check_time_skew(pam_handle_t *pamh, const char *secret_filename,
-                           int *updated, char **buf, int skew, int tm) {
+                           int *updated, SecretState *state, int skew,
+                           int tm) {
   int rc = -1;
 
-  // Parse current RESETTING_TIME_SKEW line, if any.
-  char *resetting = get_cfg_value(pamh, "RESETTING_TIME_SKEW", *buf);
-  if (resetting == &oom) {
-    // Out of memory. This is a fatal error.
-    return -1;
-  }
-
   // If the user can produce a sequence of three consecutive codes that fall
   // within a day of the current time. And if he can enter these codes in
   // quick succession, then we allow the time skew to be reset.
   // N.B. the number "3" was picked so that it would not trigger the rate
   // limiting limit if set up with default parameters.
-  unsigned int tms[3];
+  // The parser kept the three most recent pairs of time stamps and skew
+  // values from the RESETTING_TIME_SKEW line, if any.
+  unsigned int tms[RESETTING_ENTRIES];
   int skews[sizeof(tms)/sizeof(int)];
-
-  int num_entries = 0;
-  if (resetting) {
-    char *ptr = resetting;
-
-    // Read the three most recent pairs of time stamps and skew values into
-    // our arrays.
-    while (*ptr && *ptr != '\r' && *ptr != '\n') {
-      char *endptr;
-      errno = 0;
-      unsigned int i = (int)strtoul(ptr, &endptr, 10);
-      if (errno || ptr == endptr || (*endptr != '+' && *endptr != '-')) {
-        break;
-      }
-      ptr = endptr;
-      int j = (int)strtoul(ptr + 1, &endptr, 10);
-      if (errno ||
-          ptr == endptr ||
-          (*endptr != ' ' && *endptr != '\t' &&
-           *endptr != '\r' && *endptr != '\n' && *endptr)) {
-        break;
-      }
-      if (*ptr == '-') {
-        j = -j;
-      }
-      if (num_entries == sizeof(tms)/sizeof(int)) {
-        memmove(tms, tms+1, sizeof(tms)-sizeof(int));
-        memmove(skews, skews+1, sizeof(skews)-sizeof(int));
-      } else {
-        ++num_entries;
-      }
-      tms[num_entries-1]   = i;
-      skews[num_entries-1] = j;
-      ptr = endptr;
-    }
-
-    // If the user entered an identical code, assume they are just getting
-    // desperate. This doesn't actually provide us with any useful data,
-    // though. Don't change any state and hope the user keeps trying a few
-    // more times.
-    if (num_entries &&
-        tm + skew == tms[num_entries-1] + skews[num_entries-1]) {
-      free((void *)resetting);
-      return -1;
-    }
+  int num_entries = state->num_resetting;
+  memcpy(tms, state->resetting_tms, sizeof(tms));
+  memcpy(skews, state->resetting_skews, sizeof(skews));
+
+  // If the user entered an identical code, assume they are just getting
+  // desperate. This doesn't actually provide us with any useful data,
+  // though. Don't change any state and hope the user keeps trying a few
+  // more times.
+  if (num_entries &&
+      tm + skew == tms[num_entries-1] + skews[num_entries-1]) {
+    return -1;
   }
-  free((void *)resetting);
 
   // Append new timestamp entry
   if (num_entries == sizeof(tms)/sizeof(int)) {
@@ -1113,9 +1715,9 @@ static int check_time_skew(pam_handle_t *pamh, const char *secret_filename,
     // The user entered the required number of valid codes in quick
     // succession. Establish a new valid time skew for all future login
     // attempts.
-    char time_skew[40];
-    sprintf(time_skew, "%d", avg_skew);
-    if (set_cfg_value(pamh, "TIME_SKEW", time_skew, buf) < 0) {
+    state->time_skew = avg_skew;
+    if (secret_state_update(state, OPT_TIME_SKEW) < 0) {
+      log_message(LOG_ERR, pamh, "Out of memory");
       return -1;
     }
     rc = 0;
@@ -1124,14 +1726,11 @@ static int check_time_skew(pam_handle_t *pamh, const char *secret_filename,
 
   // Set the new RESETTING_TIME_SKEW line, while the user is still trying
   // to reset the time skew.
-  char reset[80 * (sizeof(tms)/sizeof(int))];
-  *reset = '\000';
-  if (rc) {
-    for (int i = 0; i < num_entries; ++i) {
-      sprintf(strrchr(reset, '\000'), " %d%+d" + !*reset, tms[i], skews[i]);
-    }
-  }
-  if (set_cfg_value(pamh, "RESETTING_TIME_SKEW", reset, buf) < 0) {
+  state->num_resetting = rc ? num_entries : 0;
+  memcpy(state->resetting_tms, tms, sizeof(tms));
+  memcpy(state->resetting_skews, skews, sizeof(skews));
+  if (secret_state_update(state, OPT_RESETTING_TIME_SKEW) < 0) {
+    log_message(LOG_ERR, pamh, "Out of memory");
     return -1;
   }
 
@@ -1141,48 +1740,96 @@ static int check_time_skew(pam_handle_t *pamh, const char *secret_filename,
   return rc;
 }
 
+/* Returns the time skew that the next code most likely has. While the user is
+ * trying to establish a new time skew, that is the one seen most recently.
+ * Otherwise, it is the current TIME_SKEW.
+ */
+static int expected_skew(const SecretState *state, int tm, int range) {
+  int skew = state->num_resetting
+    ? state->resetting_skews[state->num_resetting - 1] : state->time_skew;
+
+  // A skew of more than a year is bogus. Ignore it.
+  if (skew < -365*24*120 || skew > 365*24*120 || tm + skew < range) {
+    return 0;
+  }
+  return skew;
+}
+
+/* Compares "code" against the codes within "range" steps of the time skew
+ * "center". Returns the matching skew that is closest to "center", or 1000000
+ * if there is none.
+ */
+static int search_skew(const OtpKey *key, int window, int tm, int center,
+                       int range, int code) {
+  // All codes in the range are computed up front. This lets us hash many
+  // counter values in parallel, and reuse them for the next attempt.
+  int codes[SKEW_CODES];
+  get_skew_codes(key, window, tm + center - range, 2*range + 1, codes);
+  int skew = 1000000;
+  for (int i = 0; i <= range; ++i) {
+    if (codes[range - i] == code && skew == 1000000) {
+      // Don't short-circuit out of the loop as the obvious difference in
+      // computation time could be a signal that is valuable to an attacker.
+      skew = center - i;
+    }
+    if (codes[range + i] == code && skew == 1000000) {
+      skew = center + i;
+    }
+  }
+  memset(codes, 0, sizeof(codes));
+  return skew;
+}
+
 /* Checks for time based verification code. Returns -1 on error, 0 on success,
  * and 1, if no time based code had been entered, and subsequent tests should
- * be applied.
+ * be applied. On success, "verified" is the time step of the code.
  */
 static int check_timebased_code(pam_handle_t *pamh, const char*secret_filename,
-                                int *updated, char **buf, const uint8_t*secret,
-                                int secretLen, int code, Params *params) {
-  if (!is_totp(*buf)) {
+                                int *updated, SecretState *state,
+                                const OtpKey *key, int code,
+                                Params *params, long *verified) {
+  if (!state->totp) {
     // The secret file does not actually contain information for a time-based
     // code. Return to caller and see if any other authentication methods
     // apply.
     return 1;
   }
 
-  if (code < 0 || code >= 1000000) {
-    // All time based verification codes are no longer than six digits.
+  if (code < 0 || code >= key->modulus) {
+    // Time based verification codes have exactly the configured number of
+    // digits.
     return 1;
   }
 
   // Compute verification codes and compare them with user input
   const int tm = get_timestamp();
-  const char *skew_str = get_cfg_value(pamh, "TIME_SKEW", *buf);
-  if (skew_str == &oom) {
-    // Out of memory. This is a fatal error
+  int skew = state->time_skew;
+  int window = window_size(pamh, secret_filename, state);
+  if (!window) {
     return -1;
   }
-
-  int skew = 0;
-  if (skew_str) {
-    skew = (int)strtol(skew_str, NULL, 10);
-  }
-  free((void *)skew_str);
-
-  int window = window_size(pamh, secret_filename, *buf);
-  if (!window) {
+  int range = skew_search_range(pamh, secret_filename, state, params);
+  if (range < 0) {
     return -1;
   }
+  // The search around the skew that we expect, and the search around the
+  // current time, each have a table of their own. Neither of them evicts the
+  // codes of the other one.
+  int center = expected_skew(state, tm, range);
+  if (key->table && !params->noskewadj) {
+    // Tables that belong to this user are worth keeping up to date. Once they
+    // have been filled, this only computes the codes for the new steps.
+    update_code_table(key->table, key, tm + center - range, 2*range + 1);
+    if (center) {
+      update_code_table(key->table + 1, key, tm - range, 2*range + 1);
+    }
+  }
   for (int i = -((window-1)/2); i <= window/2; ++i) {
-    unsigned int hash = compute_code(secret, secretLen, tm + skew + i);
+    unsigned int hash = get_code(key, tm + skew + i);
     if (hash == (unsigned int)code) {
+      *verified = tm + skew + i;
       return invalidate_timebased_code(tm + skew + i, pamh, secret_filename,
-                                       updated, buf);
+                                       updated, state);
     }
   }
 
@@ -1190,35 +1837,94 @@ static int check_timebased_code(pam_handle_t *pamh, const char*secret_filename,
     // The most common failure mode is for the clocks to be insufficiently
     // synchronized. We can detect this and store a skew value for future
     // use.
-    skew = 1000000;
-    for (int i = 0; i < 25*60; ++i) {
-      unsigned int hash = compute_code(secret, secretLen, tm - i);
-      if (hash == (unsigned int)code && skew == 1000000) {
-        // Don't short-circuit out of the loop as the obvious difference in
-        // computation time could be a signal that is valuable to an attacker.
-        skew = -i;
-      }
-      hash = compute_code(secret, secretLen, tm + i);
-      if (hash == (unsigned int)code && skew == 1000000) {
-        skew = i;
+    // Look near the skew that we expect first. If the user's clock has been
+    // fixed in the meantime, the code is near the current time instead. Both
+    // searches always run, so that the time taken does not depend on the
+    // result.
+    skew = search_skew(key, 0, tm, center, range, code);
+    if (center) {
+      int unskewed = search_skew(key, 1, tm, 0, range, code);
+      if (skew == 1000000) {
+        skew = unskewed;
       }
     }
     if (skew != 1000000) {
-      return check_time_skew(pamh, secret_filename, updated, buf, skew, tm);
+      *verified = tm + skew;
+      return check_time_skew(pamh, secret_filename, updated, state, skew,
+                             tm);
     }
   }
 
   return 1;
 }
 
+/* Hardware tokens that were pressed many times get too far ahead of the
+ * HOTP_COUNTER for the window to catch up. With the "hotp_resync" option, we
+ * look HOTP_RESYNC_RANGE counter values beyond the window. Much like when
+ * adjusting the time skew, a single code from that range is not enough. It
+ * is remembered in RESETTING_HOTP_COUNTER, and only the code for the
+ * immediately following counter value, entered in the next attempt, moves
+ * the HOTP_COUNTER forward.
+ * Returns -1 on error, 0 if the counter was resynchronized, and 1 otherwise.
+ */
+#define HOTP_RESYNC_RANGE 10000
+#define HOTP_RESYNC_BATCH 1000
+
+static int resync_hotp_counter(pam_handle_t *pamh, int *updated,
+                               SecretState *state, const OtpKey *key,
+                               int code, long first,
+                               int *must_advance_counter) {
+  // All codes in the range are computed in batches, and all of them are
+  // compared, so that the time taken does not depend on the result.
+  int codes[HOTP_RESYNC_BATCH];
+  long found = 0;
+  for (long value = first; value < first + HOTP_RESYNC_RANGE;
+       value += HOTP_RESYNC_BATCH) {
+    compute_keyed_codes(key, value, HOTP_RESYNC_BATCH, codes);
+    for (int i = 0; i < HOTP_RESYNC_BATCH; ++i) {
+      if (codes[i] == code && !found) {
+        found = value + i;
+      }
+    }
+  }
+  memset(codes, 0, sizeof(codes));
+  if (!found) {
+    return 1;
+  }
+
+  int rc = 1;
+  if (state->resetting_hotp_counter &&
+      found == state->resetting_hotp_counter + 1) {
+    state->hotp_counter = found + 1;
+    state->resetting_hotp_counter = 0;
+    if (secret_state_update(state, OPT_HOTP_COUNTER) < 0) {
+      log_message(LOG_ERR, pamh, "Out of memory");
+      return -1;
+    }
+    // Rather than leaving an empty RESETTING_HOTP_COUNTER line behind, the
+    // file goes back to how it looked before the resynchronization.
+    secret_state_remove_option(state, OPT_RESETTING_HOTP_COUNTER);
+    *must_advance_counter = 0;
+    rc = 0;
+  } else {
+    state->resetting_hotp_counter = found;
+    if (secret_state_update(state, OPT_RESETTING_HOTP_COUNTER) < 0) {
+      log_message(LOG_ERR, pamh, "Out of memory");
+      return -1;
+    }
+  }
+  *updated = 1;
+  return rc;
+}
+
 /* Checks for counter based verification code. Returns -1 on error, 0 on
  * success, and 1, if no counter based code had been entered, and subsequent
  * tests should be applied.
  */
 static int check_counterbased_code(pam_handle_t *pamh,
                                    const char*secret_filename, int *updated,
-                                   char **buf, const uint8_t*secret,
-                                   int secretLen, int code, Params *params,
+                                   SecretState *state, const OtpKey *key,
+                                   int code, Params *params,
                                    long hotp_counter,
                                    int *must_advance_counter) {
   if (hotp_counter < 1) {
@@ -1228,23 +1934,24 @@ static int check_counterbased_code(pam_handle_t *pamh,
     return 1;
   }
 
-  if (code < 0 || code >= 1000000) {
-    // All counter based verification codes are no longer than six digits.
+  if (code < 0 || code >= key->modulus) {
+    // Counter based verification codes have exactly the configured number of
+    // digits.
     return 1;
   }
 
   // Compute [window_size] verification codes and compare them with user input.
   // Future codes are allowed in case the user computed but did not use a code.
-  int window = window_size(pamh, secret_filename, *buf);
+  int window = window_size(pamh, secret_filename, state);
   if (!window) {
     return -1;
   }
   for (int i = 0; i < window; ++i) {
-    unsigned int hash = compute_code(secret, secretLen, hotp_counter + i);
+    unsigned int hash = compute_keyed_code(key, hotp_counter + i);
     if (hash == (unsigned int)code) {
-      char counter_str[40];
-      sprintf(counter_str, "%ld", hotp_counter + i + 1);
-      if (set_cfg_value(pamh, "HOTP_COUNTER", counter_str, buf) < 0) {
+      state->hotp_counter = hotp_counter + i + 1;
+      if (secret_state_update(state, OPT_HOTP_COUNTER) < 0) {
+        log_message(LOG_ERR, pamh, "Out of memory");
         return -1;
       }
       *updated = 1;
@@ -1254,9 +1961,85 @@ static int check_counterbased_code(pam_handle_t *pamh,
   }
 
   *must_advance_counter = 1;
+  if (params->hotp_resync) {
+    return resync_hotp_counter(pamh, updated, state, key, code,
+                               hotp_counter + window, must_advance_counter);
+  }
   return 1;
 }
 
+/* Checks whether the password ends in a verification code (even modes) or
+ * a scratch code (odd modes). On success, the code is removed from "pw", and
+ * "verified" is the time step or the counter value of the code, or zero for
+ * a scratch code. Returns -1 on error, 0 on success, and 1, if the code is not
+ * valid, and the next mode should be tried.
+ */
+static int check_code(pam_handle_t *pamh, const char *secret_filename,
+                      int *updated, SecretState *state, const OtpKey *key,
+                      Params *params, long hotp_counter,
+                      int *must_advance_counter, int mode, char *pw,
+                      long *verified) {
+  *verified = 0;
+
+  // We are often dealing with a combined password and verification
+  // code. Separate them now.
+  int pw_len = strlen(pw);
+  int expected_len = mode & 1 ? 8 : key->digits;
+  char ch;
+  if ((mode & 1) && expected_len == key->digits) {
+    // Eight digit verification codes look just like scratch codes. The
+    // previous mode already checked for both.
+    return 1;
+  }
+  if (pw_len < expected_len ||
+      // Verification are six to eight digits starting with '0'..'9',
+      // scratch codes are eight digits starting with '1'..'9'
+      (ch = pw[pw_len - expected_len]) > '9' ||
+      ch < (mode & 1 ? '1' : '0')) {
+    return 1;
+  }
+  char *endptr;
+  errno = 0;
+  long l = strtol(pw + pw_len - expected_len, &endptr, 10);
+  if (errno || l < 0 || *endptr) {
+    return 1;
+  }
+  int code = (int)l;
+  memset(pw + pw_len - expected_len, 0, expected_len);
+
+  if ((mode == 2 || mode == 3) && !params->forward_pass) {
+    // We are explicitly configured so that we don't try to share
+    // the password with any other stacked PAM module. We must
+    // therefore verify that the user entered just the verification
+    // code, but no password.
+    if (*pw) {
+      return 1;
+    }
+  }
+
+  // Check all possible types of verification codes.
+  switch (check_scratch_codes(pamh, secret_filename, updated, state, code)) {
+  case 1:
+    if (hotp_counter > 0) {
+      int rc = check_counterbased_code(pamh, secret_filename, updated, state,
+                                       key, code, params, hotp_counter,
+                                       must_advance_counter);
+      if (!rc) {
+        // The counter now points right after the code that was used.
+        *verified = state->hotp_counter - 1;
+      }
+      return rc;
+    } else {
+      return check_timebased_code(pamh, secret_filename, updated, state, key,
+                                  code, params, verified);
+    }
+  case 0:
+    return 0;
+  default:
+    return -1;
+  }
+}
+
 static int parse_user(pam_handle_t *pamh, const char *name, uid_t *uid) {
   char *endptr;
   errno = 0;
@@ -1265,27 +2048,13 @@ static int parse_user(pam_handle_t *pamh, const char *name, uid_t *uid) {
     *uid = (uid_t)l;
     return 0;
   }
-  #ifdef _SC_GETPW_R_SIZE_MAX
-  int len   = sysconf(_SC_GETPW_R_SIZE_MAX);
-  if (len <= 0) {
-    len = 4096;
-  }
-  #else
-  int len   = 4096;
-  #endif
-  char *buf = malloc(len);
-  if (!buf) {
-    log_message(LOG_ERR, pamh, "Out of memory");
-    return -1;
-  }
-  struct passwd pwbuf, *pw;
-  if (getpwnam_r(name, &pwbuf, buf, len, &pw) || !pw) {
-    free(buf);
+  UserInfo info;
+  if (get_user_info(name, 0, &info) < 0) {
     log_message(LOG_ERR, pamh, "Failed to look up user \"%s\"", name);
     return -1;
   }
-  *uid = pw->pw_uid;
-  free(buf);
+  *uid = info.uid;
+  clear_user_info(&info);
   return 0;
 }
 
@@ -1294,7 +2063,6 @@ static int parse_args(pam_handle_t *pamh, int argc, const char **argv,
   params->echocode = PAM_PROMPT_ECHO_OFF;
   for (int i = 0; i < argc; ++i) {
     if (!memcmp(argv[i], "secret=", 7)) {
-      free((void *)params->secret_filename_spec);
       params->secret_filename_spec = argv[i] + 7;
     } else if (!memcmp(argv[i], "user=", 5)) {
       uid_t uid;
@@ -1311,8 +2079,40 @@ static int parse_args(pam_handle_t *pamh, int argc, const char **argv,
       params->forward_pass = 1;
     } else if (!strcmp(argv[i], "noskewadj")) {
       params->noskewadj = 1;
+    } else if (!strcmp(argv[i], "hotp_resync")) {
+      params->hotp_resync = 1;
     } else if (!strcmp(argv[i], "nullok")) {
       params->nullok = NULLOK;
+    } else if (!memcmp(argv[i], "daemon=", 7)) {
+      params->daemon_socket = argv[i] + 7;
+    } else if (!strcmp(argv[i], "daemon")) {
+      params->daemon_socket = DAEMON_SOCKET;
+    } else if (!strcmp(argv[i], "timing")) {
+      params->timing = 1;
+    } else if (!strcmp(argv[i], "verify_session")) {
+      params->verify_session = 1;
+    } else if (!memcmp(argv[i], "log_rate_limit=", 15)) {
+      char *endptr;
+      errno = 0;
+      long limit = strtol(argv[i] + 15, &endptr, 10);
+      if (errno || limit < 0 || limit > INT_MAX || *endptr ||
+          endptr == argv[i] + 15) {
+        log_message(LOG_ERR, pamh, "Invalid log_rate_limit \"%s\"",
+                    argv[i] + 15);
+        return -1;
+      }
+      params->log_rate_limit = limit;
+    } else if (!memcmp(argv[i], "skew_search_range=", 18)) {
+      char *endptr;
+      errno = 0;
+      long range = strtol(argv[i] + 18, &endptr, 10);
+      if (errno || range < 1 || range > MAX_SKEW_SEARCH_RANGE || *endptr ||
+          endptr == argv[i] + 18) {
+        log_message(LOG_ERR, pamh, "Invalid skew_search_range \"%s\"",
+                    argv[i] + 18);
+        return -1;
+      }
+      params->skew_search_range = range;
     } else if (!strcmp(argv[i], "echo-verification-code") ||
                !strcmp(argv[i], "echo_verification_code")) {
       params->echocode = PAM_PROMPT_ECHO_ON;
@@ -1324,41 +2124,391 @@ static int parse_args(pam_handle_t *pamh, int argc, const char **argv,
   return 0;
 }
 
+// Module arguments only need to be parsed and validated once. The parsed
+// Params are kept together with a copy of the arguments; all strings in the
+// Params point into this copy.
+typedef struct ParamsCache {
+  int    argc;
+  size_t len;
+  char   *args;
+  Params params;
+} ParamsCache;
+
+#define PARAMS_DATA MODULE_NAME "_params"
+
+static void free_params_cache(ParamsCache *cache) {
+  if (cache) {
+    free(cache->args);
+    free(cache);
+  }
+}
+
+static void cleanup_params_cache(pam_handle_t *pamh, void *data,
+                                 int error_status) {
+  free_params_cache(data);
+}
+
+static int same_args(const ParamsCache *cache, int argc, const char **argv) {
+  if (argc != cache->argc) {
+    return 0;
+  }
+  const char *ptr = cache->args, *end = cache->args + cache->len;
+  for (int i = 0; i < argc; ++i) {
+    size_t len = strlen(argv[i]) + 1;
+    if (len > (size_t)(end - ptr) || memcmp(ptr, argv[i], len)) {
+      return 0;
+    }
+    ptr += len;
+  }
+  return 1;
+}
+
+// Copies and parses the arguments. Returns NULL on error.
+static ParamsCache *new_params_cache(pam_handle_t *pamh, int argc,
+                                     const char **argv) {
+  ParamsCache *cache = calloc(1, sizeof(ParamsCache));
+  const char **copy = calloc(argc + 1, sizeof(const char *));
+  if (cache && copy) {
+    cache->argc = argc;
+    for (int i = 0; i < argc; ++i) {
+      cache->len += strlen(argv[i]) + 1;
+    }
+    if ((cache->args = malloc(cache->len + 1))) {
+      char *ptr = cache->args;
+      for (int i = 0; i < argc; ++i) {
+        size_t len = strlen(argv[i]) + 1;
+        copy[i] = memcpy(ptr, argv[i], len);
+        ptr += len;
+      }
+      if (parse_args(pamh, argc, copy, &cache->params) < 0) {
+        free_params_cache(cache);
+        cache = NULL;
+      }
+      free(copy);
+      return cache;
+    }
+  }
+  log_message(LOG_ERR, pamh, "Out of memory");
+  free_params_cache(cache);
+  free(copy);
+  return NULL;
+}
+
+// Settings that are global to the process take effect, whenever a call uses
+// them.
+static void apply_params(const Params *params) {
+#if !defined(DEMO) && !defined(TESTING)
+  log_rate_limit = params->log_rate_limit;
+#endif
+}
+
+/* Returns the parsed module arguments. They are cached in the PAM handle, so
+ * that calling the module repeatedly (e.g. for "auth" and "session") only
+ * parses them once.
+ */
+static int get_params(pam_handle_t *pamh, int argc, const char **argv,
+                      Params *params) {
+  const void *data = NULL;
+  ParamsCache *cache = NULL;
+  if (pam_get_data(pamh, PARAMS_DATA, &data) == PAM_SUCCESS) {
+    cache = (ParamsCache *)data;
+  }
+  if (!cache || !same_args(cache, argc, argv)) {
+    if (!(cache = new_params_cache(pamh, argc, argv))) {
+      return -1;
+    }
+    if (pam_set_data(pamh, PARAMS_DATA, cache,
+                     cleanup_params_cache) != PAM_SUCCESS) {
+      // Without a place to keep the copy, the Params have to point into
+      // "argv" instead.
+      free_params_cache(cache);
+      memset(params, 0, sizeof(*params));
+      if (parse_args(pamh, argc, argv, params) < 0) {
+        return -1;
+      }
+      apply_params(params);
+      return 0;
+    }
+  }
+  *params = cache->params;
+  apply_params(params);
+  return 0;
+}
+
+// Sends a request to google-authenticatord, and waits for the reply. Both
+// are lists of NUL terminated strings. Returns the number of strings in the
+// reply, or -1 on error.
+static int daemon_request(pam_handle_t *pamh, int fd, const char **request,
+                          int count, char *reply, const char **fields) {
+  char packet[DAEMON_MAX_PACKET];
+  size_t len = 0;
+  for (int i = 0; i < count; ++i) {
+    size_t field_len = strlen(request[i]) + 1;
+    if (len + field_len > sizeof(packet)) {
+      log_message(LOG_ERR, pamh, "Request to google-authenticatord is too "
+                  "long");
+      memset(packet, 0, len);
+      return -1;
+    }
+    memcpy(packet + len, request[i], field_len);
+    len += field_len;
+  }
+  ssize_t reply_len = -1;
+  if (send(fd, packet, len, MSG_NOSIGNAL) != (ssize_t)len ||
+      (reply_len = recv(fd, reply, DAEMON_MAX_PACKET, 0)) <= 0 ||
+      reply[reply_len - 1]) {
+    log_message(LOG_ERR, pamh, "Failed to talk to google-authenticatord");
+    memset(packet, 0, len);
+    return -1;
+  }
+  memset(packet, 0, len);
+  int num_fields = 0;
+  for (char *ptr = reply; ptr < reply + reply_len; ptr += strlen(ptr) + 1) {
+    if (num_fields == DAEMON_MAX_FIELDS) {
+      break;
+    }
+    fields[num_fields++] = ptr;
+  }
+  return num_fields;
+}
+
+// Connects to google-authenticatord and starts a request for "username". The
+// daemon receives all of our arguments, so that it finds and interprets the
+// secret file in exactly the same way as we would. Returns the socket, or -1
+// if the request was rejected.
+static int daemon_connect(pam_handle_t *pamh, Params *params,
+                          const char *username, int argc, const char **argv) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(params->daemon_socket) >= sizeof(addr.sun_path)) {
+    log_message(LOG_ERR, pamh, "Socket name \"%s\" is too long",
+                params->daemon_socket);
+    return -1;
+  }
+  strcpy(addr.sun_path, params->daemon_socket);
+  struct timeval tv = { DAEMON_TIMEOUT, 0 };
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (fd < 0 ||
+      fcntl(fd, F_SETFD, FD_CLOEXEC) < 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0 ||
+      connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    log_message(LOG_ERR, pamh, "Failed to connect to \"%s\"",
+                params->daemon_socket);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+
+  const char *request[argc + 2];
+  request[0] = "AUTH";
+  request[1] = username;
+  memcpy(request + 2, argv, argc * sizeof(*argv));
+  char reply[DAEMON_MAX_PACKET];
+  const char *fields[DAEMON_MAX_FIELDS];
+  int num_fields = daemon_request(pamh, fd, request, argc + 2, reply, fields);
+  if (num_fields >= 1 && !strcmp(fields[0], "OK")) {
+    return fd;
+  }
+  if (num_fields >= 1 && !strcmp(fields[0], "NOSECRET") &&
+      params->nullok != NULLERR) {
+    params->nullok = SECRETNOTFOUND;
+  } else if (num_fields >= 2 && !strcmp(fields[0], "ERR")) {
+    log_message(LOG_ERR, pamh, "%s", fields[1]);
+  }
+  close(fd);
+  return -1;
+}
+
+// Asks google-authenticatord to check a code. Only the end of the password
+// is sent, as that is where the code is. Return values and the handling of
+// "pw" are the same as for check_code().
+static int daemon_check_code(pam_handle_t *pamh, int fd, int mode, char *pw,
+                             long *verified) {
+  int pw_len = strlen(pw);
+  char mode_str[12], len_str[12];
+  sprintf(mode_str, "%d", mode);
+  sprintf(len_str, "%d", pw_len);
+  const char *request[] = {
+    "CHECK", mode_str, len_str,
+    pw + (pw_len > DAEMON_TAIL_LENGTH ? pw_len - DAEMON_TAIL_LENGTH : 0) };
+  char reply[DAEMON_MAX_PACKET];
+  const char *fields[DAEMON_MAX_FIELDS];
+  int num_fields = daemon_request(pamh, fd, request, 4, reply, fields);
+  if (num_fields == 3 && !strcmp(fields[0], "OK")) {
+    int consumed = atoi(fields[1]);
+    if (consumed < 0 || consumed > pw_len) {
+      return -1;
+    }
+    memset(pw + pw_len - consumed, 0, consumed);
+    *verified = atol(fields[2]);
+    return 0;
+  }
+  if (num_fields == 1 && !strcmp(fields[0], "INVALID")) {
+    return 1;
+  }
+  if (num_fields >= 2 && !strcmp(fields[0], "ERR")) {
+    log_message(LOG_ERR, pamh, "%s", fields[1]);
+  }
+  return -1;
+}
+
+// Tells google-authenticatord whether we want to grant access. The daemon
+// persists the new state, and only then confirms. Returns the final result.
+static int daemon_disconnect(pam_handle_t *pamh, int fd, int rc) {
+  const char *request[] = { "END", rc == PAM_SUCCESS ? "0" : "1" };
+  char reply[DAEMON_MAX_PACKET];
+  const char *fields[DAEMON_MAX_FIELDS];
+  int num_fields = daemon_request(pamh, fd, request, 2, reply, fields);
+  close(fd);
+  if (num_fields >= 1 && !strcmp(fields[0], "OK")) {
+    return rc;
+  }
+  if (rc == PAM_SUCCESS && num_fields >= 2 && !strcmp(fields[0], "ERR")) {
+    log_message(LOG_ERR, pamh, "%s", fields[1]);
+  }
+  return PAM_SESSION_ERR;
+}
+
+// If the module is configured for both "auth" and "session", a verified
+// code is remembered in the PAM handle. Opening the session then does not
+// need to prompt, or touch the secret file, again. This only applies if the
+// session uses the same secret file.
+#define AUTH_DATA MODULE_NAME "_authenticated"
+
+typedef struct AuthRecord {
+  char *username;
+  char *secret_filename;
+  int  uid;
+  long verified;  // Time step or counter value; zero for scratch codes
+} AuthRecord;
+
+static void cleanup_auth_data(pam_handle_t *pamh, void *data,
+                              int error_status) {
+  AuthRecord *record = (AuthRecord *)data;
+  free(record->username);
+  free(record->secret_filename);
+  free(record);
+}
+
+static void forget_authentication(pam_handle_t *pamh) {
+  pam_set_data(pamh, AUTH_DATA, NULL, NULL);
+}
+
+static void remember_authentication(pam_handle_t *pamh, const Params *params,
+                                    long verified) {
+  const char *username = get_user_name(pamh);
+  AuthRecord *record = username ? calloc(1, sizeof(AuthRecord)) : NULL;
+  if (!record) {
+    return;
+  }
+  record->verified = verified;
+  if (!(record->username = strdup(username)) ||
+      !(record->secret_filename = get_secret_filename(pamh, params, username,
+                                                      &record->uid)) ||
+      pam_set_data(pamh, AUTH_DATA, record, cleanup_auth_data) !=
+        PAM_SUCCESS) {
+    cleanup_auth_data(pamh, record, 0);
+  }
+}
+
+// Returns 1, if the current user was authenticated by this module earlier
+// in the same PAM transaction, with the same secret file that "params" refer
+// to. The result is forgotten after checking it, so that it can be used at
+// most once.
+static int already_authenticated(pam_handle_t *pamh, const Params *params) {
+  const void *data = NULL;
+  if (pam_get_data(pamh, AUTH_DATA, &data) != PAM_SUCCESS || !data) {
+    return 0;
+  }
+  const AuthRecord *record = (const AuthRecord *)data;
+  const char *username = get_user_name(pamh);
+  int uid = -1;
+  char *secret_filename = username && !strcmp(username, record->username)
+    ? get_secret_filename(pamh, params, username, &uid) : NULL;
+  int rc = secret_filename && uid == record->uid &&
+           !strcmp(secret_filename, record->secret_filename);
+  free(secret_filename);
+  forget_authentication(pamh);
+  return rc;
+}
+
 static int google_authenticator(pam_handle_t *pamh, int flags,
-                                int argc, const char **argv) {
+                                int argc, const char **argv, int session) {
   int        rc = PAM_SESSION_ERR;
   const char *username;
   char       *secret_filename = NULL;
-  int        uid = -1, old_uid = -1, old_gid = -1, fd = -1;
-  off_t      filesize = 0;
-  time_t     mtime = 0;
-  char       *buf = NULL;
+  int        uid = -1, old_uid = -1, old_gid = -1, fd = -1, daemon_fd = -1;
+  int        dir_fd = -1, lock_fd = -1, passes = 0;
+  FileStamp  stamp = { 0 };
+  SecretState state = { 0 };
   uint8_t    *secret = NULL;
   int        secretLen = 0;
+  OtpKey     key = { 0 };
+  char       *saved_pw = NULL;
+  Timing     timing = { 0 };
 
 #if defined(DEMO) || defined(TESTING)
   *error_msg = '\000';
 #endif
 
   // Handle optional arguments that configure our PAM module
-  Params params = { 0 };
-  if (parse_args(pamh, argc, argv, &params) < 0) {
+  Params params;
+  if (get_params(pamh, argc, argv, &params) < 0) {
     return rc;
   }
+  if (!session) {
+    // An earlier authentication does not carry over to this one.
+    forget_authentication(pamh);
+  } else if (!params.verify_session && already_authenticated(pamh, &params)) {
+    return PAM_SUCCESS;
+  }
+  if (params.timing) {
+    timing_start(&timing);
+  }
 
   // Read and process status file, then ask the user for the verification code.
-  int early_updated = 0, updated = 0;
+  // If configured to use google-authenticatord, the daemon does all of the
+  // file handling, and we only relay the user's input.
+  // If another login changes the file before we can write our own changes,
+  // we come back here. We then hold the lock, read the file again, and
+  // re-evaluate the same input without prompting the user a second time.
+  // Only logins that verified a code are remembered for opening the session.
+  // "nullok" lets users without a secret file in, without verifying anything.
+  int early_updated, updated, verified;
+  long step;
+ retry:
+  early_updated = updated = verified = 0;
+  step = 0;
   if ((username = get_user_name(pamh)) &&
-      (secret_filename = get_secret_filename(pamh, &params, username, &uid)) &&
-      !drop_privileges(pamh, username, uid, &old_uid, &old_gid) &&
-      (fd = open_secret_file(pamh, secret_filename, &params, username, uid,
-                             &filesize, &mtime)) >= 0 &&
-      (buf = read_file_contents(pamh, secret_filename, &fd, filesize)) &&
-      (secret = get_shared_secret(pamh, secret_filename, buf, &secretLen)) &&
-       rate_limit(pamh, secret_filename, &early_updated, &buf) >= 0) {
-    long hotp_counter = get_hotp_counter(pamh, buf);
+      (params.daemon_socket
+       ? ((daemon_fd = daemon_connect(pamh, &params, username,
+                                      argc, argv)) >= 0 &&
+          timing_mark(&timing, T_READ))
+       : ((secret_filename = get_secret_filename(pamh, &params, username,
+                                                 &uid)) &&
+          timing_mark(&timing, T_USER) &&
+          !drop_privileges(pamh, username, uid, &old_uid, &old_gid) &&
+          timing_mark(&timing, T_PRIVS) &&
+          (fd = open_secret_file(pamh, secret_filename, &dir_fd, &params,
+                                 username, uid, &stamp)) >= 0 &&
+          !read_file_contents(pamh, &state, secret_filename, &fd,
+                              stamp.size) &&
+          timing_mark(&timing, T_READ) &&
+          (secret = get_shared_secret(pamh, secret_filename, state.secret,
+                                      &secretLen)) &&
+          rate_limit(pamh, secret_filename, &early_updated, &state) >= 0 &&
+          otp_parameters(pamh, secret_filename, &state, &key) >= 0 &&
+          timing_mark(&timing, T_SETUP)))) {
+    // Absorb the shared secret into the HMAC state once. All verification
+    // codes are then computed from the cached state.
+    long hotp_counter = 0;
+    if (secret) {
+      init_otp_key(&key, secret, secretLen);
+      hotp_counter = state.hotp_counter;
+    }
     int must_advance_counter = 0;
-    char *pw = NULL, *saved_pw = NULL;
+    char *pw = NULL;
     for (int mode = 0; mode < 4; ++mode) {
       // In the case of TRY_FIRST_PASS, we don't actually know whether we
       // get the verification code from the system password or from prompting
@@ -1414,73 +2564,24 @@ static int google_authenticator(pam_handle_t *pamh, int flags,
         continue;
       }
 
-      // We are often dealing with a combined password and verification
-      // code. Separate them now.
       int pw_len = strlen(pw);
-      int expected_len = mode & 1 ? 8 : 6;
-      char ch;
-      if (pw_len < expected_len ||
-          // Verification are six digits starting with '0'..'9',
-          // scratch codes are eight digits starting with '1'..'9'
-          (ch = pw[pw_len - expected_len]) > '9' ||
-          ch < (expected_len == 8 ? '1' : '0')) {
-      invalid:
+      timing_mark(&timing, T_PROMPT);
+      int code_rc = params.daemon_socket
+        ? daemon_check_code(pamh, daemon_fd, mode, pw, &step)
+        : check_code(pamh, secret_filename, &updated, &state, &key,
+                     &params, hotp_counter, &must_advance_counter, mode, pw,
+                     &step);
+      timing_mark(&timing, T_VERIFY);
+      switch (code_rc) {
+      case 0:
+        rc = PAM_SUCCESS;
+        verified = 1;
+        break;
+      case 1:
         memset(pw, 0, pw_len);
         free(pw);
         pw = NULL;
         continue;
-      }
-      char *endptr;
-      errno = 0;
-      long l = strtol(pw + pw_len - expected_len, &endptr, 10);
-      if (errno || l < 0 || *endptr) {
-        goto invalid;
-      }
-      int code = (int)l;
-      memset(pw + pw_len - expected_len, 0, expected_len);
-
-      if ((mode == 2 || mode == 3) && !params.forward_pass) {
-        // We are explicitly configured so that we don't try to share
-        // the password with any other stacked PAM module. We must
-        // therefore verify that the user entered just the verification
-        // code, but no password.
-        if (*pw) {
-          goto invalid;
-        }
-      }
-
-      // Check all possible types of verification codes.
-      switch (check_scratch_codes(pamh, secret_filename, &updated, buf, code)){
-      case 1:
-        if (hotp_counter > 0) {
-          switch (check_counterbased_code(pamh, secret_filename, &updated,
-                                          &buf, secret, secretLen, code,
-                                          &params, hotp_counter,
-                                          &must_advance_counter)) {
-          case 0:
-            rc = PAM_SUCCESS;
-            break;
-          case 1:
-            goto invalid;
-          default:
-            break;
-          }
-        } else {
-          switch (check_timebased_code(pamh, secret_filename, &updated, &buf,
-                                       secret, secretLen, code, &params)) {
-          case 0:
-            rc = PAM_SUCCESS;
-            break;
-          case 1:
-            goto invalid;
-          default:
-            break;
-          }
-        }
-        break;
-      case 0:
-        rc = PAM_SUCCESS;
-        break;
       default:
         break;
       }
@@ -1502,17 +2603,18 @@ static int google_authenticator(pam_handle_t *pamh, int flags,
       memset(pw, 0, strlen(pw));
       free(pw);
     }
-    if (saved_pw) {
-      memset(saved_pw, 0, strlen(saved_pw));
-      free(saved_pw);
+
+    // The daemon needs to hear our verdict, before it can commit its state.
+    if (daemon_fd >= 0) {
+      rc = daemon_disconnect(pamh, daemon_fd, rc);
     }
 
     // If an hotp login attempt has been made, the counter must always be
     // advanced by at least one.
     if (must_advance_counter) {
-      char counter_str[40];
-      sprintf(counter_str, "%ld", hotp_counter + 1);
-      if (set_cfg_value(pamh, "HOTP_COUNTER", counter_str, &buf) < 0) {
+      state.hotp_counter = hotp_counter + 1;
+      if (secret_state_update(&state, OPT_HOTP_COUNTER) < 0) {
+        log_message(LOG_ERR, pamh, "Out of memory");
         rc = PAM_SESSION_ERR;
       }
       updated = 1;
@@ -1522,6 +2624,7 @@ static int google_authenticator(pam_handle_t *pamh, int flags,
     if (rc != PAM_SUCCESS) {
       log_message(LOG_ERR, pamh, "Invalid verification code");
     }
+    timing_mark(&timing, T_VERIFY);
   }
 
   // If the user has not created a state file with a shared secret, and if
@@ -1532,47 +2635,325 @@ static int google_authenticator(pam_handle_t *pamh, int flags,
   }
 
   // Persist the new state.
+  int write_rc = 0;
   if (early_updated || updated) {
-    if (write_file_contents(pamh, secret_filename, filesize,
-                            mtime, buf) < 0) {
+    write_rc = write_file_contents(pamh, dir_fd, secret_filename, &lock_fd,
+                                   &stamp, &state, NULL);
+    timing_mark(&timing, T_WRITE);
+    if (write_rc > 0 && ++passes >= MAX_PASSES) {
+      log_message(LOG_ERR, pamh,
+                  "Secret file \"%s\" changed while trying to use "
+                  "scratch code\n", secret_filename);
+    }
+    if (write_rc) {
       // Could not persist new state. Deny access.
       rc = PAM_SESSION_ERR;
     }
   }
   if (fd >= 0) {
     close(fd);
+    fd = -1;
   }
-  if (old_gid >= 0) {
-    if (setgroup(old_gid) >= 0 && setgroup(old_gid) == old_gid) {
-      old_gid = -1;
-    }
-  }
-  if (old_uid >= 0) {
-    if (setuser(old_uid) < 0 || setuser(old_uid) != old_uid) {
-      log_message(LOG_EMERG, pamh, "We switched users from %d to %d, "
-                  "but can't switch back", old_uid, uid);
-    }
+  if (dir_fd >= 0) {
+    close(dir_fd);
+    dir_fd = -1;
   }
+  restore_privileges(pamh, old_uid, old_gid, uid);
+  old_uid = old_gid = -1;
   free(secret_filename);
+  secret_filename = NULL;
 
   // Clean up
-  if (buf) {
-    memset(buf, 0, strlen(buf));
-    free(buf);
-  }
+  secret_state_clear(&state);
   if (secret) {
     memset(secret, 0, secretLen);
     free(secret);
+    secret = NULL;
+  }
+  clear_otp_key(&key);
+  if (write_rc > 0 && passes < MAX_PASSES) {
+    rc = PAM_SESSION_ERR;
+    goto retry;
+  }
+  if (lock_fd >= 0) {
+    close(lock_fd);
+  }
+  if (saved_pw) {
+    memset(saved_pw, 0, strlen(saved_pw));
+    free(saved_pw);
+  }
+  timing_report(pamh, &timing, passes, rc);
+  if (!session && rc == PAM_SUCCESS && verified) {
+    remember_authentication(pamh, &params, step);
   }
   return rc;
 }
 
+#ifdef DAEMON
+// google-authenticatord keeps one of these for each user. The decoded secret
+// file stays in memory between requests, and is only read again, if the file
+// changed on disk.
+struct CachedUser {
+  char       *secret_filename;
+  int        uid;
+  FileStamp  stamp;
+  SecretState state;
+  uint8_t    *secret;
+  int        secretLen;
+  OtpKey     key;
+  CodeTable  *codes;
+
+  // The arguments rarely change between requests.
+  ParamsCache *params_cache;
+
+  // Several requests can be in progress at the same time, while their users
+  // are typing. The generation changes, whenever the cached secret file is
+  // discarded. Requests that started with an older generation fail.
+  int        requests;
+  unsigned   generation;
+};
+
+// State of a single request. It belongs to the connection, not to the user.
+struct CachedRequest {
+  ParamsCache *own_params;
+  Params     params;
+  int        uid, old_uid, old_gid;
+  int        dir_fd;
+  int        early_updated, updated;
+  long       hotp_counter;
+  int        must_advance_counter;
+  unsigned   generation;
+  int        started;
+};
+
+static void forget_secret(CachedUser *user) {
+  secret_state_clear(&user->state);
+  if (user->secret) {
+    memset(user->secret, 0, user->secretLen);
+    free(user->secret);
+    user->secret = NULL;
+  }
+  clear_otp_key(&user->key);
+  ++user->generation;
+}
+
+CachedUser *cached_user_new(void) {
+  CachedUser *user = calloc(1, sizeof(CachedUser));
+  if (user) {
+    user->uid = -1;
+  }
+  return user;
+}
+
+void cached_user_free(CachedUser *user) {
+  if (user) {
+    forget_secret(user);
+    if (user->codes) {
+      memset(user->codes, 0, SKEW_WINDOWS*sizeof(*user->codes));
+      free(user->codes);
+    }
+    free(user->secret_filename);
+    free_params_cache(user->params_cache);
+    free(user);
+  }
+}
+
+CachedRequest *cached_request_new(void) {
+  CachedRequest *request = calloc(1, sizeof(CachedRequest));
+  if (request) {
+    request->uid = request->old_uid = request->old_gid = -1;
+    request->dir_fd = -1;
+  }
+  return request;
+}
+
+void cached_request_free(CachedRequest *request) {
+  if (request) {
+    free_params_cache(request->own_params);
+    free(request);
+  }
+}
+
+const char *cached_user_error(void) {
+  return error_msg;
+}
+
+int cached_user_begin(CachedUser *user, CachedRequest *request,
+                      const char *username, int argc, const char **argv) {
+  *error_msg = '\000';
+  request->started = 1;
+  ++user->requests;
+  if (!user->params_cache || !same_args(user->params_cache, argc, argv)) {
+    ParamsCache *cache = new_params_cache(NULL, argc, argv);
+    if (!cache) {
+      return -1;
+    }
+    if (user->requests == 1) {
+      free_params_cache(user->params_cache);
+      user->params_cache = cache;
+    } else {
+      // Other requests still use the old arguments.
+      request->own_params = cache;
+    }
+  }
+  request->params = request->own_params
+    ? request->own_params->params : user->params_cache->params;
+  apply_params(&request->params);
+
+  // The arguments decide where the secret file is. Start over, if they point
+  // somewhere else than last time.
+  char *secret_filename = get_secret_filename(NULL, &request->params,
+                                              username, &request->uid);
+  if (!secret_filename) {
+    return -1;
+  }
+  if (!user->secret_filename || request->uid != user->uid ||
+      strcmp(secret_filename, user->secret_filename)) {
+    forget_secret(user);
+    free(user->secret_filename);
+    user->secret_filename = secret_filename;
+    user->uid = request->uid;
+  } else {
+    free(secret_filename);
+  }
+  if (drop_privileges(NULL, username, request->uid, &request->old_uid,
+                      &request->old_gid)) {
+    return -1;
+  }
+
+  // Opening the file also checks its permissions. Only read and decode it,
+  // if it changed since we last looked at it.
+  FileStamp stamp;
+  int fd = open_secret_file(NULL, user->secret_filename, &request->dir_fd,
+                            &request->params, username, request->uid,
+                            &stamp);
+  if (fd < 0) {
+    forget_secret(user);
+    return request->params.nullok == SECRETNOTFOUND ? 1 : -1;
+  }
+  if (!user->state.lines || !same_file_stamp(&stamp, &user->stamp)) {
+    forget_secret(user);
+    if (read_file_contents(NULL, &user->state, user->secret_filename, &fd,
+                           stamp.size) < 0 ||
+        !(user->secret = get_shared_secret(NULL, user->secret_filename,
+                                           user->state.secret,
+                                           &user->secretLen)) ||
+        otp_parameters(NULL, user->secret_filename, &user->state,
+                       &user->key) < 0) {
+      forget_secret(user);
+      return -1;
+    }
+    init_otp_key(&user->key, user->secret, user->secretLen);
+    user->stamp = stamp;
+  } else {
+    close(fd);
+  }
+
+  // Each user has their own tables of precomputed codes. If they cannot be
+  // allocated, the tables that are shared by all users work just as well.
+  if (!user->codes) {
+    user->codes = calloc(SKEW_WINDOWS, sizeof(*user->codes));
+  }
+  user->key.table = user->codes;
+
+  if (rate_limit(NULL, user->secret_filename, &request->early_updated,
+                 &user->state) < 0) {
+    return -1;
+  }
+  request->hotp_counter = user->state.hotp_counter;
+  request->generation = user->generation;
+  return 0;
+}
+
+// Returns non-zero, if the cached secret file is still the one that
+// "request" started with.
+static int same_generation(const CachedUser *user,
+                           const CachedRequest *request) {
+  return user->state.lines && request->generation == user->generation;
+}
+
+int cached_user_check(CachedUser *user, CachedRequest *request,
+                      int mode, char *pw, long *verified) {
+  if (!same_generation(user, request)) {
+    log_message(LOG_ERR, NULL, "Secret file \"%s\" changed during login",
+                user->secret_filename);
+    return -1;
+  }
+
+  // Other requests might have used up counter values in the meantime.
+  request->hotp_counter = user->state.hotp_counter;
+  return check_code(NULL, user->secret_filename, &request->updated,
+                    &user->state, &user->key, &request->params,
+                    request->hotp_counter, &request->must_advance_counter,
+                    mode, pw, verified);
+}
+
+int cached_user_end(CachedUser *user, CachedRequest *request, int rc) {
+  if (!request->started) {
+    return rc;
+  }
+  if (!same_generation(user, request)) {
+    rc = PAM_SESSION_ERR;
+  } else {
+    // If an hotp login attempt has been made, the counter must always be
+    // advanced by at least one.
+    if (request->must_advance_counter &&
+        user->state.hotp_counter <= request->hotp_counter) {
+      user->state.hotp_counter = request->hotp_counter + 1;
+      if (secret_state_update(&user->state, OPT_HOTP_COUNTER) < 0) {
+        log_message(LOG_ERR, NULL, "Out of memory");
+        rc = PAM_SESSION_ERR;
+      }
+      request->updated = 1;
+    }
+
+    // Persist the new state, and remember what the file that we wrote looks
+    // like. The PAM module and "google-authenticator" might still write the
+    // file directly. If they replace it afterwards, its stamp no longer
+    // matches, and the next request reads it again. If anything goes wrong,
+    // the cached copy can no longer be trusted. There is no retry, as the
+    // login attempt was evaluated against the old contents.
+    if (request->early_updated || request->updated) {
+      FileStamp stamp;
+      int lock_fd = -1;
+      int write_rc = write_file_contents(NULL, request->dir_fd,
+                                         user->secret_filename,
+                                         &lock_fd, &user->stamp,
+                                         &user->state, &stamp);
+      if (write_rc > 0) {
+        log_message(LOG_ERR, NULL,
+                    "Secret file \"%s\" changed while trying to use "
+                    "scratch code\n", user->secret_filename);
+      }
+      if (write_rc) {
+        rc = PAM_SESSION_ERR;
+        forget_secret(user);
+      } else {
+        user->stamp = stamp;
+      }
+      if (lock_fd >= 0) {
+        close(lock_fd);
+      }
+    }
+  }
+  if (request->dir_fd >= 0) {
+    close(request->dir_fd);
+    request->dir_fd = -1;
+  }
+  restore_privileges(NULL, request->old_uid, request->old_gid, request->uid);
+  request->old_uid = request->old_gid = -1;
+  request->started = 0;
+  --user->requests;
+  return rc;
+}
+#endif
+
 PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags,
                                    int argc, const char **argv)
   __attribute__((visibility("default")));
 PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags,
                                    int argc, const char **argv) {
-  return google_authenticator(pamh, flags, argc, argv);
+  return google_authenticator(pamh, flags, argc, argv, 0);
 }
 
 PAM_EXTERN int pam_sm_setcred(pam_handle_t *pamh, int flags, int argc,
@@ -1588,7 +2969,7 @@ PAM_EXTERN int pam_sm_open_session(pam_handle_t *pamh, int flags,
   __attribute__((visibility("default")));
 PAM_EXTERN int pam_sm_open_session(pam_handle_t *pamh, int flags,
                                    int argc, const char **argv) {
-  return google_authenticator(pamh, flags, argc, argv);
+  return google_authenticator(pamh, flags, argc, argv, 1);
 }
 
 #ifdef PAM_STATIC
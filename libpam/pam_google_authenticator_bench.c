@@ -0,0 +1,494 @@
+// Benchmarks for the PAM module. This is part of the Google Authenticator
+// project.
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <assert.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <security/pam_appl.h>
+#include <security/pam_modules.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "base32.h"
+#include "hmac.h"
+#include "secret_state.h"
+#include "sha1.h"
+
+#if !defined(PAM_BAD_ITEM)
+#define PAM_BAD_ITEM PAM_SYMBOL_ERR
+#endif
+
+// Each benchmark runs for at least this long.
+#define MIN_DURATION_NS 200000000ull
+#define MAX_RESULTS     64
+
+static const uint8_t secret[] = "2SH3V3GDW7ZNMGYE";
+static char *response = "";
+static void *pam_module;
+
+static struct {
+  char               name[64];
+  unsigned long long ops, ns;
+  double             hit_rate;          // Negative, if not applicable
+} results[MAX_RESULTS];
+static int num_results;
+
+static int conversation(int num_msg, const struct pam_message **msg,
+                        struct pam_response **resp, void *appdata_ptr) {
+  if (num_msg == 1 && msg[0]->msg_style == PAM_PROMPT_ECHO_OFF) {
+    *resp = malloc(sizeof(struct pam_response));
+    assert(*resp);
+    (*resp)->resp = strdup(response);
+    (*resp)->resp_retcode = 0;
+    return PAM_SUCCESS;
+  }
+  return PAM_CONV_ERR;
+}
+
+#ifdef sun
+#define PAM_CONST
+#else
+#define PAM_CONST const
+#endif
+int pam_get_item(const pam_handle_t *pamh, int item_type,
+                 PAM_CONST void **item)
+  __attribute__((visibility("default")));
+int pam_get_item(const pam_handle_t *pamh, int item_type,
+                 PAM_CONST void **item) {
+  switch (item_type) {
+    case PAM_SERVICE: {
+      static const char *service = "google_authenticator_bench";
+      memcpy(item, &service, sizeof(&service));
+      return PAM_SUCCESS;
+    }
+    case PAM_USER: {
+      char *user = getenv("USER");
+      memcpy(item, &user, sizeof(&user));
+      return PAM_SUCCESS;
+    }
+    case PAM_CONV: {
+      static struct pam_conv conv = { .conv = conversation }, *p_conv = &conv;
+      memcpy(item, &p_conv, sizeof(p_conv));
+      return PAM_SUCCESS;
+    }
+    default:
+      return PAM_BAD_ITEM;
+  }
+}
+
+int pam_set_item(pam_handle_t *pamh, int item_type,
+                 PAM_CONST void *item)
+  __attribute__((visibility("default")));
+int pam_set_item(pam_handle_t *pamh, int item_type,
+                 PAM_CONST void *item) {
+  return PAM_BAD_ITEM;
+}
+
+// The module keeps parsed state in the PAM handle between calls.
+static struct {
+  const char *name;
+  void       *data;
+  void       (*cleanup)(pam_handle_t *pamh, void *data, int error_status);
+} pam_data[4];
+
+int pam_set_data(pam_handle_t *pamh, const char *module_data_name,
+                 void *data, void (*cleanup)(pam_handle_t *pamh, void *data,
+                                             int error_status))
+  __attribute__((visibility("default")));
+int pam_set_data(pam_handle_t *pamh, const char *module_data_name,
+                 void *data, void (*cleanup)(pam_handle_t *pamh, void *data,
+                                             int error_status)) {
+  for (int i = 0; i < sizeof(pam_data)/sizeof(*pam_data); ++i) {
+    if (!pam_data[i].name || !strcmp(pam_data[i].name, module_data_name)) {
+      if (pam_data[i].cleanup) {
+        pam_data[i].cleanup(pamh, pam_data[i].data, 0);
+      }
+      pam_data[i].name = module_data_name;
+      pam_data[i].data = data;
+      pam_data[i].cleanup = cleanup;
+      return PAM_SUCCESS;
+    }
+  }
+  return PAM_BUF_ERR;
+}
+
+int pam_get_data(const pam_handle_t *pamh, const char *module_data_name,
+                 const void **data)
+  __attribute__((visibility("default")));
+int pam_get_data(const pam_handle_t *pamh, const char *module_data_name,
+                 const void **data) {
+  for (int i = 0; i < sizeof(pam_data)/sizeof(*pam_data); ++i) {
+    if (pam_data[i].name && !strcmp(pam_data[i].name, module_data_name)) {
+      *data = pam_data[i].data;
+      return PAM_SUCCESS;
+    }
+  }
+  return PAM_NO_MODULE_DATA;
+}
+
+static unsigned long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+static void record(const char *name, unsigned long long ops,
+                   unsigned long long ns) {
+  assert(num_results < MAX_RESULTS);
+  snprintf(results[num_results].name, sizeof(results[num_results].name),
+           "%s", name);
+  results[num_results].ops = ops;
+  results[num_results].ns = ns;
+  results[num_results].hit_rate = -1;
+  ++num_results;
+  fprintf(stderr, ".");
+}
+
+// Runs "fn" until at least MIN_DURATION_NS have passed, and records the
+// average time per call.
+#define BENCH(name, fn) do {                                                  \
+    unsigned long long ops_ = 0, start_ = now_ns(), ns_;                      \
+    do {                                                                      \
+      for (int i_ = 0; i_ < 100; ++i_, ++ops_) {                              \
+        fn;                                                                   \
+      }                                                                       \
+    } while ((ns_ = now_ns() - start_) < MIN_DURATION_NS);                    \
+    record(name, ops_, ns_);                                                  \
+  } while (0)
+
+static void bench_sha1(void) {
+  static uint8_t buf[4096];
+  uint8_t digest[SHA1_DIGEST_LENGTH];
+  SHA1_INFO ctx;
+  BENCH("sha1 (64 bytes)",
+        (sha1_init(&ctx), sha1_update(&ctx, buf, 64),
+         sha1_final(&ctx, digest)));
+  BENCH("sha1 (4096 bytes)",
+        (sha1_init(&ctx), sha1_update(&ctx, buf, sizeof(buf)),
+         sha1_final(&ctx, digest)));
+}
+
+static void bench_hmac(void) {
+  uint8_t key[10], hash[SHA1_DIGEST_LENGTH], hashes[64][SHA1_DIGEST_LENGTH];
+  uint8_t counter[8] = { 0 };
+  base32_decode(secret, key, sizeof(key));
+  HMAC_SHA1_KEY ctx;
+  hmac_sha1_init_key(&ctx, key, sizeof(key));
+  BENCH("hmac_sha1", hmac_sha1(key, sizeof(key), counter, sizeof(counter),
+                               hash, sizeof(hash)));
+  BENCH("hmac_sha1_counter (cached key)",
+        hmac_sha1_counter(&ctx, ops_, hash));
+  BENCH("hmac_sha1_counters (64 counters)",
+        hmac_sha1_counters(&ctx, ops_, 64, hashes));
+  hmac_sha1_clear_key(&ctx);
+}
+
+static void bench_base32(void) {
+  uint8_t key[10], encoded[32];
+  base32_decode(secret, key, sizeof(key));
+  BENCH("base32_encode (10 bytes)",
+        base32_encode(key, sizeof(key), encoded, sizeof(encoded)));
+  BENCH("base32_decode (16 characters)",
+        base32_decode(secret, key, sizeof(key)));
+}
+
+static void bench_compute_code(void) {
+  int (*compute_code)(const uint8_t *, int, unsigned long) =
+    (int (*)(const uint8_t *, int, unsigned long))
+    dlsym(pam_module, "compute_code");
+  assert(compute_code);
+  uint8_t key[10];
+  base32_decode(secret, key, sizeof(key));
+  BENCH("compute_code", compute_code(key, sizeof(key), ops_));
+}
+
+// Replaces the contents of the secret file.
+static void write_secret_file(const char *fn, const char *contents) {
+  chmod(fn, 0600);
+  int fd = open(fn, O_WRONLY | O_TRUNC);
+  assert(fd >= 0);
+  assert(write(fd, contents, strlen(contents)) == strlen(contents));
+  close(fd);
+}
+
+static void bench_logins(void) {
+  int (*pam_sm_open_session)(pam_handle_t *, int, int, const char **) =
+    (int (*)(pam_handle_t *, int, int, const char **))
+    dlsym(pam_module, "pam_sm_open_session");
+  void (*set_time)(time_t t) =
+    (void (*)(time_t))dlsym(pam_module, "set_time");
+  int (*compute_code)(const uint8_t *, int, unsigned long) =
+    (int (*)(const uint8_t *, int, unsigned long))
+    dlsym(pam_module, "compute_code");
+  assert(pam_sm_open_session && set_time && compute_code);
+
+  char fn[] = "/tmp/.google_authenticator_bench_XXXXXX";
+  int fd = mkstemp(fn);
+  assert(fd >= 0);
+  close(fd);
+  char arg[sizeof(fn) + 8];
+  sprintf(arg, "secret=%s", fn);
+  const char *argv[] = { arg };
+  uint8_t key[10];
+  base32_decode(secret, key, sizeof(key));
+  char code[7];
+  set_time(10000*30);
+  sprintf(code, "%06d", compute_code(key, sizeof(key), 10000));
+
+  // Without DISALLOW_REUSE, the same code can be used over and over again.
+  // Successful logins then never have to write the file.
+  write_secret_file(fn, "2SH3V3GDW7ZNMGYE\n\" TOTP_AUTH\n");
+  response = code;
+  BENCH("totp login (success)",
+        assert(pam_sm_open_session(NULL, 0, 1, argv) == PAM_SUCCESS));
+
+  // Invalid codes make the module search for a time skew.
+  response = "000000";
+  if (compute_code(key, sizeof(key), 10000) == 0) {
+    response = "111111";
+  }
+  BENCH("totp login (failure, skew search)",
+        assert(pam_sm_open_session(NULL, 0, 1, argv) == PAM_SESSION_ERR));
+
+  // Each scratch code can only be used once. Rewriting the file is not
+  // included in the measurement.
+  unsigned long long ops = 0, ns = 0, start = now_ns();
+  do {
+    write_secret_file(fn, "2SH3V3GDW7ZNMGYE\n\" TOTP_AUTH\n"
+                          "12345678\n23456789\n34567890\n45678901\n");
+    static char *scratch_codes[] = { "12345678", "23456789", "34567890",
+                                     "45678901" };
+    for (int i = 0; i < 4; ++i, ++ops) {
+      response = scratch_codes[i];
+      unsigned long long t = now_ns();
+      assert(pam_sm_open_session(NULL, 0, 1, argv) == PAM_SUCCESS);
+      ns += now_ns() - t;
+    }
+  } while (now_ns() - start < MIN_DURATION_NS);
+  record("scratch code login", ops, ns);
+
+  // Failed counter-based logins advance the counter. With "hotp_resync",
+  // they also compute the codes for the next 10000 counter values. This
+  // takes the same time, whether a code is found or not.
+  const char *resync_argv[] = { arg, "hotp_resync" };
+  response = "000000";
+  write_secret_file(fn, "2SH3V3GDW7ZNMGYE\n\" HOTP_COUNTER 1\n");
+  BENCH("hotp login (failure)", pam_sm_open_session(NULL, 0, 1, argv));
+  write_secret_file(fn, "2SH3V3GDW7ZNMGYE\n\" HOTP_COUNTER 1\n");
+  BENCH("hotp login (failure, hotp_resync)",
+        pam_sm_open_session(NULL, 0, 2, resync_argv));
+
+  // Rate limited logins have to update the file every time.
+  static const int sizes[] = { 1, 10, 100 };
+  for (int i = 0; i < sizeof(sizes)/sizeof(*sizes); ++i) {
+    char *contents = malloc(128 + 12*sizes[i]);
+    assert(contents);
+    char *ptr = contents + sprintf(contents, "2SH3V3GDW7ZNMGYE\n"
+                                   "\" TOTP_AUTH\n\" RATE_LIMIT %d 3600",
+                                   sizes[i]);
+    for (int j = 0; j < sizes[i]; ++j) {
+      ptr += sprintf(ptr, " %d", 10000*30 - 1000 + j);
+    }
+    strcpy(ptr, "\n");
+    write_secret_file(fn, contents);
+    free(contents);
+    response = code;
+    char name[64];
+    sprintf(name, "totp login (RATE_LIMIT %d)", sizes[i]);
+    BENCH(name, pam_sm_open_session(NULL, 0, 1, argv));
+  }
+  unlink(fn);
+}
+
+// Time skews that users' phones had, when they tried to log in, and how often
+// each of them was seen, in percent. Most phones are within a few steps of
+// the server. Some were set to the wrong time zone.
+static const struct {
+  int skew, weight;
+} skew_distribution[] = {
+  { 0, 40 }, { -1, 14 }, { 1, 14 }, { -2, 5 }, { 2, 5 }, { -10, 3 },
+  { 10, 3 }, { -60, 2 }, { 60, 2 }, { -120, 3 }, { 120, 3 }, { -240, 1 },
+  { 240, 1 }, { -480, 1 }, { 480, 1 }, { 1440, 1 }, { -1440, 1 }
+};
+
+// Compares how long the search for a time skew takes with different
+// "skew_search_range" arguments, and how many of the skews in
+// skew_distribution[] each of them finds. The tables of precomputed codes
+// never help here, because every attempt happens at a different time.
+static void bench_skew_search(void) {
+  int (*pam_sm_open_session)(pam_handle_t *, int, int, const char **) =
+    (int (*)(pam_handle_t *, int, int, const char **))
+    dlsym(pam_module, "pam_sm_open_session");
+  void (*set_time)(time_t t) =
+    (void (*)(time_t))dlsym(pam_module, "set_time");
+  int (*compute_code)(const uint8_t *, int, unsigned long) =
+    (int (*)(const uint8_t *, int, unsigned long))
+    dlsym(pam_module, "compute_code");
+  assert(pam_sm_open_session && set_time && compute_code);
+
+  char fn[] = "/tmp/.google_authenticator_bench_XXXXXX";
+  int fd = mkstemp(fn);
+  assert(fd >= 0);
+  close(fd);
+  char arg[sizeof(fn) + 8];
+  sprintf(arg, "secret=%s", fn);
+  uint8_t key[10];
+  base32_decode(secret, key, sizeof(key));
+  char code[7];
+  response = code;
+
+  static const int ranges[] = { 1499, 240, 60, 10 };
+  for (int i = 0; i < sizeof(ranges)/sizeof(*ranges); ++i) {
+    char range_arg[32];
+    sprintf(range_arg, "skew_search_range=%d", ranges[i]);
+    const char *argv[] = { arg, range_arg };
+
+    // A code that is off by a skew gets recorded in RESETTING_TIME_SKEW, if
+    // the search finds it.
+    int found = 0;
+    for (int j = 0; j < sizeof(skew_distribution)/sizeof(*skew_distribution);
+         ++j) {
+      write_secret_file(fn, "2SH3V3GDW7ZNMGYE\n\" TOTP_AUTH\n");
+      int tm = 100000 + 10000*j;
+      set_time(tm*30);
+      sprintf(code, "%06d", compute_code(key, sizeof(key),
+                                         tm + skew_distribution[j].skew));
+      int rc = pam_sm_open_session(NULL, 0, 2, argv);
+      char buf[256] = { 0 };
+      fd = open(fn, O_RDONLY);
+      assert(fd >= 0);
+      assert(read(fd, buf, sizeof(buf) - 1) > 0);
+      close(fd);
+      if (rc == PAM_SUCCESS || strstr(buf, "RESETTING_TIME_SKEW")) {
+        found += skew_distribution[j].weight;
+      }
+    }
+
+    // Invalid codes that do not match any skew. The clock moves by more
+    // than the search range between attempts.
+    write_secret_file(fn, "2SH3V3GDW7ZNMGYE\n\" TOTP_AUTH\n");
+    strcpy(code, "000000");
+    char name[64];
+    sprintf(name, "skew search (range %d)", ranges[i]);
+    BENCH(name, {
+        set_time((1000000 + 3000*ops_)*30);
+        pam_sm_open_session(NULL, 0, 2, argv);
+      });
+    results[num_results - 1].hit_rate = found/100.0;
+  }
+  unlink(fn);
+}
+
+// Parses a secret file with a RATE_LIMIT option that holds "num_timestamps"
+// time stamps, records one more login attempt, and serializes the result.
+// This is what every login does for rate-limited accounts.
+static void bench_rate_limit(int num_timestamps) {
+  char *file = malloc(64 + 12*num_timestamps);
+  assert(file);
+  char *ptr = file + sprintf(file, "2SH3V3GDW7ZNMGYE\n\" RATE_LIMIT 100 3600");
+  for (int i = 0; i < num_timestamps; ++i) {
+    ptr += sprintf(ptr, " %d", 1000000 + i);
+  }
+  strcpy(ptr, "\n\" TOTP_AUTH\n");
+
+  char name[64];
+  sprintf(name, "rate_limit (%d timestamps)", num_timestamps);
+  BENCH(name, {
+      SecretState state;
+      assert(!secret_state_parse(&state, file));
+      secret_state_rate_limit(&state, 1000000 + num_timestamps + ops_);
+      assert(!secret_state_update(&state, OPT_RATE_LIMIT));
+      char *serialized = secret_state_serialize(&state);
+      assert(serialized);
+      free(serialized);
+      secret_state_clear(&state);
+    });
+  free(file);
+}
+
+static void print_results(const char *format) {
+  if (!strcmp(format, "json")) {
+    printf("{\n  \"sha1_backend\": \"%s\",\n  \"results\": [\n",
+           sha1_backend());
+    for (int i = 0; i < num_results; ++i) {
+      printf("    { \"name\": \"%s\", \"ops\": %llu, \"ns_per_op\": %.1f, "
+             "\"ops_per_sec\": %.0f", results[i].name, results[i].ops,
+             (double)results[i].ns/results[i].ops,
+             results[i].ops*1e9/results[i].ns);
+      if (results[i].hit_rate >= 0) {
+        printf(", \"hit_rate\": %.3f", results[i].hit_rate);
+      }
+      printf(" }%s\n", i + 1 < num_results ? "," : "");
+    }
+    puts("  ]\n}");
+  } else if (!strcmp(format, "csv")) {
+    puts("name,ops,ns_per_op,ops_per_sec,hit_rate");
+    for (int i = 0; i < num_results; ++i) {
+      printf("\"%s\",%llu,%.1f,%.0f,", results[i].name, results[i].ops,
+             (double)results[i].ns/results[i].ops,
+             results[i].ops*1e9/results[i].ns);
+      if (results[i].hit_rate >= 0) {
+        printf("%.3f", results[i].hit_rate);
+      }
+      putchar('\n');
+    }
+  } else {
+    printf("SHA1 backend: %s\n", sha1_backend());
+    for (int i = 0; i < num_results; ++i) {
+      printf("%-40s %12.1f ns/op %14.0f ops/sec", results[i].name,
+             (double)results[i].ns/results[i].ops,
+             results[i].ops*1e9/results[i].ns);
+      if (results[i].hit_rate >= 0) {
+        printf(" %6.1f%% found", 100*results[i].hit_rate);
+      }
+      putchar('\n');
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  const char *format = "text";
+  if (argc == 2 && !strncmp(argv[1], "--format=", 9)) {
+    format = argv[1] + 9;
+  }
+  if (argc > 2 || (argc == 2 && strcmp(format, "text") &&
+                   strcmp(format, "json") && strcmp(format, "csv"))) {
+    fprintf(stderr, "Usage: %s [--format=text|json|csv]\n", argv[0]);
+    return 1;
+  }
+
+  pam_module = dlopen("./pam_google_authenticator_testing.so",
+                      RTLD_LAZY | RTLD_GLOBAL);
+  assert(pam_module != NULL);
+
+  bench_sha1();
+  bench_hmac();
+  bench_base32();
+  bench_compute_code();
+  bench_logins();
+  bench_skew_search();
+  bench_rate_limit(0);
+  bench_rate_limit(10);
+  bench_rate_limit(100);
+  fprintf(stderr, "\n");
+  print_results(format);
+  return 0;
+}
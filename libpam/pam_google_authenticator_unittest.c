@@ -25,12 +25,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include "base32.h"
 #include "hmac.h"
+#include "secret_state.h"
+#include "sha1_mb.h"
 
 #if !defined(PAM_BAD_ITEM)
 // FreeBSD does not know about PAM_BAD_ITEM. And PAM_SYMBOL_ERR is an "enum",
@@ -43,11 +48,48 @@ static char *response = "";
 static void *pam_module;
 static enum { TWO_PROMPTS, COMBINED_PASSWORD, COMBINED_PROMPT } conv_mode;
 static int num_prompts_shown = 0;
+static const char *concurrent_fn, *concurrent_contents;
+static int concurrent_in_place;
+
+// Pretends that another login replaced the secret file, while the PAM module
+// was waiting for the user to enter a code. If "concurrent_in_place" is set,
+// the file keeps its inode, and usually also its size and st_mtime.
+static void run_concurrent_login(void) {
+  if (concurrent_contents) {
+    char *tmp_fn = strcat(strcpy(malloc(strlen(concurrent_fn) + 5),
+                                 concurrent_fn), ".new");
+    int fd = concurrent_in_place
+      ? open(concurrent_fn, O_WRONLY)
+      : open(tmp_fn, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    assert(fd >= 0);
+    assert(write(fd, concurrent_contents, strlen(concurrent_contents)) ==
+           strlen(concurrent_contents));
+    close(fd);
+    assert(concurrent_in_place || !rename(tmp_fn, concurrent_fn));
+    free(tmp_fn);
+    concurrent_contents = NULL;
+  }
+}
+
+// google-authenticatord is only built on Linux.
+#ifdef __linux__
+static pid_t daemon_pid;
+static char daemon_dir[] = "/tmp/.google_authenticatord_XXXXXX";
+
+// Failed assertions must not leave google-authenticatord running. It would
+// keep our stdout open, and anything that reads our output would hang.
+static void stop_daemon(int signo) {
+  kill(daemon_pid, SIGTERM);
+  waitpid(daemon_pid, NULL, 0);
+  rmdir(daemon_dir);
+}
+#endif
 
 static int conversation(int num_msg, const struct pam_message **msg,
                         struct pam_response **resp, void *appdata_ptr) {
   // Keep track of how often the conversation callback is executed.
   ++num_prompts_shown;
+  run_concurrent_login();
   if (conv_mode == COMBINED_PASSWORD) {
     return PAM_CONV_ERR;
   }
@@ -91,6 +133,7 @@ int pam_get_item(const pam_handle_t *pamh, int item_type,
     }
     case PAM_AUTHTOK: {
       static char *authtok = NULL;
+      run_concurrent_login();
       if (conv_mode == COMBINED_PASSWORD) {
         authtok = realloc(authtok, sizeof(pw) + strlen(response));
         *item = strcat(strcpy(authtok, pw), response);
@@ -120,6 +163,51 @@ int pam_set_item(pam_handle_t *pamh, int item_type,
   }
 }
 
+// The module can keep state in the PAM handle. All tests share one handle,
+// and we count how often the module updates its state.
+static struct {
+  const char *name;
+  void       *data;
+  void       (*cleanup)(pam_handle_t *pamh, void *data, int error_status);
+} pam_data[4];
+static int num_pam_data_set = 0;
+
+int pam_set_data(pam_handle_t *pamh, const char *module_data_name,
+                 void *data, void (*cleanup)(pam_handle_t *pamh, void *data,
+                                             int error_status))
+  __attribute__((visibility("default")));
+int pam_set_data(pam_handle_t *pamh, const char *module_data_name,
+                 void *data, void (*cleanup)(pam_handle_t *pamh, void *data,
+                                             int error_status)) {
+  ++num_pam_data_set;
+  for (int i = 0; i < sizeof(pam_data)/sizeof(*pam_data); ++i) {
+    if (!pam_data[i].name || !strcmp(pam_data[i].name, module_data_name)) {
+      if (pam_data[i].cleanup) {
+        pam_data[i].cleanup(pamh, pam_data[i].data, 0);
+      }
+      pam_data[i].name = module_data_name;
+      pam_data[i].data = data;
+      pam_data[i].cleanup = cleanup;
+      return PAM_SUCCESS;
+    }
+  }
+  return PAM_BUF_ERR;
+}
+
+int pam_get_data(const pam_handle_t *pamh, const char *module_data_name,
+                 const void **data)
+  __attribute__((visibility("default")));
+int pam_get_data(const pam_handle_t *pamh, const char *module_data_name,
+                 const void **data) {
+  for (int i = 0; i < sizeof(pam_data)/sizeof(*pam_data); ++i) {
+    if (pam_data[i].name && !strcmp(pam_data[i].name, module_data_name)) {
+      *data = pam_data[i].data;
+      return PAM_SUCCESS;
+    }
+  }
+  return PAM_NO_MODULE_DATA;
+}
+
 static const char *get_error_msg(void) {
   const char *(*get_error_msg)(void) =
     (const char *(*)(void))dlsym(pam_module, "get_error_msg");
@@ -198,6 +286,290 @@ int main(int argc, char *argv[]) {
                                 0x75, 0x1A, 0x2A, 0x26 },
                  sizeof(hmac)));
 
+  // Testing HMAC_SHA256 and HMAC_SHA512 with test vectors from RFC 4231
+  puts("Testing HMAC_SHA256 and HMAC_SHA512");
+  uint8_t hmac256[32], hmac512[64];
+  hmac_sha256((uint8_t *)"Jefe", 4,
+              (uint8_t *)"what do ya want for nothing?", 28,
+              hmac256, sizeof(hmac256));
+  assert(!memcmp(hmac256,
+                 (uint8_t []) { 0x5B, 0xDC, 0xC1, 0x46, 0xBF, 0x60, 0x75, 0x4E,
+                                0x6A, 0x04, 0x24, 0x26, 0x08, 0x95, 0x75, 0xC7,
+                                0x5A, 0x00, 0x3F, 0x08, 0x9D, 0x27, 0x39, 0x83,
+                                0x9D, 0xEC, 0x58, 0xB9, 0x64, 0xEC, 0x38, 0x43 },
+                 sizeof(hmac256)));
+  hmac_sha512((uint8_t *)"Jefe", 4,
+              (uint8_t *)"what do ya want for nothing?", 28,
+              hmac512, sizeof(hmac512));
+  assert(!memcmp(hmac512,
+                 (uint8_t []) { 0x16, 0x4B, 0x7A, 0x7B, 0xFC, 0xF8, 0x19, 0xE2,
+                                0xE3, 0x95, 0xFB, 0xE7, 0x3B, 0x56, 0xE0, 0xA3,
+                                0x87, 0xBD, 0x64, 0x22, 0x2E, 0x83, 0x1F, 0xD6,
+                                0x10, 0x27, 0x0C, 0xD7, 0xEA, 0x25, 0x05, 0x54,
+                                0x97, 0x58, 0xBF, 0x75, 0xC0, 0x5A, 0x99, 0x4A,
+                                0x6D, 0x03, 0x4F, 0x65, 0xF8, 0xF0, 0xE6, 0xFD,
+                                0xCA, 0xEA, 0xB1, 0xA3, 0x4D, 0x4A, 0x6B, 0x4B,
+                                0x63, 0x6E, 0x07, 0x0A, 0x38, 0xBC, 0xE7, 0x37 },
+                 sizeof(hmac512)));
+  uint8_t long_key[131];
+  memset(long_key, 0xAA, sizeof(long_key));
+  hmac_sha256(long_key, sizeof(long_key),
+              (uint8_t *)"Test Using Larger Than Block-Size Key - Hash Key "
+                         "First", 54,
+              hmac256, sizeof(hmac256));
+  assert(!memcmp(hmac256,
+                 (uint8_t []) { 0x60, 0xE4, 0x31, 0x59, 0x1E, 0xE0, 0xB6, 0x7F,
+                                0x0D, 0x8A, 0x26, 0xAA, 0xCB, 0xF5, 0xB7, 0x7F,
+                                0x8E, 0x0B, 0xC6, 0x21, 0x37, 0x28, 0xC5, 0x14,
+                                0x05, 0x46, 0x04, 0x0F, 0x0E, 0xE3, 0x7F, 0x54 },
+                 sizeof(hmac256)));
+  hmac_sha512(long_key, sizeof(long_key),
+              (uint8_t *)"Test Using Larger Than Block-Size Key - Hash Key "
+                         "First", 54,
+              hmac512, sizeof(hmac512));
+  assert(!memcmp(hmac512,
+                 (uint8_t []) { 0x80, 0xB2, 0x42, 0x63, 0xC7, 0xC1, 0xA3, 0xEB,
+                                0xB7, 0x14, 0x93, 0xC1, 0xDD, 0x7B, 0xE8, 0xB4,
+                                0x9B, 0x46, 0xD1, 0xF4, 0x1B, 0x4A, 0xEE, 0xC1,
+                                0x12, 0x1B, 0x01, 0x37, 0x83, 0xF8, 0xF3, 0x52,
+                                0x6B, 0x56, 0xD0, 0x37, 0xE0, 0x5F, 0x25, 0x98,
+                                0xBD, 0x0F, 0xD2, 0x21, 0x5D, 0x6A, 0x1E, 0x52,
+                                0x95, 0xE6, 0x4F, 0x73, 0xF6, 0x3F, 0x0A, 0xEC,
+                                0x8B, 0x91, 0x5A, 0x98, 0x5D, 0x78, 0x65, 0x98 },
+                 sizeof(hmac512)));
+
+  // Testing keyed and batched HMAC_SHA1 computation. Use a count that is not a
+  // multiple of the number of SIMD lanes, so that the tail is covered, too.
+  // Each of the multi-buffer kernels that this CPU can run must produce the
+  // same results.
+  puts("Testing keyed and batched HMAC_SHA1");
+  static const int lanes[] = { 16, 8, 4, 1 };
+  for (int k = 0; k < sizeof(lanes)/sizeof(*lanes); ++k) {
+    if (sha1_mb_select_kernel(lanes[k]) < 0) {
+      assert(lanes[k] != 1);
+      continue;
+    }
+    assert(sha1_mb_lanes() == lanes[k]);
+    uint8_t hmacs[37][20];
+    HMAC_SHA1_KEY key;
+    hmac_sha1_init_key(&key, (uint8_t *)"0123456789:;<=>?@ABC", 20);
+    hmac_sha1_counters(&key, 0xFFFFFFF0ull, 37, hmacs);
+    for (int i = 0; i < 37; ++i) {
+      uint8_t counter[8];
+      unsigned long long value = 0xFFFFFFF0ull + i;
+      for (int j = 8; j--; value >>= 8) {
+        counter[j] = value;
+      }
+      hmac_sha1((uint8_t *)"0123456789:;<=>?@ABC", 20, counter, 8,
+                hmac, sizeof(hmac));
+      assert(!memcmp(hmac, hmacs[i], sizeof(hmac)));
+      hmac_sha1_compute(&key, counter, 8, hmac, sizeof(hmac));
+      assert(!memcmp(hmac, hmacs[i], sizeof(hmac)));
+      hmac_sha1_counter(&key, 0xFFFFFFF0ull + i, hmac);
+      assert(!memcmp(hmac, hmacs[i], sizeof(hmac)));
+    }
+    hmac_sha1_clear_key(&key);
+  }
+  assert(sha1_mb_select_kernel(3) < 0);
+  assert(!sha1_mb_select_kernel(0));
+
+  // The fixed-length counter paths must match the generic code.
+  HMAC_SHA256_KEY key256;
+  HMAC_SHA512_KEY key512;
+  hmac_sha256_init_key(&key256, long_key, sizeof(long_key));
+  hmac_sha512_init_key(&key512, long_key, sizeof(long_key));
+  for (int i = 0; i < 37; ++i) {
+    uint8_t counter[8];
+    unsigned long long value = 0xFFFFFFF0ull + i;
+    for (int j = 8; j--; value >>= 8) {
+      counter[j] = value;
+    }
+    uint8_t expected[64];
+    hmac_sha256_compute(&key256, counter, 8, expected, 32);
+    hmac_sha256_counter(&key256, 0xFFFFFFF0ull + i, hmac256);
+    assert(!memcmp(hmac256, expected, sizeof(hmac256)));
+    hmac_sha512_compute(&key512, counter, 8, expected, 64);
+    hmac_sha512_counter(&key512, 0xFFFFFFF0ull + i, hmac512);
+    assert(!memcmp(hmac512, expected, sizeof(hmac512)));
+  }
+
+  // Unchanged lines must be written back exactly as they were read, and
+  // updates must only touch the lines of the options that changed.
+  puts("Testing secret file parser");
+  SecretState state;
+  static const char secret_file[] =
+    "JBSWY3DPEHPK3PXP\r\n"
+    "\" RATE_LIMIT 3 30 1000 1010\n"
+    "\" UNKNOWN_OPTION 42\n"
+    "\" HOTP_COUNTER 5\r\n"
+    "\n"
+    "\" HOTP_COUNTER 7\n"
+    "12345678\n"
+    "87654321";
+  assert(!secret_state_parse(&state, secret_file));
+  assert(!strcmp(state.secret, "JBSWY3DPEHPK3PXP\r"));
+  assert(state.status[OPT_RATE_LIMIT] == OPT_VALID);
+  assert(state.rate_limit_attempts == 3 && state.rate_limit_interval == 30);
+  assert(state.rate_limit_timestamps.count == 2);
+  assert(state.status[OPT_HOTP_COUNTER] == OPT_VALID);
+  assert(state.hotp_counter == 5);
+  assert(state.status[OPT_WINDOW_SIZE] == OPT_ABSENT);
+  assert(!state.totp);
+  char *serialized = secret_state_serialize(&state);
+  assert(!strcmp(serialized, secret_file));
+  free(serialized);
+  state.hotp_counter = 6;
+  assert(!secret_state_update(&state, OPT_HOTP_COUNTER));
+  state.window_size = 5;
+  assert(!secret_state_update(&state, OPT_WINDOW_SIZE));
+  assert(secret_state_remove_scratch_code(&state, 11111111) == 1);
+  assert(!secret_state_remove_scratch_code(&state, 87654321));
+  serialized = secret_state_serialize(&state);
+  assert(!strcmp(serialized,
+                 "JBSWY3DPEHPK3PXP\r\n"
+                 "\" WINDOW_SIZE 5\n"
+                 "\" RATE_LIMIT 3 30 1000 1010\n"
+                 "\" UNKNOWN_OPTION 42\n"
+                 "\" HOTP_COUNTER 6\r\n"
+                 "\n"
+                 "12345678\n"));
+  free(serialized);
+  secret_state_clear(&state);
+
+  // Binary files hold the same state as text files, and they can be updated
+  // in place. Stale copies of the state must not overwrite newer ones.
+  puts("Testing binary secret files");
+  static const char text_file[] =
+    "JBSWY3DPEHPK3PXP\n"
+    "\" TOTP_AUTH\n"
+    "\" RATE_LIMIT 3 30 1000 1010\n"
+    "\" DISALLOW_REUSE 33 34\n"
+    "\" WINDOW_SIZE 5\n"
+    "12345678\n";
+  assert(!secret_state_parse(&state, text_file));
+  size_t binary_len;
+  char *binary_file = secret_state_serialize_binary(&state, &binary_len);
+  assert(binary_file);
+  assert(secret_state_is_binary(binary_file, binary_len));
+  secret_state_clear(&state);
+  assert(!secret_state_parse_binary(&state, binary_file, binary_len));
+  assert(state.totp && state.window_size == 5);
+  assert(secret_state_is_disallowed(&state, 33));
+  assert(secret_state_is_disallowed(&state, 34));
+  assert(!secret_state_is_disallowed(&state, 35));
+  serialized = secret_state_serialize(&state);
+  assert(!strcmp(serialized,
+                 "JBSWY3DPEHPK3PXP\n"
+                 "\" TOTP_AUTH\n"
+                 "\" RATE_LIMIT 3 30 1000 1010\n"
+                 "\" WINDOW_SIZE 5\n"
+                 "\" DISALLOW_REUSE 33 34\n"
+                 "12345678\n"));
+  free(serialized);
+  char binary_fn[] = "/tmp/.google_authenticator_XXXXXX";
+  int binary_fd = mkstemp(binary_fn);
+  assert(binary_fd >= 0);
+  assert(write(binary_fd, binary_file, binary_len) == binary_len);
+  SecretState stale;
+  assert(!secret_state_parse_binary(&stale, binary_file, binary_len));
+  assert(!secret_state_remove_scratch_code(&state, 12345678));
+  assert(!secret_state_update_binary(&state, binary_fd));
+  assert(!secret_state_remove_scratch_code(&stale, 12345678));
+  assert(secret_state_update_binary(&stale, binary_fd) == 1);
+  secret_state_clear(&stale);
+  assert(pread(binary_fd, binary_file, binary_len, 0) == binary_len);
+  assert(!secret_state_parse_binary(&stale, binary_file, binary_len));
+  assert(stale.sequence == state.sequence);
+  assert(secret_state_remove_scratch_code(&stale, 12345678) == 1);
+  secret_state_clear(&stale);
+  secret_state_clear(&state);
+  assert(!secret_state_parse(&state, secret_file));
+  assert(!secret_state_serialize_binary(&state, &binary_len));
+  secret_state_clear(&state);
+
+  // Options that were added later, e.g. SKEW_SEARCH_RANGE and
+  // RESETTING_HOTP_COUNTER, are kept in binary files, too.
+  assert(!secret_state_parse(&state, "JBSWY3DPEHPK3PXP\n"
+                                     "\" SKEW_SEARCH_RANGE 60\n"
+                                     "\" HOTP_COUNTER 7\n"
+                                     "\" RESETTING_HOTP_COUNTER 5000\n"));
+  assert(state.status[OPT_SKEW_SEARCH_RANGE] == OPT_VALID);
+  assert(state.skew_search_range == 60);
+  free(binary_file);
+  binary_file = secret_state_serialize_binary(&state, &binary_len);
+  assert(binary_file);
+  secret_state_clear(&state);
+  assert(!secret_state_parse_binary(&state, binary_file, binary_len));
+  assert(state.skew_search_range == 60 && state.hotp_counter == 7 &&
+         state.resetting_hotp_counter == 5000);
+  serialized = secret_state_serialize(&state);
+  assert(!strcmp(serialized,
+                 "JBSWY3DPEHPK3PXP\n"
+                 "\" HOTP_COUNTER 7\n"
+                 "\" SKEW_SEARCH_RANGE 60\n"
+                 "\" RESETTING_HOTP_COUNTER 5000\n"));
+  free(serialized);
+  secret_state_clear(&state);
+  assert(!secret_state_parse(&state, "JBSWY3DPEHPK3PXP\n"
+                                     "\" SKEW_SEARCH_RANGE 1500\n"));
+  assert(state.status[OPT_SKEW_SEARCH_RANGE] == OPT_INVALID);
+  secret_state_clear(&state);
+  close(binary_fd);
+  unlink(binary_fn);
+  free(binary_file);
+
+  // The DISALLOW_REUSE bitmap must behave exactly like a list of time steps
+  // that gets pruned to the window around the most recently used step.
+  puts("Testing DISALLOW_REUSE bitmap");
+  srandom(1);
+  for (int window = 1; window <= 100; ++window) {
+    int list[256], num_list = 0;
+    assert(!secret_state_parse(&state, "JBSWY3DPEHPK3PXP\n"
+                                       "\" DISALLOW_REUSE\n"));
+    int now = 10000000;
+    for (int i = 0; i < 500; ++i) {
+      now += random() % 3 == 0;
+      if (random() % 50 == 0) {
+        now += random() % 1000;
+      }
+      int tm = now + (int)(random() % (2*window + 9)) - window - 4;
+      int blocked = 0;
+      for (int j = 0; j < num_list; ++j) {
+        blocked |= list[j] == tm;
+      }
+      assert(secret_state_is_disallowed(&state, tm) == blocked);
+      if (blocked) {
+        continue;
+      }
+      int num_kept = 0;
+      for (int j = 0; j < num_list; ++j) {
+        if (list[j] - tm < window && tm - list[j] < window) {
+          list[num_kept++] = list[j];
+        }
+      }
+      list[num_kept++] = tm;
+      num_list = num_kept;
+      secret_state_disallow(&state, tm, window);
+      assert(!secret_state_update(&state, OPT_DISALLOW_REUSE));
+
+      // Occasionally write the state out and read it back in.
+      if (i % 50 == 0) {
+        serialized = secret_state_serialize(&state);
+        secret_state_clear(&state);
+        assert(!secret_state_parse(&state, serialized));
+        free(serialized);
+      }
+      for (int step = tm - 300; step <= tm + 300; ++step) {
+        int expected = 0;
+        for (int j = 0; j < num_list; ++j) {
+          expected |= list[j] == step;
+        }
+        assert(secret_state_is_disallowed(&state, step) == expected);
+      }
+    }
+    secret_state_clear(&state);
+  }
+
   // Load the PAM module
   puts("Loading PAM module");
   pam_module = dlopen("./pam_google_authenticator_testing.so",
@@ -210,6 +582,10 @@ int main(int argc, char *argv[]) {
       (int (*)(pam_handle_t *, int, int, const char **))
       dlsym(pam_module, "pam_sm_open_session");
   assert(pam_sm_open_session != NULL);
+  int (*pam_sm_authenticate)(pam_handle_t *, int, int, const char **) =
+      (int (*)(pam_handle_t *, int, int, const char **))
+      dlsym(pam_module, "pam_sm_authenticate");
+  assert(pam_sm_authenticate != NULL);
 
   // Look up private test-only API
   void (*set_time)(time_t t) =
@@ -218,6 +594,36 @@ int main(int argc, char *argv[]) {
   int (*compute_code)(uint8_t *, int, unsigned long) =
       (int (*)(uint8_t*, int, unsigned long))dlsym(pam_module, "compute_code");
   assert(compute_code);
+  void (*compute_codes)(uint8_t *, int, unsigned long, int, int *) =
+      (void (*)(uint8_t *, int, unsigned long, int, int *))
+      dlsym(pam_module, "compute_codes");
+  assert(compute_codes);
+  int (*get_passwd_lookups)(int) =
+      (int (*)(int))dlsym(pam_module, "get_passwd_lookups");
+  assert(get_passwd_lookups);
+  int (*get_skew_codes_computed)(void) =
+      (int (*)(void))dlsym(pam_module, "get_skew_codes_computed");
+  assert(get_skew_codes_computed);
+
+#ifdef __linux__
+  // Start google-authenticatord, so that counter-based codes can also be
+  // tested through the daemon.
+  assert(mkdtemp(daemon_dir));
+  char daemon_arg[sizeof(daemon_dir) + 12];
+  sprintf(daemon_arg, "daemon=%s/sock", daemon_dir);
+  daemon_pid = fork();
+  assert(daemon_pid >= 0);
+  if (!daemon_pid) {
+    execl("./google-authenticatord", "google-authenticatord", "--foreground",
+          "--socket", daemon_arg + 7, (char *)NULL);
+    _exit(1);
+  }
+  signal(SIGABRT, stop_daemon);
+  for (int i = 0; access(daemon_arg + 7, F_OK); ++i) {
+    assert(i < 500);
+    usleep(10000);
+  }
+#endif
 
   for (int otp_mode = 0; otp_mode < 8; ++otp_mode) {
     // Create a secret file with a well-known test vector
@@ -231,6 +637,17 @@ int main(int argc, char *argv[]) {
     uint8_t binary_secret[sizeof(secret)];
     size_t binary_secret_len = base32_decode(secret, binary_secret,
                                              sizeof(binary_secret));
+
+    // Check that batched code computation matches the scalar code.
+    if (!otp_mode) {
+      puts("Testing batched verification codes");
+      int codes[1000];
+      compute_codes(binary_secret, binary_secret_len, 9500, 1000, codes);
+      for (int i = 0; i < 1000; ++i) {
+        assert(codes[i] == compute_code(binary_secret, binary_secret_len,
+                                        9500 + i));
+      }
+    }
   
     // Set up test argc/argv parameters to let the PAM module know where to
     // find our secret file
@@ -360,6 +777,141 @@ int main(int argc, char *argv[]) {
     puts("Testing successful login");
     assert(pam_sm_open_session(NULL, 0, targc, targv) == PAM_SUCCESS);
     verify_prompts_shown(expected_good_prompts_shown);
+
+    // The "timing" option logs how long each phase of the login took.
+    puts("Testing timing option");
+    targv[targc] = "timing";
+    assert(pam_sm_open_session(NULL, 0, targc + 1, targv) == PAM_SUCCESS);
+    verify_prompts_shown(expected_good_prompts_shown);
+    assert(!strncmp(get_error_msg(), "timing result=success retries=0 user=",
+                    37));
+    assert(strstr(get_error_msg(), " total="));
+    targv[targc] = NULL;
+
+    // User database lookups are cached. Both looking up the user's home
+    // directory and the user's group can be answered by the same entry.
+    if (!otp_mode) {
+      puts("Testing user database cache");
+      int lookups = get_passwd_lookups(1);
+      assert(pam_sm_open_session(NULL, 0, targc, targv) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      assert(get_passwd_lookups(0) == lookups + 1);
+      assert(pam_sm_open_session(NULL, 0, targc, targv) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      assert(get_passwd_lookups(1) == lookups + 1);
+      assert(pam_sm_open_session(NULL, 0, targc, targv) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      assert(get_passwd_lookups(0) == lookups + 2);
+    }
+
+    // Module arguments are parsed once, and then kept in the PAM handle, until
+    // they change.
+    if (!otp_mode) {
+      puts("Testing argument cache");
+      targv[targc] = "timing";
+      assert(pam_sm_open_session(NULL, 0, targc + 1, targv) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      targv[targc] = NULL;
+      int pam_data_set = num_pam_data_set;
+      assert(pam_sm_open_session(NULL, 0, targc, targv) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      assert(num_pam_data_set == pam_data_set + 1);
+      assert(pam_sm_open_session(NULL, 0, targc, targv) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      assert(num_pam_data_set == pam_data_set + 1);
+    }
+
+    // If the module is stacked in both "auth" and "session", opening the
+    // session does not verify the same login a second time.
+    if (!otp_mode) {
+      puts("Testing session after authentication");
+      assert(pam_sm_authenticate(NULL, 0, targc, targv) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      char *old_response = response;
+      response = "123456";
+      assert(pam_sm_open_session(NULL, 0, targc, targv) == PAM_SUCCESS);
+      verify_prompts_shown(0);
+      assert(pam_sm_open_session(NULL, 0, targc, targv) == PAM_SESSION_ERR);
+      verify_prompts_shown(expected_bad_prompts_shown);
+      assert(pam_sm_authenticate(NULL, 0, targc, targv) == PAM_SESSION_ERR);
+      verify_prompts_shown(expected_bad_prompts_shown);
+      assert(pam_sm_open_session(NULL, 0, targc, targv) == PAM_SESSION_ERR);
+      verify_prompts_shown(expected_bad_prompts_shown);
+      response = old_response;
+      assert(pam_sm_authenticate(NULL, 0, targc, targv) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      targv[targc] = "verify_session";
+      response = "123456";
+      assert(pam_sm_open_session(NULL, 0, targc + 1, targv) ==
+             PAM_SESSION_ERR);
+      verify_prompts_shown(expected_bad_prompts_shown);
+      targv[targc] = NULL;
+
+      // "verify_session" leaves the authentication for the next session.
+      assert(pam_sm_open_session(NULL, 0, targc, targv) == PAM_SUCCESS);
+      verify_prompts_shown(0);
+
+      // "nullok" lets users without a secret file authenticate. Sessions
+      // without "nullok" still need a code.
+      const char *old_secret = targv[0];
+      targv[0] = "secret=/NOSUCHFILE";
+      targv[targc] = "nullok";
+      assert(pam_sm_authenticate(NULL, 0, targc + 1, targv) == PAM_SUCCESS);
+      verify_prompts_shown(0);
+      targv[targc] = NULL;
+      assert(pam_sm_open_session(NULL, 0, targc, targv) == PAM_SESSION_ERR);
+      verify_prompts_shown(0);
+
+      // A session that uses a different secret file verifies its own code.
+      targv[0] = old_secret;
+      response = old_response;
+      assert(pam_sm_authenticate(NULL, 0, targc, targv) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      targv[0] = "secret=/NOSUCHFILE";
+      assert(pam_sm_open_session(NULL, 0, targc, targv) == PAM_SESSION_ERR);
+      verify_prompts_shown(0);
+      targv[0] = old_secret;
+      response = "123456";
+      assert(pam_sm_open_session(NULL, 0, targc, targv) == PAM_SESSION_ERR);
+      verify_prompts_shown(expected_bad_prompts_shown);
+      response = old_response;
+    }
+
+    // Failed attempts within the same time step reuse the codes that were
+    // computed for the time skew search. Advancing the clock only computes
+    // the codes for the new step.
+    if (!otp_mode) {
+      puts("Testing cache of time skew codes");
+      char *old_response = response;
+      response = "123456";
+      set_time(20000*30);
+      int computed = get_skew_codes_computed();
+      assert(pam_sm_open_session(NULL, 0, targc, targv) == PAM_SESSION_ERR);
+      verify_prompts_shown(expected_bad_prompts_shown);
+      assert(get_skew_codes_computed() == computed + 2*25*60 - 1);
+      assert(pam_sm_open_session(NULL, 0, targc, targv) == PAM_SESSION_ERR);
+      verify_prompts_shown(expected_bad_prompts_shown);
+      assert(get_skew_codes_computed() == computed + 2*25*60 - 1);
+      set_time(20001*30);
+      assert(pam_sm_open_session(NULL, 0, targc, targv) == PAM_SESSION_ERR);
+      verify_prompts_shown(expected_bad_prompts_shown);
+      assert(get_skew_codes_computed() == computed + 2*25*60);
+      set_time(19999*30);
+      assert(pam_sm_open_session(NULL, 0, targc, targv) == PAM_SESSION_ERR);
+      verify_prompts_shown(expected_bad_prompts_shown);
+      assert(get_skew_codes_computed() == computed + 2*25*60 + 2);
+
+      // Valid codes are found in the same table.
+      char buf[7];
+      response = buf;
+      sprintf(response, "%06d", compute_code(binary_secret,
+                                             binary_secret_len, 19999));
+      assert(pam_sm_open_session(NULL, 0, targc, targv) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      assert(get_skew_codes_computed() == computed + 2*25*60 + 2);
+      set_time(10000*30);
+      response = old_response;
+    }
   
     // Test the WINDOW_SIZE option
     puts("Testing WINDOW_SIZE option");
@@ -490,6 +1042,80 @@ int main(int argc, char *argv[]) {
                                (const char *[]){ "noskewadj", 0 }) ==
            PAM_SESSION_ERR);
     verify_prompts_shown(0);
+
+    // With a TIME_SKEW in effect, the search around it and the search around
+    // the current time keep their own tables. A repeated failure does not
+    // compute any codes, and a failure in the next time step only computes
+    // one new code for each search.
+    if (!otp_mode) {
+      puts("Testing cache of skewed time codes");
+      int computed = get_skew_codes_computed();
+      set_time(40000*30);
+      response = "123456";
+      for (int i = 0; i < 3; ++i) {
+        if (i == 2) {
+          set_time(40001*30);
+        }
+        assert(pam_sm_open_session(NULL, 0, targc, targv) ==
+               PAM_SESSION_ERR);
+        verify_prompts_shown(expected_bad_prompts_shown);
+        assert(get_skew_codes_computed() ==
+               computed + 2*2999 + (i == 2 ? 2 : 0));
+      }
+      response = buf;
+    }
+
+    // The search for a new time skew starts at the skew that is expected,
+    // and also looks around the current time. SKEW_SEARCH_RANGE limits how
+    // far either search goes.
+    if (!otp_mode) {
+      puts("Testing SKEW_SEARCH_RANGE");
+      assert(!chmod(fn, 0600));
+      assert((fd = open(fn, O_APPEND | O_WRONLY)) >= 0);
+      assert(write(fd, "\" SKEW_SEARCH_RANGE 10\n", 23) == 23);
+      close(fd);
+      int computed = get_skew_codes_computed();
+      for (int *skew = (int []){ -995, -975, 3, 20, 0 }, i = 0; *skew; ++i) {
+        // Stay below the RATE_LIMIT that an earlier test set up.
+        set_time((50000 + 5*i)*30);
+        sprintf(response, "%06d", compute_code(binary_secret,
+                                               binary_secret_len,
+                                               50000 + 5*i + *skew++));
+        assert(pam_sm_open_session(NULL, 0, targc, targv) ==
+               PAM_SESSION_ERR);
+        verify_prompts_shown(expected_bad_prompts_shown);
+        if (!i) {
+          assert(get_skew_codes_computed() == computed + 2*21);
+        }
+      }
+      assert((fd = open(fn, O_RDONLY)) >= 0);
+      memset(state_file_buf, 0, sizeof(state_file_buf));
+      assert(read(fd, state_file_buf, sizeof(state_file_buf)-1) > 0);
+      close(fd);
+      assert(strstr(state_file_buf,
+                    "\" RESETTING_TIME_SKEW 50000-995 50010+3\n"));
+
+      // The module argument can shrink the range further.
+      set_time(50020*30);
+      sprintf(response, "%06d", compute_code(binary_secret,
+                                             binary_secret_len, 50030));
+      targv[targc] = "skew_search_range=5";
+      assert(pam_sm_open_session(NULL, 0, targc + 1, targv) ==
+             PAM_SESSION_ERR);
+      verify_prompts_shown(expected_bad_prompts_shown);
+      targv[targc] = "skew_search_range=0";
+      assert(pam_sm_open_session(NULL, 0, targc + 1, targv) ==
+             PAM_SESSION_ERR);
+      verify_prompts_shown(0);
+      assert(!strcmp(get_error_msg(), "Invalid skew_search_range \"0\""));
+      targv[targc] = NULL;
+      assert((fd = open(fn, O_RDONLY)) >= 0);
+      memset(state_file_buf, 0, sizeof(state_file_buf));
+      assert(read(fd, state_file_buf, sizeof(state_file_buf)-1) > 0);
+      close(fd);
+      assert(strstr(state_file_buf,
+                    "\" RESETTING_TIME_SKEW 50000-995 50010+3\n"));
+    }
     set_time(10000*30);
     
     // Test scratch codes
@@ -505,6 +1131,48 @@ int main(int argc, char *argv[]) {
     verify_prompts_shown(expected_good_prompts_shown);
     assert(pam_sm_open_session(NULL, 0, targc, targv) == PAM_SESSION_ERR);
     verify_prompts_shown(expected_bad_prompts_shown);
+
+    // If a concurrent login changes the file, the PAM module reads it again,
+    // and re-evaluates the code that it already received. A scratch code
+    // can only ever be used by one of the logins.
+    puts("Testing concurrent logins");
+    static const char before[] =
+      "2SH3V3GDW7ZNMGYE\n\" TOTP_AUTH\n12345678\n87654321\n";
+    static const char after[] = "2SH3V3GDW7ZNMGYE\n\" TOTP_AUTH\n87654321\n";
+    char contents[sizeof(before)];
+    concurrent_fn = fn;
+    for (int i = 0; i < 2; ++i) {
+      assert(!chmod(fn, 0600));
+      assert((fd = open(fn, O_TRUNC | O_WRONLY)) >= 0);
+      assert(write(fd, before, sizeof(before)-1) == sizeof(before)-1);
+      close(fd);
+      concurrent_contents = after;
+      response = i ? "87654321" : "12345678";
+      assert(pam_sm_open_session(NULL, 0, targc, targv) ==
+             (i ? PAM_SUCCESS : PAM_SESSION_ERR));
+      verify_prompts_shown(i ? expected_good_prompts_shown
+                             : expected_bad_prompts_shown);
+      assert(!concurrent_contents);
+    }
+    assert((fd = open(fn, O_RDONLY)) >= 0);
+    assert(read(fd, contents, sizeof(contents)) == 29);
+    close(fd);
+    assert(!memcmp(contents, after, 29));
+
+    // Same-sized changes are detected, even if they happen within the same
+    // second, and leave the inode unchanged.
+    static const char in_place[] =
+      "2SH3V3GDW7ZNMGYE\n\" TOTP_AUTH\n11111111\n87654321\n";
+    assert(!chmod(fn, 0600));
+    assert((fd = open(fn, O_TRUNC | O_WRONLY)) >= 0);
+    assert(write(fd, before, sizeof(before)-1) == sizeof(before)-1);
+    close(fd);
+    concurrent_contents = in_place;
+    concurrent_in_place = 1;
+    response = "12345678";
+    assert(pam_sm_open_session(NULL, 0, targc, targv) == PAM_SESSION_ERR);
+    verify_prompts_shown(expected_bad_prompts_shown);
+    concurrent_in_place = 0;
   
     // Set up secret file for counter-based codes.
     assert(!chmod(fn, 0600));
@@ -560,7 +1228,201 @@ int main(int argc, char *argv[]) {
     hotp_counter = strstr(state_file_buf, "\" HOTP_COUNTER ");
     assert(hotp_counter);
     assert(!memcmp(hotp_counter + 15, "6\n", 2));
-  
+
+    char daemon_code[7];
+#ifdef __linux__
+    // Repeat counter-based logins through google-authenticatord. The daemon
+    // caches the secret file, but it must notice when the file changes.
+    puts("Testing google-authenticatord");
+    targv[targc] = daemon_arg;
+    sprintf(daemon_code, "%06d",
+            compute_code(binary_secret, binary_secret_len, 6));
+    response = daemon_code;
+
+    // A login that is still waiting for its user to type must not hold up
+    // other logins for the same user.
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strcpy(addr.sun_path, daemon_arg + 7);
+    int idle = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    assert(idle >= 0);
+    assert(!connect(idle, (struct sockaddr *)&addr, sizeof(addr)));
+    char packet[4096], *ptr = packet;
+    ptr = stpcpy(ptr, "AUTH") + 1;
+    ptr = stpcpy(ptr, getenv("USER")) + 1;
+    for (int i = 0; i <= targc; ++i) {
+      ptr = stpcpy(ptr, targv[i]) + 1;
+    }
+    assert(send(idle, packet, ptr - packet, 0) == ptr - packet);
+    assert(recv(idle, packet, sizeof(packet), 0) == 3 &&
+           !strcmp(packet, "OK"));
+    assert(pam_sm_open_session(NULL, 0, targc + 1, targv) == PAM_SUCCESS);
+    verify_prompts_shown(expected_good_prompts_shown);
+    close(idle);
+    assert(pam_sm_open_session(NULL, 0, targc + 1, targv) == PAM_SESSION_ERR);
+    verify_prompts_shown(expected_bad_prompts_shown);
+    assert((fd = open(fn, O_RDONLY)) >= 0);
+    memset(state_file_buf, 0, sizeof(state_file_buf));
+    assert(read(fd, state_file_buf, sizeof(state_file_buf)-1) > 0);
+    close(fd);
+    hotp_counter = strstr(state_file_buf, "\" HOTP_COUNTER ");
+    assert(hotp_counter);
+    assert(!memcmp(hotp_counter + 15, "8\n", 2));
+    assert(!chmod(fn, 0600));
+    assert((fd = open(fn, O_TRUNC | O_WRONLY)) >= 0);
+    assert(write(fd, secret, sizeof(secret)-1) == sizeof(secret)-1);
+    assert(write(fd, "\n\" HOTP_COUNTER 10\n12345678\n", 28) == 28);
+    close(fd);
+    sprintf(daemon_code, "%06d",
+            compute_code(binary_secret, binary_secret_len, 10));
+    assert(pam_sm_open_session(NULL, 0, targc + 1, targv) == PAM_SUCCESS);
+    verify_prompts_shown(expected_good_prompts_shown);
+    response = "12345678";
+    assert(pam_sm_open_session(NULL, 0, targc + 1, targv) == PAM_SUCCESS);
+    verify_prompts_shown(expected_good_prompts_shown);
+    assert(pam_sm_open_session(NULL, 0, targc + 1, targv) == PAM_SESSION_ERR);
+    verify_prompts_shown(expected_bad_prompts_shown);
+    targv[targc] = NULL;
+#endif
+
+    // With "hotp_resync", a code far ahead of the counter is remembered, and
+    // the code for the following counter value then resynchronizes it. Much
+    // like when resetting the time skew, the first code ends the login
+    // attempt right away, as it changed the state.
+    puts("Testing hotp_resync option");
+    assert(!chmod(fn, 0600));
+    assert((fd = open(fn, O_TRUNC | O_WRONLY)) >= 0);
+    assert(write(fd, secret, sizeof(secret)-1) == sizeof(secret)-1);
+    assert(write(fd, "\n\" HOTP_COUNTER 1\n", 18) == 18);
+    close(fd);
+    sprintf(daemon_code, "%06d",
+            compute_code(binary_secret, binary_secret_len, 5000));
+    response = daemon_code;
+    assert(pam_sm_open_session(NULL, 0, targc, targv) == PAM_SESSION_ERR);
+    verify_prompts_shown(expected_bad_prompts_shown);
+    targv[targc] = "hotp_resync";
+    assert(pam_sm_open_session(NULL, 0, targc + 1, targv) == PAM_SESSION_ERR);
+    verify_prompts_shown(expected_good_prompts_shown);
+    assert((fd = open(fn, O_RDONLY)) >= 0);
+    memset(state_file_buf, 0, sizeof(state_file_buf));
+    assert(read(fd, state_file_buf, sizeof(state_file_buf)-1) > 0);
+    close(fd);
+    assert(strstr(state_file_buf, "\" HOTP_COUNTER 3\n"));
+    assert(strstr(state_file_buf, "\" RESETTING_HOTP_COUNTER 5000\n"));
+    sprintf(daemon_code, "%06d",
+            compute_code(binary_secret, binary_secret_len, 5002));
+    assert(pam_sm_open_session(NULL, 0, targc + 1, targv) == PAM_SESSION_ERR);
+    verify_prompts_shown(expected_good_prompts_shown);
+    sprintf(daemon_code, "%06d",
+            compute_code(binary_secret, binary_secret_len, 5003));
+    assert(pam_sm_open_session(NULL, 0, targc + 1, targv) == PAM_SUCCESS);
+    verify_prompts_shown(expected_good_prompts_shown);
+    assert((fd = open(fn, O_RDONLY)) >= 0);
+    memset(state_file_buf, 0, sizeof(state_file_buf));
+    assert(read(fd, state_file_buf, sizeof(state_file_buf)-1) > 0);
+    close(fd);
+    assert(strstr(state_file_buf, "\" HOTP_COUNTER 5004\n"));
+    assert(!strstr(state_file_buf, "RESETTING_HOTP_COUNTER"));
+    assert(!secret_state_parse(&state, state_file_buf));
+    binary_file = secret_state_serialize_binary(&state, &binary_len);
+    assert(binary_file);
+    free(binary_file);
+    secret_state_clear(&state);
+    targv[targc] = NULL;
+
+    // The PAM module updates binary files in place.
+    puts("Testing binary secret file");
+    assert(!secret_state_parse(&state, "2SH3V3GDW7ZNMGYE\n"
+                                       "\" HOTP_COUNTER 20\n"));
+    binary_file = secret_state_serialize_binary(&state, &binary_len);
+    assert(binary_file);
+    secret_state_clear(&state);
+    assert(!chmod(fn, 0600));
+    assert((fd = open(fn, O_TRUNC | O_WRONLY)) >= 0);
+    assert(write(fd, binary_file, binary_len) == binary_len);
+    close(fd);
+    sprintf(daemon_code, "%06d",
+            compute_code(binary_secret, binary_secret_len, 20));
+    response = daemon_code;
+    assert(pam_sm_open_session(NULL, 0, targc, targv) == PAM_SUCCESS);
+    verify_prompts_shown(expected_good_prompts_shown);
+    assert(pam_sm_open_session(NULL, 0, targc, targv) == PAM_SESSION_ERR);
+    verify_prompts_shown(expected_bad_prompts_shown);
+
+    assert((fd = open(fn, O_RDONLY)) >= 0);
+    assert(read(fd, binary_file, binary_len) == binary_len);
+    close(fd);
+    assert(!secret_state_parse_binary(&state, binary_file, binary_len));
+    assert(state.hotp_counter == 22 && state.sequence == 3);
+    secret_state_clear(&state);
+
+    // Binary files remember the code for "hotp_resync", too.
+    targv[targc] = "hotp_resync";
+    sprintf(daemon_code, "%06d",
+            compute_code(binary_secret, binary_secret_len, 5000));
+    assert(pam_sm_open_session(NULL, 0, targc + 1, targv) == PAM_SESSION_ERR);
+    verify_prompts_shown(expected_good_prompts_shown);
+    assert((fd = open(fn, O_RDONLY)) >= 0);
+    assert(read(fd, binary_file, binary_len) == binary_len);
+    close(fd);
+    assert(!secret_state_parse_binary(&state, binary_file, binary_len));
+    assert(state.hotp_counter == 23 && state.resetting_hotp_counter == 5000);
+    secret_state_clear(&state);
+    sprintf(daemon_code, "%06d",
+            compute_code(binary_secret, binary_secret_len, 5001));
+    assert(pam_sm_open_session(NULL, 0, targc + 1, targv) == PAM_SUCCESS);
+    verify_prompts_shown(expected_good_prompts_shown);
+    targv[targc] = NULL;
+    assert((fd = open(fn, O_RDONLY)) >= 0);
+    assert(read(fd, binary_file, binary_len) == binary_len);
+    close(fd);
+    assert(!secret_state_parse_binary(&state, binary_file, binary_len));
+    assert(state.hotp_counter == 5002 && !state.resetting_hotp_counter &&
+           state.status[OPT_RESETTING_HOTP_COUNTER] == OPT_ABSENT &&
+           state.sequence == 5);
+    secret_state_clear(&state);
+    free(binary_file);
+
+    // Test the ALGORITHM and DIGITS options with the test vectors from
+    // RFC 6238. Each algorithm uses a key of matching size.
+    puts("Testing ALGORITHM and DIGITS options");
+    static const struct {
+      const char *secret, *options, *code;
+    } rfc6238[] = {
+      { "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ",
+        "\" TOTP_AUTH\n\" DIGITS 8\n", "94287082" },
+      { "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQGEZA",
+        "\" TOTP_AUTH\n\" ALGORITHM SHA256\n\" DIGITS 8\n", "46119246" },
+      { "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ"
+        "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQGEZDGNA",
+        "\" TOTP_AUTH\n\" ALGORITHM SHA512\n\" DIGITS 8\n", "90693936" },
+    };
+    set_time(59);
+    for (int i = 0; i < sizeof(rfc6238)/sizeof(*rfc6238); ++i) {
+      assert(!chmod(fn, 0600));
+      assert((fd = open(fn, O_TRUNC | O_WRONLY)) >= 0);
+      assert(write(fd, rfc6238[i].secret, strlen(rfc6238[i].secret)) ==
+             strlen(rfc6238[i].secret));
+      assert(write(fd, "\n", 1) == 1);
+      assert(write(fd, rfc6238[i].options, strlen(rfc6238[i].options)) ==
+             strlen(rfc6238[i].options));
+      close(fd);
+      response = (char *)rfc6238[i].code + 2;
+      assert(pam_sm_open_session(NULL, 0, targc, targv) == PAM_SESSION_ERR);
+      verify_prompts_shown(expected_bad_prompts_shown);
+      response = (char *)rfc6238[i].code;
+      assert(pam_sm_open_session(NULL, 0, targc, targv) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+    }
+    assert(!chmod(fn, 0600));
+    assert((fd = open(fn, O_TRUNC | O_WRONLY)) >= 0);
+    assert(write(fd, secret, sizeof(secret)-1) == sizeof(secret)-1);
+    assert(write(fd, "\n\" TOTP_AUTH\n\" DIGITS 9\n", 24) == 24);
+    close(fd);
+    assert(pam_sm_open_session(NULL, 0, targc, targv) == PAM_SESSION_ERR);
+    verify_prompts_shown(0);
+    assert(!strncmp(get_error_msg(), "Invalid DIGITS option", 21));
+    set_time(10000*30);
+
     // Remove the temporarily created secret file
     unlink(fn);
 
@@ -570,6 +1432,14 @@ int main(int argc, char *argv[]) {
     }
   }
 
+#ifdef __linux__
+  // Stop google-authenticatord. It removes its socket on the way out.
+  signal(SIGABRT, SIG_DFL);
+  assert(!kill(daemon_pid, SIGTERM));
+  assert(waitpid(daemon_pid, NULL, 0) == daemon_pid);
+  assert(!rmdir(daemon_dir));
+#endif
+
   // Unload the PAM module
   dlclose(pam_module);
 
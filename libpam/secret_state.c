@@ -0,0 +1,962 @@
+// Parser and serializer for the secret file of the PAM module
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "secret_state.h"
+
+static const char *const option_names[NUM_OPTIONS] = {
+  "RATE_LIMIT", "WINDOW_SIZE", "DISALLOW_REUSE", "HOTP_COUNTER", "TIME_SKEW",
+  "RESETTING_TIME_SKEW", "ALGORITHM", "DIGITS", "SKEW_SEARCH_RANGE",
+  "RESETTING_HOTP_COUNTER"
+};
+
+static const char *const algorithm_names[] = { "SHA1", "SHA256", "SHA512" };
+
+// Binary files start with a NUL byte, which can never be part of a text file.
+// All numbers are stored in host byte order, and files are only portable
+// between machines that agree on it.
+static const char binary_magic[8] = "\0GAUTH\r\n";
+#define BINARY_VERSION        3
+#define BINARY_BYTE_ORDER     0x01020304
+#define BINARY_MAX_SECRET     128
+#define BINARY_MAX_SCRATCH    16
+
+typedef struct BinaryHeader {
+  char     magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t slot_size;
+  uint32_t secret_len;
+  char     secret[BINARY_MAX_SECRET];
+} BinaryHeader;
+
+// The header is followed by two slots. The state with sequence number "n" is
+// stored in slot "n % 2", so that an update never overwrites the current
+// state. If writing a slot gets interrupted, its checksum no longer matches,
+// and the other slot remains in effect.
+// Every option with typed fields in SecretState has its fields here, too.
+// Adding an option changes the layout, and needs a new BINARY_VERSION.
+typedef struct BinarySlot {
+  uint64_t checksum;        // Covers everything after this field
+  uint64_t sequence;        // Zero, if the slot has never been written
+  int64_t  hotp_counter;
+  int64_t  resetting_hotp_counter;
+  uint8_t  status[NUM_OPTIONS];
+  int32_t  totp;
+  int32_t  rate_limit_attempts;
+  int32_t  rate_limit_interval;
+  int32_t  window_size;
+  int32_t  time_skew;
+  int32_t  algorithm;
+  int32_t  digits;
+  int32_t  skew_search_range;
+  uint32_t num_rate_limit_timestamps;
+  int32_t  disallowed_base;
+  uint32_t num_resetting;
+  uint32_t num_scratch;
+  uint32_t rate_limit_timestamps[RATE_LIMIT_CAPACITY];
+  uint64_t disallowed_bits[DISALLOW_REUSE_STEPS/64];
+  uint32_t resetting_tms[RESETTING_ENTRIES];
+  int32_t  resetting_skews[RESETTING_ENTRIES];
+  int32_t  scratch[BINARY_MAX_SCRATCH];
+} BinarySlot;
+
+#define BINARY_FILE_SIZE (sizeof(BinaryHeader) + 2*sizeof(BinarySlot))
+
+static void ring_pop_oldest(RateLimitRing *ring) {
+  ring->head = (ring->head + 1) & (RATE_LIMIT_CAPACITY - 1);
+  --ring->count;
+}
+
+// Inserts a time stamp in sorted order. New time stamps are almost always
+// the most recent ones, so this usually does not have to move anything. If
+// the ring is full, the oldest time stamp is discarded.
+static void ring_insert(RateLimitRing *ring, unsigned int timestamp) {
+  if (ring->count == RATE_LIMIT_CAPACITY) {
+    if (timestamp <= rate_limit_timestamp(ring, 0)) {
+      return;
+    }
+    ring_pop_oldest(ring);
+  }
+  int i = ring->count++;
+  for (; i > 0 && rate_limit_timestamp(ring, i - 1) > timestamp; --i) {
+    ring->timestamps[(ring->head + i) & (RATE_LIMIT_CAPACITY - 1)] =
+      rate_limit_timestamp(ring, i - 1);
+  }
+  ring->timestamps[(ring->head + i) & (RATE_LIMIT_CAPACITY - 1)] = timestamp;
+}
+
+#define DISALLOW_WORDS (DISALLOW_REUSE_STEPS/64)
+
+// Returns the 64 bits that start at bit "pos". Bits outside of the set are
+// zero.
+static uint64_t bits_at(const uint64_t *bits, int pos) {
+  int word = pos >> 6, shift = pos & 63;
+  uint64_t lo = word >= 0 && word < DISALLOW_WORDS ? bits[word] : 0;
+  uint64_t hi = word + 1 >= 0 && word + 1 < DISALLOW_WORDS ? bits[word + 1] : 0;
+  return shift ? (lo >> shift) | (hi << (64 - shift)) : lo;
+}
+
+// Returns the bits of word "i" that stand for the positions "from" up to,
+// but not including, "to".
+static uint64_t word_mask(int i, int from, int to) {
+  if (from < 64*i) {
+    from = 64*i;
+  }
+  if (to > 64*i + 64) {
+    to = 64*i + 64;
+  }
+  if (from >= to) {
+    return 0;
+  }
+  return (to - from == 64 ? ~0ull : (1ull << (to - from)) - 1) << (from - 64*i);
+}
+
+// Moves the set, so that it starts at time step "base". Time steps that no
+// longer fit are dropped.
+static void disallowed_rebase(DisallowedSteps *steps, int base) {
+  long long delta = (long long)base - steps->base;
+  uint64_t bits[DISALLOW_WORDS] = { 0 };
+  if (delta > -DISALLOW_REUSE_STEPS && delta < DISALLOW_REUSE_STEPS) {
+    for (int i = 0; i < DISALLOW_WORDS; ++i) {
+      bits[i] = bits_at(steps->bits, 64*i + (int)delta);
+    }
+  }
+  memcpy(steps->bits, bits, sizeof(bits));
+  steps->base = base;
+}
+
+static int disallowed_empty(const DisallowedSteps *steps) {
+  for (int i = 0; i < DISALLOW_WORDS; ++i) {
+    if (steps->bits[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Adds a time step that was read from the file. If the steps in the file
+// cover a range that is too wide to fit, we keep the most recent ones.
+static void disallowed_add(DisallowedSteps *steps, int step) {
+  if (disallowed_empty(steps)) {
+    steps->base = step - DISALLOW_REUSE_STEPS/2;
+  } else if ((long long)step - steps->base >= DISALLOW_REUSE_STEPS) {
+    disallowed_rebase(steps, step - DISALLOW_REUSE_STEPS + 1);
+  } else if (step < steps->base) {
+    // Only move the set downwards, if that does not drop any time steps.
+    int top = DISALLOW_REUSE_STEPS - 1;
+    while (!((steps->bits[top/64] >> (top%64)) & 1)) {
+      --top;
+    }
+    if ((long long)steps->base + top - step >= DISALLOW_REUSE_STEPS) {
+      return;
+    }
+    disallowed_rebase(steps, step);
+  }
+  int i = step - steps->base;
+  steps->bits[i/64] |= 1ull << (i%64);
+}
+
+void secret_state_disallow(SecretState *state, int step, int window) {
+  // Center the set on the new time step, then drop everything outside of
+  // the window.
+  DisallowedSteps *steps = &state->disallowed;
+  disallowed_rebase(steps, step - DISALLOW_REUSE_STEPS/2);
+  for (int i = 0; i < DISALLOW_WORDS; ++i) {
+    steps->bits[i] &= word_mask(i, DISALLOW_REUSE_STEPS/2 - window + 1,
+                                DISALLOW_REUSE_STEPS/2 + window);
+  }
+  steps->bits[DISALLOW_REUSE_STEPS/2/64] |=
+    1ull << (DISALLOW_REUSE_STEPS/2 % 64);
+}
+
+// All option values are parsed in place. They end in the line terminators,
+// or in the NUL byte at the end of the line.
+
+static int parse_rate_limit(SecretState *state, const char *value) {
+  // Parse both the maximum number of login attempts and the time interval
+  // that we are looking at.
+  const char *endptr = value, *ptr;
+  int attempts, interval;
+  errno = 0;
+  if (((attempts = (int)strtoul(ptr = endptr, (char **)&endptr, 10)) < 1) ||
+      ptr == endptr ||
+      attempts > 100 ||
+      errno ||
+      (*endptr != ' ' && *endptr != '\t') ||
+      ((interval = (int)strtoul(ptr = endptr, (char **)&endptr, 10)) < 1) ||
+      ptr == endptr ||
+      interval > 3600 ||
+      errno) {
+    return OPT_INVALID;
+  }
+  state->rate_limit_attempts = attempts;
+  state->rate_limit_interval = interval;
+
+  // Parse the time stamps of all previous login attempts.
+  while (*endptr && *endptr != '\r' && *endptr != '\n') {
+    unsigned int timestamp;
+    errno = 0;
+    if ((*endptr != ' ' && *endptr != '\t') ||
+        ((timestamp = (int)strtoul(ptr = endptr, (char **)&endptr, 10)),
+         errno) ||
+        ptr == endptr) {
+      return OPT_INVALID;
+    }
+    ring_insert(&state->rate_limit_timestamps, timestamp);
+  }
+  return OPT_VALID;
+}
+
+static int parse_window_size(SecretState *state, const char *value) {
+  char *endptr;
+  errno = 0;
+  int window = (int)strtoul(value, &endptr, 10);
+  if (errno || value == endptr ||
+      (*endptr && *endptr != ' ' && *endptr != '\t' &&
+       *endptr != '\n' && *endptr != '\r') ||
+      window < 1 || window > 100) {
+    return OPT_INVALID;
+  }
+  state->window_size = window;
+  return OPT_VALID;
+}
+
+static int parse_disallow_reuse(SecretState *state, const char *value) {
+  // The list of time steps is kept up to the first syntax error.
+  for (const char *ptr = value; *ptr;) {
+    // Skip white-space, if any
+    ptr += strspn(ptr, " \t\r\n");
+    if (!*ptr) {
+      break;
+    }
+
+    char *endptr;
+    errno = 0;
+    int blocked = (int)strtoul(ptr, &endptr, 10);
+    if (errno ||
+        ptr == endptr ||
+        (*endptr != ' ' && *endptr != '\t' &&
+         *endptr != '\r' && *endptr != '\n' && *endptr)) {
+      return OPT_INVALID;
+    }
+    disallowed_add(&state->disallowed, blocked);
+    ptr = endptr;
+  }
+  return OPT_VALID;
+}
+
+static int parse_resetting_time_skew(SecretState *state, const char *value) {
+  // Only the most recent entries matter. Parsing stops silently at the first
+  // entry that we do not understand.
+  const char *ptr = value;
+  while (*ptr && *ptr != '\r' && *ptr != '\n') {
+    char *endptr;
+    errno = 0;
+    unsigned int i = (int)strtoul(ptr, &endptr, 10);
+    if (errno || ptr == endptr || (*endptr != '+' && *endptr != '-')) {
+      break;
+    }
+    ptr = endptr;
+    int j = (int)strtoul(ptr + 1, &endptr, 10);
+    if (errno ||
+        ptr == endptr ||
+        (*endptr != ' ' && *endptr != '\t' &&
+         *endptr != '\r' && *endptr != '\n' && *endptr)) {
+      break;
+    }
+    if (*ptr == '-') {
+      j = -j;
+    }
+    if (state->num_resetting == RESETTING_ENTRIES) {
+      memmove(state->resetting_tms, state->resetting_tms + 1,
+              sizeof(state->resetting_tms) - sizeof(int));
+      memmove(state->resetting_skews, state->resetting_skews + 1,
+              sizeof(state->resetting_skews) - sizeof(int));
+    } else {
+      ++state->num_resetting;
+    }
+    state->resetting_tms[state->num_resetting - 1]   = i;
+    state->resetting_skews[state->num_resetting - 1] = j;
+    ptr = endptr;
+  }
+  return OPT_VALID;
+}
+
+static int parse_algorithm(SecretState *state, const char *value) {
+  size_t len = strcspn(value, " \t\r\n");
+  for (int i = 0; i < sizeof(algorithm_names)/sizeof(*algorithm_names); ++i) {
+    if (len == strlen(algorithm_names[i]) &&
+        !memcmp(value, algorithm_names[i], len)) {
+      state->algorithm = i;
+      return OPT_VALID;
+    }
+  }
+  return OPT_INVALID;
+}
+
+static int parse_digits(SecretState *state, const char *value) {
+  char *endptr;
+  errno = 0;
+  int digits = (int)strtoul(value, &endptr, 10);
+  if (errno || value == endptr ||
+      (*endptr && *endptr != ' ' && *endptr != '\t' &&
+       *endptr != '\n' && *endptr != '\r') ||
+      digits < 6 || digits > 8) {
+    return OPT_INVALID;
+  }
+  state->digits = digits;
+  return OPT_VALID;
+}
+
+static int parse_skew_search_range(SecretState *state, const char *value) {
+  char *endptr;
+  errno = 0;
+  int range = (int)strtoul(value, &endptr, 10);
+  if (errno || value == endptr ||
+      (*endptr && *endptr != ' ' && *endptr != '\t' &&
+       *endptr != '\n' && *endptr != '\r') ||
+      range < 1 || range > MAX_SKEW_SEARCH_RANGE) {
+    return OPT_INVALID;
+  }
+  state->skew_search_range = range;
+  return OPT_VALID;
+}
+
+// Returns the new status of the option, or -1 if out of memory.
+static int parse_option(SecretState *state, int option, const char *value) {
+  switch (option) {
+  case OPT_RATE_LIMIT:
+    return parse_rate_limit(state, value);
+  case OPT_WINDOW_SIZE:
+    return parse_window_size(state, value);
+  case OPT_DISALLOW_REUSE:
+    return parse_disallow_reuse(state, value);
+  case OPT_HOTP_COUNTER:
+    state->hotp_counter = strtol(value, NULL, 10);
+    return OPT_VALID;
+  case OPT_TIME_SKEW:
+    state->time_skew = (int)strtol(value, NULL, 10);
+    return OPT_VALID;
+  case OPT_RESETTING_TIME_SKEW:
+    return parse_resetting_time_skew(state, value);
+  case OPT_ALGORITHM:
+    return parse_algorithm(state, value);
+  case OPT_DIGITS:
+    return parse_digits(state, value);
+  case OPT_SKEW_SEARCH_RANGE:
+    return parse_skew_search_range(state, value);
+  case OPT_RESETTING_HOTP_COUNTER:
+    state->resetting_hotp_counter = strtol(value, NULL, 10);
+    return OPT_VALID;
+  default:
+    return OPT_INVALID;
+  }
+}
+
+// Classifies one line, other than the first one. "len" is the length of the
+// line without its terminators. Scratch codes are only recognized up to the
+// first line that is neither an option nor a scratch code.
+static int parse_line(SecretState *state, SecretLine *line, size_t len,
+                      int *scratch_codes) {
+  const char *text = line->text;
+  if (*text == '"') {
+    if (text[1] != ' ') {
+      return 0;
+    }
+    for (int option = 0; option < NUM_OPTIONS; ++option) {
+      size_t key_len = strlen(option_names[option]);
+      const char *ptr = text + 2 + key_len;
+      if (len >= 2 + key_len &&
+          !memcmp(text + 2, option_names[option], key_len) &&
+          (ptr == text + len || *ptr == ' ' || *ptr == '\t')) {
+        line->option = option;
+
+        // Only the first occurrence of an option is used.
+        if (state->status[option] == OPT_ABSENT) {
+          int status = parse_option(state, option, ptr + strspn(ptr, " \t"));
+          if (status < 0) {
+            return -1;
+          }
+          state->status[option] = status;
+        }
+        return 0;
+      }
+    }
+    return 0;
+  }
+
+  if (*scratch_codes) {
+    // Scratch codes are all numeric eight-digit codes. There must not be any
+    // other information on that line.
+    char *endptr;
+    errno = 0;
+    int scratchcode = (int)strtoul(text, &endptr, 10);
+    if (errno ||
+        endptr == text ||
+        endptr != text + len ||
+        scratchcode <  10*1000*1000 ||
+        scratchcode >= 100*1000*1000) {
+      *scratch_codes = 0;
+    } else {
+      line->scratch = scratchcode;
+    }
+  }
+  return 0;
+}
+
+int secret_state_parse(SecretState *state, const char *buf) {
+  memset(state, 0, sizeof(*state));
+  state->digits = 6;
+  if (!(state->secret = strndup(buf, strcspn(buf, "\n")))) {
+    return -1;
+  }
+
+  int max_lines = 0, scratch_codes = 1;
+  const char *ptr = buf;
+  do {
+    if (state->num_lines == max_lines) {
+      max_lines = 2*max_lines + 16;
+      SecretLine *lines = realloc(state->lines, max_lines*sizeof(SecretLine));
+      if (!lines) {
+        return -1;
+      }
+      state->lines = lines;
+    }
+
+    // Lines end in any sequence of CR and LF characters.
+    size_t len = strcspn(ptr, "\r\n");
+    size_t total = len + strspn(ptr + len, "\r\n");
+    SecretLine *line = &state->lines[state->num_lines];
+    line->option = -1;
+    line->scratch = 0;
+    line->changed = 0;
+    if (!(line->text = strndup(ptr, total))) {
+      return -1;
+    }
+    ++state->num_lines;
+    if (memmem(ptr, len, "\" TOTP_AUTH", 11)) {
+      state->totp = 1;
+    }
+    if (state->num_lines > 1 &&
+        parse_line(state, line, len, &scratch_codes) < 0) {
+      return -1;
+    }
+    ptr += total;
+  } while (*ptr);
+  return 0;
+}
+
+static void remove_line(SecretState *state, int idx) {
+  SecretLine *line = &state->lines[idx];
+  if (line->text) {
+    memset(line->text, 0, strlen(line->text));
+    free(line->text);
+  }
+  memmove(line, line + 1, (state->num_lines - idx - 1)*sizeof(SecretLine));
+  --state->num_lines;
+}
+
+int secret_state_update(SecretState *state, int option) {
+  int first = -1;
+  for (int i = 1; i < state->num_lines; ) {
+    if (state->lines[i].option != option) {
+      ++i;
+    } else if (first < 0) {
+      first = i++;
+    } else {
+      remove_line(state, i);
+    }
+  }
+
+  if (first < 0) {
+    // New options go right after the secret. This needs a line terminator,
+    // even if the file did not have one.
+    SecretLine *lines = realloc(state->lines,
+                                (state->num_lines + 1)*sizeof(SecretLine));
+    if (!lines) {
+      return -1;
+    }
+    state->lines = lines;
+    char *eol = strdup("\n");
+    if (!eol) {
+      return -1;
+    }
+    char *secret_line = lines[0].text;
+    size_t len = strlen(secret_line);
+    if (!len ||
+        (secret_line[len - 1] != '\n' && secret_line[len - 1] != '\r')) {
+      char *resized = malloc(len + 2);
+      if (!resized) {
+        free(eol);
+        return -1;
+      }
+      memcpy(resized, secret_line, len);
+      strcpy(resized + len, "\n");
+      memset(secret_line, 0, len);
+      free(secret_line);
+      lines[0].text = resized;
+    }
+    first = 1;
+    memmove(lines + 2, lines + 1, (state->num_lines - 1)*sizeof(SecretLine));
+    lines[1].text = eol;
+    lines[1].option = option;
+    lines[1].scratch = 0;
+    lines[1].changed = 1;
+    ++state->num_lines;
+  } else if (!state->lines[first].changed) {
+    // Only keep the line terminators. They might include blank lines.
+    char *text = state->lines[first].text;
+    size_t len = strcspn(text, "\r\n");
+    memmove(text, text + len, strlen(text + len) + 1);
+    if (!*text) {
+      // The last line of the file did not have a terminator.
+      char *eol = strdup("\n");
+      if (!eol) {
+        return -1;
+      }
+      free(text);
+      state->lines[first].text = eol;
+    }
+    state->lines[first].changed = 1;
+  }
+  state->status[option] = OPT_VALID;
+  return 0;
+}
+
+void secret_state_remove_option(SecretState *state, int option) {
+  for (int i = 1; i < state->num_lines; ) {
+    if (state->lines[i].option == option) {
+      remove_line(state, i);
+    } else {
+      ++i;
+    }
+  }
+  state->status[option] = OPT_ABSENT;
+}
+
+int secret_state_remove_scratch_code(SecretState *state, int code) {
+  for (int i = 1; i < state->num_lines; ++i) {
+    if (state->lines[i].scratch && state->lines[i].scratch == code) {
+      remove_line(state, i);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Generates the line for an option from its typed fields, followed by the
+// line terminators in "eol".
+static char *render_option(const SecretState *state, int option,
+                           const char *eol) {
+  int num_disallowed = 0;
+  for (int i = 0; i < DISALLOW_WORDS; ++i) {
+    num_disallowed += __builtin_popcountll(state->disallowed.bits[i]);
+  }
+  char *line = malloc(64 + strlen(eol) +
+                      24*(state->rate_limit_timestamps.count +
+                          num_disallowed + RESETTING_ENTRIES));
+  if (!line) {
+    return NULL;
+  }
+  char *ptr = line + sprintf(line, "\" %s ", option_names[option]);
+  switch (option) {
+  case OPT_RATE_LIMIT:
+    ptr += sprintf(ptr, "%d %d", state->rate_limit_attempts,
+                   state->rate_limit_interval);
+    for (int i = 0; i < state->rate_limit_timestamps.count; ++i) {
+      ptr += sprintf(ptr, " %u",
+                     rate_limit_timestamp(&state->rate_limit_timestamps, i));
+    }
+    break;
+  case OPT_WINDOW_SIZE:
+    ptr += sprintf(ptr, "%d", state->window_size);
+    break;
+  case OPT_DISALLOW_REUSE:
+    for (int i = 0, first = 1; i < DISALLOW_REUSE_STEPS; ++i) {
+      if ((state->disallowed.bits[i/64] >> (i%64)) & 1) {
+        ptr += sprintf(ptr, " %d" + first, state->disallowed.base + i);
+        first = 0;
+      }
+    }
+    break;
+  case OPT_HOTP_COUNTER:
+    ptr += sprintf(ptr, "%ld", state->hotp_counter);
+    break;
+  case OPT_TIME_SKEW:
+    ptr += sprintf(ptr, "%d", state->time_skew);
+    break;
+  case OPT_RESETTING_TIME_SKEW:
+    for (int i = 0; i < state->num_resetting; ++i) {
+      ptr += sprintf(ptr, " %d%+d" + !i, state->resetting_tms[i],
+                     state->resetting_skews[i]);
+    }
+    break;
+  case OPT_ALGORITHM:
+    ptr += sprintf(ptr, "%s", algorithm_names[state->algorithm]);
+    break;
+  case OPT_DIGITS:
+    ptr += sprintf(ptr, "%d", state->digits);
+    break;
+  case OPT_SKEW_SEARCH_RANGE:
+    ptr += sprintf(ptr, "%d", state->skew_search_range);
+    break;
+  case OPT_RESETTING_HOTP_COUNTER:
+    if (state->resetting_hotp_counter) {
+      ptr += sprintf(ptr, "%ld", state->resetting_hotp_counter);
+    }
+    break;
+  }
+  strcpy(ptr, eol);
+  return line;
+}
+
+char *secret_state_serialize(const SecretState *state) {
+  char *rendered[state->num_lines];
+  size_t len = 0;
+  char *buf = NULL;
+  memset(rendered, 0, sizeof(rendered));
+  for (int i = 0; i < state->num_lines; ++i) {
+    if (state->lines[i].changed &&
+        !(rendered[i] = render_option(state, state->lines[i].option,
+                                      state->lines[i].text))) {
+      goto cleanup;
+    }
+    len += strlen(rendered[i] ? rendered[i] : state->lines[i].text);
+  }
+  if ((buf = malloc(len + 1)) != NULL) {
+    char *ptr = buf;
+    for (int i = 0; i < state->num_lines; ++i) {
+      const char *text = rendered[i] ? rendered[i] : state->lines[i].text;
+      size_t text_len = strlen(text);
+      memcpy(ptr, text, text_len);
+      ptr += text_len;
+    }
+    *ptr = '\000';
+  }
+ cleanup:
+  for (int i = 0; i < state->num_lines; ++i) {
+    free(rendered[i]);
+  }
+  return buf;
+}
+
+int secret_state_rate_limit(SecretState *state, unsigned int now) {
+  RateLimitRing *ring = &state->rate_limit_timestamps;
+
+  // Drop time stamps from the future. The clock must have been turned back.
+  while (ring->count && rate_limit_timestamp(ring, ring->count - 1) > now) {
+    --ring->count;
+  }
+
+  // Add the current login attempt, then expire all entries outside of the
+  // current time interval.
+  ring_insert(ring, now);
+  while (ring->count &&
+         rate_limit_timestamp(ring, 0) < now - state->rate_limit_interval) {
+    ring_pop_oldest(ring);
+  }
+
+  // Only keep as many time stamps as there are allowed attempts.
+  int exceeded = ring->count > state->rate_limit_attempts;
+  while (ring->count > state->rate_limit_attempts) {
+    ring_pop_oldest(ring);
+  }
+  return exceeded;
+}
+
+// FNV-1a hash of everything in the slot after the checksum itself.
+static uint64_t slot_checksum(const BinarySlot *slot) {
+  const uint8_t *ptr = (const uint8_t *)&slot->sequence;
+  const uint8_t *end = (const uint8_t *)(slot + 1);
+  uint64_t hash = 0xCBF29CE484222325ull;
+  while (ptr < end) {
+    hash = (hash ^ *ptr++) * 0x100000001B3ull;
+  }
+  return hash;
+}
+
+int secret_state_is_binary(const char *buf, size_t len) {
+  return len >= sizeof(binary_magic) &&
+         !memcmp(buf, binary_magic, sizeof(binary_magic));
+}
+
+// Returns the slot that holds the current state, or NULL if the file is
+// corrupt.
+static const BinarySlot *current_slot(const char *buf, size_t len) {
+  const BinaryHeader *header = (const BinaryHeader *)buf;
+  if (len != BINARY_FILE_SIZE ||
+      !secret_state_is_binary(buf, len) ||
+      header->version != BINARY_VERSION ||
+      header->byte_order != BINARY_BYTE_ORDER ||
+      header->slot_size != sizeof(BinarySlot) ||
+      header->secret_len < 1 ||
+      header->secret_len > BINARY_MAX_SECRET) {
+    return NULL;
+  }
+  const BinarySlot *slots = (const BinarySlot *)(header + 1);
+  const BinarySlot *slot = NULL;
+  for (int i = 0; i < 2; ++i) {
+    if (slots[i].sequence &&
+        slots[i].checksum == slot_checksum(&slots[i]) &&
+        (!slot || slots[i].sequence > slot->sequence)) {
+      slot = &slots[i];
+    }
+  }
+  if (slot &&
+      (slot->num_rate_limit_timestamps > RATE_LIMIT_CAPACITY ||
+       slot->num_resetting > RESETTING_ENTRIES ||
+       slot->num_scratch > BINARY_MAX_SCRATCH ||
+       slot->algorithm < ALGORITHM_SHA1 ||
+       slot->algorithm > ALGORITHM_SHA512 ||
+       (slot->status[OPT_SKEW_SEARCH_RANGE] == OPT_VALID &&
+        (slot->skew_search_range < 1 ||
+         slot->skew_search_range > MAX_SKEW_SEARCH_RANGE)))) {
+    return NULL;
+  }
+  return slot;
+}
+
+// Appends a line to a state that is being read from a binary file.
+static int add_line(SecretState *state, const char *text, int option,
+                    int scratch) {
+  SecretLine *lines = realloc(state->lines,
+                              (state->num_lines + 1)*sizeof(SecretLine));
+  if (!lines) {
+    return -1;
+  }
+  state->lines = lines;
+  SecretLine *line = &lines[state->num_lines];
+  if (!(line->text = strdup(text))) {
+    return -1;
+  }
+  line->option = option;
+  line->scratch = scratch;
+  line->changed = option >= 0;
+  ++state->num_lines;
+  return 0;
+}
+
+int secret_state_parse_binary(SecretState *state, const char *buf,
+                              size_t len) {
+  memset(state, 0, sizeof(*state));
+  const BinarySlot *slot = current_slot(buf, len);
+  if (!slot) {
+    return 1;
+  }
+  const BinaryHeader *header = (const BinaryHeader *)buf;
+  if (!(state->secret = strndup(header->secret, header->secret_len))) {
+    return -1;
+  }
+  state->binary = 1;
+  state->sequence = slot->sequence;
+  state->totp = slot->totp;
+  memcpy(state->status, slot->status, sizeof(slot->status));
+  state->rate_limit_attempts = slot->rate_limit_attempts;
+  state->rate_limit_interval = slot->rate_limit_interval;
+  state->window_size = slot->window_size;
+  state->hotp_counter = slot->hotp_counter;
+  state->time_skew = slot->time_skew;
+  state->algorithm = slot->algorithm;
+  state->digits = slot->digits;
+  state->skew_search_range = slot->skew_search_range;
+  state->resetting_hotp_counter = slot->resetting_hotp_counter;
+  for (int i = 0; i < slot->num_rate_limit_timestamps; ++i) {
+    ring_insert(&state->rate_limit_timestamps, slot->rate_limit_timestamps[i]);
+  }
+  state->disallowed.base = slot->disallowed_base;
+  memcpy(state->disallowed.bits, slot->disallowed_bits,
+         sizeof(state->disallowed.bits));
+  state->num_resetting = slot->num_resetting;
+  memcpy(state->resetting_tms, slot->resetting_tms,
+         sizeof(state->resetting_tms));
+  memcpy(state->resetting_skews, slot->resetting_skews,
+         sizeof(state->resetting_skews));
+
+  // Generate the lines that a text file with the same state would have. They
+  // are needed for updates, and for converting back to the text format.
+  char *secret_line = malloc(header->secret_len + 2);
+  if (!secret_line) {
+    return -1;
+  }
+  strcat(strcpy(secret_line, state->secret), "\n");
+  int rc = add_line(state, secret_line, -1, 0);
+  memset(secret_line, 0, header->secret_len);
+  free(secret_line);
+  if (rc < 0 ||
+      (state->totp && add_line(state, "\" TOTP_AUTH\n", -1, 0) < 0)) {
+    return -1;
+  }
+  for (int option = 0; option < NUM_OPTIONS; ++option) {
+    if (state->status[option] != OPT_ABSENT &&
+        add_line(state, "\n", option, 0) < 0) {
+      return -1;
+    }
+  }
+  for (int i = 0; i < slot->num_scratch; ++i) {
+    char scratch[12];
+    sprintf(scratch, "%08d\n", slot->scratch[i]);
+    if (add_line(state, scratch, -1, slot->scratch[i]) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Fills in all fields of "slot", except for the sequence number and the
+// checksum. Returns -1 and sets "errno", if the state cannot be represented.
+static int fill_slot(const SecretState *state, BinarySlot *slot) {
+  memset(slot, 0, sizeof(*slot));
+  for (int option = 0; option < NUM_OPTIONS; ++option) {
+    if (state->status[option] == OPT_INVALID) {
+      goto invalid;
+    }
+    slot->status[option] = state->status[option];
+  }
+  slot->totp = state->totp;
+  slot->rate_limit_attempts = state->rate_limit_attempts;
+  slot->rate_limit_interval = state->rate_limit_interval;
+  slot->window_size = state->window_size;
+  slot->hotp_counter = state->hotp_counter;
+  slot->time_skew = state->time_skew;
+  slot->algorithm = state->algorithm;
+  slot->digits = state->digits;
+  slot->skew_search_range = state->skew_search_range;
+  slot->resetting_hotp_counter = state->resetting_hotp_counter;
+  slot->num_rate_limit_timestamps = state->rate_limit_timestamps.count;
+  for (int i = 0; i < state->rate_limit_timestamps.count; ++i) {
+    slot->rate_limit_timestamps[i] =
+      rate_limit_timestamp(&state->rate_limit_timestamps, i);
+  }
+  slot->disallowed_base = state->disallowed.base;
+  memcpy(slot->disallowed_bits, state->disallowed.bits,
+         sizeof(slot->disallowed_bits));
+  slot->num_resetting = state->num_resetting;
+  memcpy(slot->resetting_tms, state->resetting_tms,
+         sizeof(slot->resetting_tms));
+  memcpy(slot->resetting_skews, state->resetting_skews,
+         sizeof(slot->resetting_skews));
+
+  // Other than options and scratch codes, the only line that we know how to
+  // represent is the "TOTP_AUTH" option.
+  for (int i = 1; i < state->num_lines; ++i) {
+    const SecretLine *line = &state->lines[i];
+    if (line->scratch) {
+      if (slot->num_scratch == BINARY_MAX_SCRATCH) {
+        goto invalid;
+      }
+      slot->scratch[slot->num_scratch++] = line->scratch;
+    } else if (line->option < 0 &&
+               strncmp(line->text, "\" TOTP_AUTH", 11)) {
+      goto invalid;
+    }
+  }
+  return 0;
+
+ invalid:
+  memset(slot, 0, sizeof(*slot));
+  errno = EINVAL;
+  return -1;
+}
+
+char *secret_state_serialize_binary(const SecretState *state, size_t *len) {
+  size_t secret_len = strcspn(state->secret, "\r\n");
+  if (secret_len < 1 || secret_len > BINARY_MAX_SECRET) {
+    errno = EINVAL;
+    return NULL;
+  }
+  char *buf = calloc(1, BINARY_FILE_SIZE);
+  if (!buf) {
+    return NULL;
+  }
+  BinaryHeader *header = (BinaryHeader *)buf;
+  memcpy(header->magic, binary_magic, sizeof(binary_magic));
+  header->version = BINARY_VERSION;
+  header->byte_order = BINARY_BYTE_ORDER;
+  header->slot_size = sizeof(BinarySlot);
+  header->secret_len = secret_len;
+  memcpy(header->secret, state->secret, secret_len);
+  BinarySlot *slot = (BinarySlot *)(header + 1) + 1;
+  if (fill_slot(state, slot) < 0) {
+    memset(buf, 0, BINARY_FILE_SIZE);
+    free(buf);
+    errno = EINVAL;
+    return NULL;
+  }
+  slot->sequence = 1;
+  slot->checksum = slot_checksum(slot);
+  *len = BINARY_FILE_SIZE;
+  return buf;
+}
+
+int secret_state_update_binary(SecretState *state, int fd) {
+  // Make sure that nobody else changed the file since we read it. This
+  // prevents attackers from opening a lot of pending sessions and then
+  // reusing the same scratch code multiple times.
+  char *buf = malloc(BINARY_FILE_SIZE + 1);
+  if (!buf) {
+    return -1;
+  }
+  int rc = -1;
+  ssize_t len = pread(fd, buf, BINARY_FILE_SIZE + 1, 0);
+  if (len < 0) {
+    goto cleanup;
+  }
+  const BinarySlot *current = current_slot(buf, len);
+  if (!current || current->sequence != state->sequence) {
+    rc = 1;
+    goto cleanup;
+  }
+
+  // Write the new state into the other slot.
+  BinarySlot slot;
+  if (fill_slot(state, &slot) < 0) {
+    goto cleanup;
+  }
+  slot.sequence = state->sequence + 1;
+  slot.checksum = slot_checksum(&slot);
+  off_t offset = sizeof(BinaryHeader) + (slot.sequence % 2)*sizeof(BinarySlot);
+  if (pwrite(fd, &slot, sizeof(slot), offset) == sizeof(slot) &&
+      !fdatasync(fd)) {
+    state->sequence = slot.sequence;
+    rc = 0;
+  }
+  memset(&slot, 0, sizeof(slot));
+
+ cleanup:
+  memset(buf, 0, BINARY_FILE_SIZE + 1);
+  free(buf);
+  return rc;
+}
+
+void secret_state_clear(SecretState *state) {
+  while (state->num_lines > 0) {
+    remove_line(state, state->num_lines - 1);
+  }
+  free(state->lines);
+  if (state->secret) {
+    memset(state->secret, 0, strlen(state->secret));
+    free(state->secret);
+  }
+  memset(state, 0, sizeof(*state));
+}
@@ -0,0 +1,206 @@
+// Parser and serializer for the secret file of the PAM module
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// The file format is described in FILEFORMAT. The file is parsed once, in a
+// single pass, into typed fields. Lines are kept in their original order, so
+// that unchanged lines (including any that we do not understand) are written
+// back exactly as they were read.
+//
+// Alternatively, the same state can be kept in a binary file. It holds two
+// fixed-size copies of the state, only one of which is ever overwritten at a
+// time. Updates are written in place, and a checksum and sequence number tell
+// which copy is current. Binary files are parsed into the same SecretState,
+// so the rest of the code does not need to know which format is in use.
+
+#ifndef SECRET_STATE_H__
+#define SECRET_STATE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Options that have typed fields in SecretState
+enum {
+  OPT_RATE_LIMIT = 0,
+  OPT_WINDOW_SIZE,
+  OPT_DISALLOW_REUSE,
+  OPT_HOTP_COUNTER,
+  OPT_TIME_SKEW,
+  OPT_RESETTING_TIME_SKEW,
+  OPT_ALGORITHM,
+  OPT_DIGITS,
+  OPT_SKEW_SEARCH_RANGE,
+  OPT_RESETTING_HOTP_COUNTER,
+  NUM_OPTIONS
+};
+
+// Values in SecretState.status[]. Syntax errors are recorded, rather than
+// reported right away, so that they only cause failures when the option is
+// actually needed.
+enum { OPT_ABSENT = 0, OPT_VALID, OPT_INVALID };
+
+// Values for SecretState.algorithm
+enum { ALGORITHM_SHA1 = 0, ALGORITHM_SHA256, ALGORITHM_SHA512 };
+
+// Number of RESETTING_TIME_SKEW entries that are needed to adjust the skew
+#define RESETTING_ENTRIES 3
+
+// The search for time skew looks at most this many steps away from the
+// expected skew, in either direction.
+#define MAX_SKEW_SEARCH_RANGE (25*60 - 1)
+
+// RATE_LIMIT allows at most 100 attempts. While checking the limit, there can
+// briefly be one more time stamp than that. Must be a power of two.
+#define RATE_LIMIT_CAPACITY 128
+
+// Time stamps of recent login attempts in ascending order. They are kept in
+// a ring buffer, so that expiring the oldest entries and appending new ones
+// does not need to move or allocate anything.
+typedef struct RateLimitRing {
+  unsigned int timestamps[RATE_LIMIT_CAPACITY];
+  int          head;                 // Index of the oldest time stamp
+  int          count;
+} RateLimitRing;
+
+// DISALLOW_REUSE only has to remember the time steps within the window
+// around the most recently used one. Windows extend by at most 99 steps in
+// either direction. Must be a multiple of 64.
+#define DISALLOW_REUSE_STEPS 256
+
+// Set of time steps that must not be reused. Bit "i" stands for time step
+// "base + i". This takes constant space, no matter how many codes are used.
+typedef struct DisallowedSteps {
+  int      base;
+  uint64_t bits[DISALLOW_REUSE_STEPS/64];
+} DisallowedSteps;
+
+typedef struct SecretLine {
+  char *text;     // Line contents with terminators; only the terminators, if
+                  // the line must be regenerated from the typed fields
+  int  option;    // OPT_... for lines with a known option, and -1 otherwise
+  int  scratch;   // Scratch code on this line, or zero
+  int  changed;   // The option's typed fields have been updated
+} SecretLine;
+
+typedef struct SecretState {
+  SecretLine   *lines;
+  int          num_lines;
+  char         *secret;              // BASE32 encoded secret
+  int          totp;                 // File has a "TOTP_AUTH" option
+  unsigned char status[NUM_OPTIONS];
+
+  int          rate_limit_attempts;
+  int          rate_limit_interval;
+  RateLimitRing rate_limit_timestamps;
+  int          window_size;
+  DisallowedSteps disallowed;        // Time steps that must not be reused
+  long         hotp_counter;
+  int          time_skew;
+  unsigned int resetting_tms[RESETTING_ENTRIES];
+  int          resetting_skews[RESETTING_ENTRIES];
+  int          num_resetting;
+  int          algorithm;
+  int          digits;
+  int          skew_search_range;
+  long         resetting_hotp_counter; // Zero, if not resynchronizing
+
+  int          binary;               // State was read from a binary file
+  unsigned long long sequence;       // Sequence number of the binary state
+} SecretState;
+
+// Parses the NUL terminated contents of a secret file. Returns 0 on success,
+// and -1 if out of memory. "state" must be released with secret_state_clear()
+// in either case.
+int secret_state_parse(SecretState *state, const char *buf)
+  __attribute__((visibility("hidden")));
+
+// Must be called after changing the typed fields of "option". The option's
+// line is then regenerated, when the state is serialized. If the file did not
+// have the option yet, it is added right after the secret. Later duplicates
+// of the option are removed. Returns -1 if out of memory.
+int secret_state_update(SecretState *state, int option)
+  __attribute__((visibility("hidden")));
+
+// Removes all lines of "option" from the file. The option is then absent, as
+// if the file had never had it.
+void secret_state_remove_option(SecretState *state, int option)
+  __attribute__((visibility("hidden")));
+
+// Removes scratch code "code" from the file. Returns 0 on success, and 1 if
+// there is no such scratch code.
+int secret_state_remove_scratch_code(SecretState *state, int code)
+  __attribute__((visibility("hidden")));
+
+// Returns the new file contents in a NUL terminated buffer that the caller
+// must free, or NULL if out of memory.
+char *secret_state_serialize(const SecretState *state)
+  __attribute__((visibility("hidden")));
+
+// Returns the i-th oldest time stamp of a RATE_LIMIT option.
+static inline unsigned int rate_limit_timestamp(const RateLimitRing *ring,
+                                                int i) {
+  return ring->timestamps[(ring->head + i) & (RATE_LIMIT_CAPACITY - 1)];
+}
+
+// Records a login attempt at time "now", and expires all time stamps that are
+// older than the RATE_LIMIT interval. Returns 1, if there have been too many
+// attempts, and 0 otherwise. Only the most recent attempts are kept in either
+// case. The caller must call secret_state_update() afterwards.
+int secret_state_rate_limit(SecretState *state, unsigned int now)
+  __attribute__((visibility("hidden")));
+
+// Returns non-zero, if DISALLOW_REUSE blocks time step "step".
+static inline int secret_state_is_disallowed(const SecretState *state,
+                                             int step) {
+  unsigned int i = (unsigned int)step - (unsigned int)state->disallowed.base;
+  return i < DISALLOW_REUSE_STEPS &&
+         ((state->disallowed.bits[i/64] >> (i%64)) & 1);
+}
+
+// Blocks time step "step" from being reused, and forgets about all time
+// steps that are "window" or more steps away from it. The caller must call
+// secret_state_update() afterwards.
+void secret_state_disallow(SecretState *state, int step, int window)
+  __attribute__((visibility("hidden")));
+
+// Returns non-zero, if "buf" holds a binary secret file.
+int secret_state_is_binary(const char *buf, size_t len)
+  __attribute__((visibility("hidden")));
+
+// Parses the contents of a binary secret file. Returns 0 on success, 1 if the
+// file is corrupt, and -1 if out of memory. "state" must be released with
+// secret_state_clear() in either case.
+int secret_state_parse_binary(SecretState *state, const char *buf, size_t len)
+  __attribute__((visibility("hidden")));
+
+// Returns the contents of a new binary secret file in a buffer that the
+// caller must free, and stores its size in "len". Returns NULL and sets
+// "errno" to EINVAL, if the state cannot be represented in the binary format.
+// This happens for options that we do not understand, for options with
+// syntax errors, and for overly long lists.
+char *secret_state_serialize_binary(const SecretState *state, size_t *len)
+  __attribute__((visibility("hidden")));
+
+// Writes the state back to the binary file "fd" that it was read from, and
+// waits for the data to reach the disk. Returns 0 on success, 1 if somebody
+// else updated the file since it was read, and -1 on error.
+int secret_state_update_binary(SecretState *state, int fd)
+  __attribute__((visibility("hidden")));
+
+// Releases all memory, after overwriting anything that could be sensitive.
+void secret_state_clear(SecretState *state)
+  __attribute__((visibility("hidden")));
+
+#endif
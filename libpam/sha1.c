@@ -103,12 +103,272 @@
     A = T32(R32(B,5) + f##n(C,D,E) + T + *WP++ + CONST##n); C = R32(C,30)
 
 
+/* the portable compression function, used if there is no hardware support */
+
+static void
+sha1_compress_generic(uint32_t *digest, const uint32_t *block)
+{
+    int i;
+    uint32_t T, A, B, C, D, E, W[80], *WP;
+
+    for (i = 0; i < 16; ++i) {
+        W[i] = block[i];
+    }
+    for (i = 16; i < 80; ++i) {
+    W[i] = W[i-3] ^ W[i-8] ^ W[i-14] ^ W[i-16];
+    W[i] = R32(W[i], 1);
+    }
+    A = digest[0];
+    B = digest[1];
+    C = digest[2];
+    D = digest[3];
+    E = digest[4];
+    WP = W;
+#ifdef UNRAVEL
+    FA(1); FB(1); FC(1); FD(1); FE(1); FT(1); FA(1); FB(1); FC(1); FD(1);
+    FE(1); FT(1); FA(1); FB(1); FC(1); FD(1); FE(1); FT(1); FA(1); FB(1);
+    FC(2); FD(2); FE(2); FT(2); FA(2); FB(2); FC(2); FD(2); FE(2); FT(2);
+    FA(2); FB(2); FC(2); FD(2); FE(2); FT(2); FA(2); FB(2); FC(2); FD(2);
+    FE(3); FT(3); FA(3); FB(3); FC(3); FD(3); FE(3); FT(3); FA(3); FB(3);
+    FC(3); FD(3); FE(3); FT(3); FA(3); FB(3); FC(3); FD(3); FE(3); FT(3);
+    FA(4); FB(4); FC(4); FD(4); FE(4); FT(4); FA(4); FB(4); FC(4); FD(4);
+    FE(4); FT(4); FA(4); FB(4); FC(4); FD(4); FE(4); FT(4); FA(4); FB(4);
+    digest[0] = T32(digest[0] + E);
+    digest[1] = T32(digest[1] + T);
+    digest[2] = T32(digest[2] + A);
+    digest[3] = T32(digest[3] + B);
+    digest[4] = T32(digest[4] + C);
+#else /* !UNRAVEL */
+#ifdef UNROLL_LOOPS
+    FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1);
+    FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1);
+    FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2);
+    FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2);
+    FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3);
+    FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3);
+    FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4);
+    FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4);
+#else /* !UNROLL_LOOPS */
+    for (i =  0; i < 20; ++i) { FG(1); }
+    for (i = 20; i < 40; ++i) { FG(2); }
+    for (i = 40; i < 60; ++i) { FG(3); }
+    for (i = 60; i < 80; ++i) { FG(4); }
+#endif /* !UNROLL_LOOPS */
+    digest[0] = T32(digest[0] + A);
+    digest[1] = T32(digest[1] + B);
+    digest[2] = T32(digest[2] + C);
+    digest[3] = T32(digest[3] + D);
+    digest[4] = T32(digest[4] + E);
+#endif /* !UNRAVEL */
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) &&                             \
+    (defined(__clang__) || __GNUC__ >= 5)
+#define HAS_SHA_NI
+#include <cpuid.h>
+#include <immintrin.h>
+
+/* four rounds using the x86 SHA extensions; "E" holds the "e" value for the
+ * current rounds, and "ABCD" is saved in "F" to compute the next one
+ */
+#define NI(E, F, MSG, f)    \
+    E = _mm_sha1nexte_epu32(E, MSG); F = ABCD;    \
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E, f)
+
+/* the message schedule: "M0" holds the current words, the other registers
+ * accumulate partial results for the next three groups of four rounds
+ */
+#define NI_MSG2(M0, M1)        M1 = _mm_sha1msg2_epu32(M1, M0)
+#define NI_XOR(M0, M2)         M2 = _mm_xor_si128(M2, M0)
+#define NI_MSG1(M0, M3)        M3 = _mm_sha1msg1_epu32(M3, M0)
+#define NI_SCHED(M0, M1, M2, M3)    \
+    NI_MSG2(M0, M1); NI_XOR(M0, M2); NI_MSG1(M0, M3)
+
+static __attribute__((target("sha,sse4.1"))) void
+sha1_compress_sha_ni(uint32_t *digest, const uint32_t *block)
+{
+    __m128i ABCD, ABCD_SAVE, E0, E0_SAVE, E1, MSG0, MSG1, MSG2, MSG3;
+
+    /* the instructions expect "a" and "W[0]" in the most significant lane */
+    ABCD = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) digest), 0x1B);
+    E0 = _mm_set_epi32(digest[4], 0, 0, 0);
+    ABCD_SAVE = ABCD;
+    E0_SAVE = E0;
+    MSG0 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) block), 0x1B);
+    MSG1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) block + 1),
+                             0x1B);
+    MSG2 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) block + 2),
+                             0x1B);
+    MSG3 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) block + 3),
+                             0x1B);
+
+    E0 = _mm_add_epi32(E0, MSG0); E1 = ABCD;
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+    NI(E1, E0, MSG1, 0); NI_MSG1(MSG1, MSG0);
+    NI(E0, E1, MSG2, 0); NI_XOR(MSG2, MSG0); NI_MSG1(MSG2, MSG1);
+    NI(E1, E0, MSG3, 0); NI_SCHED(MSG3, MSG0, MSG1, MSG2);
+    NI(E0, E1, MSG0, 0); NI_SCHED(MSG0, MSG1, MSG2, MSG3);
+    NI(E1, E0, MSG1, 1); NI_SCHED(MSG1, MSG2, MSG3, MSG0);
+    NI(E0, E1, MSG2, 1); NI_SCHED(MSG2, MSG3, MSG0, MSG1);
+    NI(E1, E0, MSG3, 1); NI_SCHED(MSG3, MSG0, MSG1, MSG2);
+    NI(E0, E1, MSG0, 1); NI_SCHED(MSG0, MSG1, MSG2, MSG3);
+    NI(E1, E0, MSG1, 1); NI_SCHED(MSG1, MSG2, MSG3, MSG0);
+    NI(E0, E1, MSG2, 2); NI_SCHED(MSG2, MSG3, MSG0, MSG1);
+    NI(E1, E0, MSG3, 2); NI_SCHED(MSG3, MSG0, MSG1, MSG2);
+    NI(E0, E1, MSG0, 2); NI_SCHED(MSG0, MSG1, MSG2, MSG3);
+    NI(E1, E0, MSG1, 2); NI_SCHED(MSG1, MSG2, MSG3, MSG0);
+    NI(E0, E1, MSG2, 2); NI_SCHED(MSG2, MSG3, MSG0, MSG1);
+    NI(E1, E0, MSG3, 3); NI_SCHED(MSG3, MSG0, MSG1, MSG2);
+    NI(E0, E1, MSG0, 3); NI_SCHED(MSG0, MSG1, MSG2, MSG3);
+    NI(E1, E0, MSG1, 3); NI_MSG2(MSG1, MSG2); NI_XOR(MSG1, MSG3);
+    NI(E0, E1, MSG2, 3); NI_MSG2(MSG2, MSG3);
+    NI(E1, E0, MSG3, 3);
+
+    E0 = _mm_sha1nexte_epu32(E0, E0_SAVE);
+    ABCD = _mm_add_epi32(ABCD, ABCD_SAVE);
+    _mm_storeu_si128((__m128i *) digest, _mm_shuffle_epi32(ABCD, 0x1B));
+    digest[4] = _mm_extract_epi32(E0, 3);
+}
+
+static int
+has_sha_ni(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1) ||
+        __get_cpuid_max(0, 0) < 7) {
+        return 0;
+    }
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return !!(ebx & (1 << 29));
+}
+#endif /* x86 */
+
+#if defined(__aarch64__) && defined(__linux__) &&                            \
+    (defined(__clang__) || __GNUC__ >= 8)
+#define HAS_ARMV8_SHA1
+#include <arm_neon.h>
+#include <sys/auxv.h>
+
+#ifndef HWCAP_SHA1
+#define HWCAP_SHA1 (1 << 5)
+#endif
+
+/* four rounds using the ARMv8 cryptography extensions */
+#define ARM(op, E, F, MSG, K)    \
+    F = vsha1h_u32(vgetq_lane_u32(ABCD, 0));    \
+    ABCD = op(ABCD, E, vaddq_u32(MSG, vdupq_n_u32(K)))
+
+/* computes the message words for the four rounds after the next three */
+#define ARM_SCHED(M0, M1, M2, M3)    \
+    M0 = vsha1su1q_u32(vsha1su0q_u32(M0, M1, M2), M3)
+
+#ifdef __clang__
+__attribute__((target("crypto")))
+#else
+__attribute__((target("+crypto")))
+#endif
+static void
+sha1_compress_armv8(uint32_t *digest, const uint32_t *block)
+{
+    uint32x4_t ABCD, ABCD_SAVE, MSG0, MSG1, MSG2, MSG3;
+    uint32_t E0, E1;
+
+    ABCD = ABCD_SAVE = vld1q_u32(digest);
+    E0 = digest[4];
+    MSG0 = vld1q_u32(block);
+    MSG1 = vld1q_u32(block + 4);
+    MSG2 = vld1q_u32(block + 8);
+    MSG3 = vld1q_u32(block + 12);
+
+    ARM(vsha1cq_u32, E0, E1, MSG0, CONST1); ARM_SCHED(MSG0, MSG1, MSG2, MSG3);
+    ARM(vsha1cq_u32, E1, E0, MSG1, CONST1); ARM_SCHED(MSG1, MSG2, MSG3, MSG0);
+    ARM(vsha1cq_u32, E0, E1, MSG2, CONST1); ARM_SCHED(MSG2, MSG3, MSG0, MSG1);
+    ARM(vsha1cq_u32, E1, E0, MSG3, CONST1); ARM_SCHED(MSG3, MSG0, MSG1, MSG2);
+    ARM(vsha1cq_u32, E0, E1, MSG0, CONST1); ARM_SCHED(MSG0, MSG1, MSG2, MSG3);
+    ARM(vsha1pq_u32, E1, E0, MSG1, CONST2); ARM_SCHED(MSG1, MSG2, MSG3, MSG0);
+    ARM(vsha1pq_u32, E0, E1, MSG2, CONST2); ARM_SCHED(MSG2, MSG3, MSG0, MSG1);
+    ARM(vsha1pq_u32, E1, E0, MSG3, CONST2); ARM_SCHED(MSG3, MSG0, MSG1, MSG2);
+    ARM(vsha1pq_u32, E0, E1, MSG0, CONST2); ARM_SCHED(MSG0, MSG1, MSG2, MSG3);
+    ARM(vsha1pq_u32, E1, E0, MSG1, CONST2); ARM_SCHED(MSG1, MSG2, MSG3, MSG0);
+    ARM(vsha1mq_u32, E0, E1, MSG2, CONST3); ARM_SCHED(MSG2, MSG3, MSG0, MSG1);
+    ARM(vsha1mq_u32, E1, E0, MSG3, CONST3); ARM_SCHED(MSG3, MSG0, MSG1, MSG2);
+    ARM(vsha1mq_u32, E0, E1, MSG0, CONST3); ARM_SCHED(MSG0, MSG1, MSG2, MSG3);
+    ARM(vsha1mq_u32, E1, E0, MSG1, CONST3); ARM_SCHED(MSG1, MSG2, MSG3, MSG0);
+    ARM(vsha1mq_u32, E0, E1, MSG2, CONST3); ARM_SCHED(MSG2, MSG3, MSG0, MSG1);
+    ARM(vsha1pq_u32, E1, E0, MSG3, CONST4); ARM_SCHED(MSG3, MSG0, MSG1, MSG2);
+    ARM(vsha1pq_u32, E0, E1, MSG0, CONST4);
+    ARM(vsha1pq_u32, E1, E0, MSG1, CONST4);
+    ARM(vsha1pq_u32, E0, E1, MSG2, CONST4);
+    ARM(vsha1pq_u32, E1, E0, MSG3, CONST4);
+
+    vst1q_u32(digest, vaddq_u32(ABCD, ABCD_SAVE));
+    digest[4] += E0;
+}
+#endif /* aarch64 */
+
+/* the compression function; selected once, when the code is loaded */
+
+static void (*sha1_compress)(uint32_t *digest, const uint32_t *block) =
+    sha1_compress_generic;
+static const char *sha1_compress_name = "generic";
+
+/* checks a hardware implementation against the portable one */
+
+static int
+sha1_self_test(void (*compress)(uint32_t *digest, const uint32_t *block))
+{
+    int i, j;
+    uint32_t block[16], expected[5], actual[5];
+
+    for (i = 0; i < 16; ++i) {
+        block[i] = T32(0x9e3779b9L * (i + 1));
+    }
+    expected[0] = actual[0] = 0x67452301L;
+    expected[1] = actual[1] = 0xefcdab89L;
+    expected[2] = actual[2] = 0x98badcfeL;
+    expected[3] = actual[3] = 0x10325476L;
+    expected[4] = actual[4] = 0xc3d2e1f0L;
+    for (i = 0; i < 4; ++i) {
+        sha1_compress_generic(expected, block);
+        compress(actual, block);
+        for (j = 0; j < 16; ++j) {
+            block[j] ^= expected[j % 5];
+        }
+    }
+    return !memcmp(expected, actual, sizeof(expected));
+}
+
+static void __attribute__((constructor))
+sha1_select(void)
+{
+#ifdef HAS_SHA_NI
+    if (has_sha_ni() && sha1_self_test(sha1_compress_sha_ni)) {
+        sha1_compress = sha1_compress_sha_ni;
+        sha1_compress_name = "sha-ni";
+    }
+#endif
+#ifdef HAS_ARMV8_SHA1
+    if ((getauxval(AT_HWCAP) & HWCAP_SHA1) &&
+        sha1_self_test(sha1_compress_armv8)) {
+        sha1_compress = sha1_compress_armv8;
+        sha1_compress_name = "armv8";
+    }
+#endif
+}
+
+const char *
+sha1_backend(void)
+{
+    return sha1_compress_name;
+}
+
 static void
 sha1_transform(SHA1_INFO *sha1_info)
 {
     int i;
     uint8_t *dp;
-    uint32_t T, A, B, C, D, E, W[80], *WP;
+    uint32_t T, W[16];
 
     dp = sha1_info->data;
 
@@ -167,52 +427,7 @@ sha1_transform(SHA1_INFO *sha1_info)
     }
 #endif /* SWAP_DONE */
 
-    for (i = 16; i < 80; ++i) {
-    W[i] = W[i-3] ^ W[i-8] ^ W[i-14] ^ W[i-16];
-    W[i] = R32(W[i], 1);
-    }
-    A = sha1_info->digest[0];
-    B = sha1_info->digest[1];
-    C = sha1_info->digest[2];
-    D = sha1_info->digest[3];
-    E = sha1_info->digest[4];
-    WP = W;
-#ifdef UNRAVEL
-    FA(1); FB(1); FC(1); FD(1); FE(1); FT(1); FA(1); FB(1); FC(1); FD(1);
-    FE(1); FT(1); FA(1); FB(1); FC(1); FD(1); FE(1); FT(1); FA(1); FB(1);
-    FC(2); FD(2); FE(2); FT(2); FA(2); FB(2); FC(2); FD(2); FE(2); FT(2);
-    FA(2); FB(2); FC(2); FD(2); FE(2); FT(2); FA(2); FB(2); FC(2); FD(2);
-    FE(3); FT(3); FA(3); FB(3); FC(3); FD(3); FE(3); FT(3); FA(3); FB(3);
-    FC(3); FD(3); FE(3); FT(3); FA(3); FB(3); FC(3); FD(3); FE(3); FT(3);
-    FA(4); FB(4); FC(4); FD(4); FE(4); FT(4); FA(4); FB(4); FC(4); FD(4);
-    FE(4); FT(4); FA(4); FB(4); FC(4); FD(4); FE(4); FT(4); FA(4); FB(4);
-    sha1_info->digest[0] = T32(sha1_info->digest[0] + E);
-    sha1_info->digest[1] = T32(sha1_info->digest[1] + T);
-    sha1_info->digest[2] = T32(sha1_info->digest[2] + A);
-    sha1_info->digest[3] = T32(sha1_info->digest[3] + B);
-    sha1_info->digest[4] = T32(sha1_info->digest[4] + C);
-#else /* !UNRAVEL */
-#ifdef UNROLL_LOOPS
-    FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1);
-    FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1);
-    FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2);
-    FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2);
-    FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3);
-    FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3);
-    FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4);
-    FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4);
-#else /* !UNROLL_LOOPS */
-    for (i =  0; i < 20; ++i) { FG(1); }
-    for (i = 20; i < 40; ++i) { FG(2); }
-    for (i = 40; i < 60; ++i) { FG(3); }
-    for (i = 60; i < 80; ++i) { FG(4); }
-#endif /* !UNROLL_LOOPS */
-    sha1_info->digest[0] = T32(sha1_info->digest[0] + A);
-    sha1_info->digest[1] = T32(sha1_info->digest[1] + B);
-    sha1_info->digest[2] = T32(sha1_info->digest[2] + C);
-    sha1_info->digest[3] = T32(sha1_info->digest[3] + D);
-    sha1_info->digest[4] = T32(sha1_info->digest[4] + E);
-#endif /* !UNRAVEL */
+    sha1_compress(sha1_info->digest, W);
 }
 
 /* initialize the SHA digest */
@@ -326,4 +541,38 @@ sha1_final(SHA1_INFO *sha1_info, uint8_t digest[20])
     sha1_transform_and_copy(digest, sha1_info);
 }
 
+/* finish computing the SHA digest of a message that ends in "count" (at most
+ * 13) big-endian words, and that has otherwise only been fed whole blocks.
+ * This builds the final padded block directly, and leaves "sha1_info"
+ * unchanged, so that the same state can be reused for other messages.
+ */
+
+void
+sha1_final_words(const SHA1_INFO *sha1_info, const uint32_t *words, int count,
+                 uint32_t digest[5])
+{
+    int i;
+    uint32_t lo_bit_count, hi_bit_count, W[16];
+
+    lo_bit_count = T32(sha1_info->count_lo + ((uint32_t) count << 5));
+    hi_bit_count = sha1_info->count_hi;
+    if (lo_bit_count < sha1_info->count_lo) {
+        ++hi_bit_count;
+    }
+    for (i = 0; i < count; ++i) {
+        W[i] = words[i];
+    }
+    W[count] = 0x80000000L;
+    for (i = count + 1; i < 14; ++i) {
+        W[i] = 0;
+    }
+    W[14] = hi_bit_count;
+    W[15] = lo_bit_count;
+    for (i = 0; i < 5; ++i) {
+        digest[i] = sha1_info->digest[i];
+    }
+    sha1_compress(digest, W);
+    memset(W, 0, sizeof(W));
+}
+
 /***EOF***/
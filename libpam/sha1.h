@@ -36,4 +36,16 @@ void sha1_update(SHA1_INFO *sha1_info, const uint8_t *buffer, int count)
 void sha1_final(SHA1_INFO *sha1_info, uint8_t digest[20])
   __attribute__((visibility("hidden")));
 
+// Finishes a message that ends in "count" (at most 13) 32-bit big-endian
+// words, after all previous calls to sha1_update() added whole blocks. This
+// bypasses the buffering in sha1_update() and sha1_final(), and leaves
+// "sha1_info" unchanged. "words" and "digest" may overlap.
+void sha1_final_words(const SHA1_INFO *sha1_info, const uint32_t *words,
+                      int count, uint32_t digest[5])
+  __attribute__((visibility("hidden")));
+
+// Returns the name of the compression function that was selected at load
+// time: "sha-ni", "armv8", or "generic".
+const char *sha1_backend(void) __attribute__((visibility("hidden")));
+
 #endif
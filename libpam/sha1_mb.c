@@ -0,0 +1,185 @@
+// Multi-buffer SHA1 for HMAC based one-time passwords
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string.h>
+
+#include "sha1.h"
+#include "sha1_mb.h"
+
+// The vector kernels rely on GCC-style vector extensions, on the "target"
+// attribute, and on run-time CPU detection. All of these are available in
+// both recent versions of GCC and in clang.
+#if (defined(__x86_64__) || defined(__i386__)) &&                             \
+    (defined(__clang__) || __GNUC__ >= 5)
+#define SHA1_MB_X86
+#endif
+
+typedef struct {
+  void (*fn)(const SHA1_INFO *inner, const SHA1_INFO *outer, uint64_t counter,
+             uint8_t (*digests)[SHA1_DIGEST_LENGTH]);
+  int  lanes;
+} Kernel;
+
+static void sha1_mb_scalar(const SHA1_INFO *inner, const SHA1_INFO *outer,
+                           uint64_t counter,
+                           uint8_t (*digests)[SHA1_DIGEST_LENGTH]) {
+  uint32_t words[5] = { (uint32_t)(counter >> 32), (uint32_t)counter };
+  sha1_final_words(inner, words, 2, words);
+  sha1_final_words(outer, words, 5, words);
+  for (int i = 0; i < SHA1_DIGEST_LENGTH; ++i) {
+    digests[0][i] = (uint8_t)(words[i/4] >> (24 - 8*(i%4)));
+  }
+  memset(words, 0, sizeof(words));
+}
+
+static const Kernel scalar_kernel = { sha1_mb_scalar, 1 };
+
+#ifdef SHA1_MB_X86
+#define MB_ROL(x, n)    (((x) << (n)) | ((x) >> (32 - (n))))
+#define MB_F1(x, y, z)  ((z) ^ ((x) & ((y) ^ (z))))
+#define MB_F2(x, y, z)  ((x) ^ (y) ^ (z))
+#define MB_F3(x, y, z)  (((x) & (y)) | ((z) & ((x) | (y))))
+#define MB_F4(x, y, z)  ((x) ^ (y) ^ (z))
+
+// Expands the message schedule in place, using W[] as a 16 entry ring buffer.
+#define MB_W(i)                                                               \
+  (W[(i) & 15] = MB_ROL(W[((i) - 3) & 15] ^ W[((i) - 8) & 15] ^               \
+                        W[((i) - 14) & 15] ^ W[(i) & 15], 1))
+
+#define MB_ROUND(f, k, w)                                                     \
+  t = MB_ROL(a, 5) + f(b, c, d) + e + (w) + (k);                              \
+  e = d; d = c; c = MB_ROL(b, 30); b = a; a = t
+
+#define SHA1_MB_COMPRESS(s, W)                                                \
+  do {                                                                        \
+    a = s[0]; b = s[1]; c = s[2]; d = s[3]; e = s[4];                         \
+    for (int i =  0; i < 16; ++i) { MB_ROUND(MB_F1, 0x5a827999u, W[i]);    }  \
+    for (int i = 16; i < 20; ++i) { MB_ROUND(MB_F1, 0x5a827999u, MB_W(i)); }  \
+    for (int i = 20; i < 40; ++i) { MB_ROUND(MB_F2, 0x6ed9eba1u, MB_W(i)); }  \
+    for (int i = 40; i < 60; ++i) { MB_ROUND(MB_F3, 0x8f1bbcdcu, MB_W(i)); }  \
+    for (int i = 60; i < 80; ++i) { MB_ROUND(MB_F4, 0xca62c1d6u, MB_W(i)); }  \
+    s[0] += a; s[1] += b; s[2] += c; s[3] += d; s[4] += e;                    \
+  } while (0)
+
+#define SHA1_MB_NAME   sha1_mb_sse4
+#define SHA1_MB_LANES  4
+#define SHA1_MB_TARGET __attribute__((target("sse4.1")))
+#include "sha1_mb_kernel.h"
+#undef SHA1_MB_NAME
+#undef SHA1_MB_LANES
+#undef SHA1_MB_TARGET
+
+#define SHA1_MB_NAME   sha1_mb_avx2
+#define SHA1_MB_LANES  8
+#define SHA1_MB_TARGET __attribute__((target("avx2")))
+#include "sha1_mb_kernel.h"
+#undef SHA1_MB_NAME
+#undef SHA1_MB_LANES
+#undef SHA1_MB_TARGET
+
+#define SHA1_MB_NAME   sha1_mb_avx512
+#define SHA1_MB_LANES  16
+#define SHA1_MB_TARGET __attribute__((target("avx512f")))
+#include "sha1_mb_kernel.h"
+#undef SHA1_MB_NAME
+#undef SHA1_MB_LANES
+#undef SHA1_MB_TARGET
+
+static const Kernel sse4_kernel   = { sha1_mb_sse4,    4 };
+static const Kernel avx2_kernel   = { sha1_mb_avx2,    8 };
+static const Kernel avx512_kernel = { sha1_mb_avx512, 16 };
+#endif
+
+// Returns non-zero, if the CPU can run "kernel".
+static int kernel_supported(const Kernel *kernel) {
+#ifdef SHA1_MB_X86
+  __builtin_cpu_init();
+  if (kernel == &avx512_kernel) {
+    return __builtin_cpu_supports("avx512f");
+  } else if (kernel == &avx2_kernel) {
+    return __builtin_cpu_supports("avx2");
+  } else if (kernel == &sse4_kernel) {
+    return __builtin_cpu_supports("sse4.1");
+  }
+#endif
+  return kernel == &scalar_kernel;
+}
+
+// All kernels, widest first.
+static const Kernel *const kernels[] = {
+#ifdef SHA1_MB_X86
+  &avx512_kernel, &avx2_kernel, &sse4_kernel,
+#endif
+  &scalar_kernel
+};
+
+static const Kernel *kernel;
+
+static const Kernel *get_kernel(void) {
+  // Selecting the kernel is idempotent. If multiple threads race, they all
+  // store the same pointer.
+  if (!kernel) {
+    const Kernel *k = &scalar_kernel;
+    for (int i = 0; i < sizeof(kernels)/sizeof(*kernels); ++i) {
+      if (kernel_supported(kernels[i])) {
+        k = kernels[i];
+        break;
+      }
+    }
+    kernel = k;
+  }
+  return kernel;
+}
+
+int sha1_mb_lanes(void) {
+  return get_kernel()->lanes;
+}
+
+int sha1_mb_select_kernel(int lanes) {
+  if (!lanes) {
+    kernel = NULL;
+    return 0;
+  }
+  for (int i = 0; i < sizeof(kernels)/sizeof(*kernels); ++i) {
+    if (kernels[i]->lanes == lanes) {
+      if (!kernel_supported(kernels[i])) {
+        break;
+      }
+      kernel = kernels[i];
+      return 0;
+    }
+  }
+  return -1;
+}
+
+void sha1_mb_hmac_counters(const SHA1_INFO *inner, const SHA1_INFO *outer,
+                           uint64_t counter, int count,
+                           uint8_t (*digests)[SHA1_DIGEST_LENGTH]) {
+  const Kernel *kernel = get_kernel();
+  for (; count >= kernel->lanes; count -= kernel->lanes) {
+    kernel->fn(inner, outer, counter, digests);
+    counter += kernel->lanes;
+    digests += kernel->lanes;
+  }
+  if (count > 0) {
+    // Compute a full set of lanes, but only copy out the ones that were
+    // asked for.
+    uint8_t tmp[SHA1_MB_MAX_LANES][SHA1_DIGEST_LENGTH];
+    kernel->fn(inner, outer, counter, tmp);
+    memcpy(digests, tmp, count*SHA1_DIGEST_LENGTH);
+    memset(tmp, 0, sizeof(tmp));
+  }
+}
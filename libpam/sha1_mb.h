@@ -0,0 +1,50 @@
+// Multi-buffer SHA1 for HMAC based one-time passwords
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Computes many independent HMAC_SHA1 values for the same key in parallel.
+// Each SIMD lane hashes a different 8-byte counter value. The widest kernel
+// that the CPU supports (AVX-512, AVX2 or SSE4.1) is selected at run-time.
+// On all other systems, we fall back to the portable scalar implementation.
+
+#ifndef SHA1_MB_H__
+#define SHA1_MB_H__
+
+#include <stdint.h>
+
+#include "sha1.h"
+
+#define SHA1_MB_MAX_LANES 16
+
+// Returns the number of counter values that the selected kernel computes
+// in a single pass.
+int sha1_mb_lanes(void) __attribute__((visibility("hidden")));
+
+// Forces the use of the kernel with the given number of lanes, so that tests
+// can cover all kernels that the CPU supports. Passing zero restores the
+// automatic selection. Returns -1, if there is no such kernel, or if the CPU
+// cannot run it. Not thread-safe.
+int sha1_mb_select_kernel(int lanes) __attribute__((visibility("hidden")));
+
+// "inner" and "outer" must be the SHA1 states after absorbing exactly one
+// 64-byte block (i.e. the HMAC ipad and opad). For each of the "count"
+// consecutive counter values starting at "counter", the HMAC_SHA1 of the
+// counter's 8-byte big-endian representation is stored in "digests".
+void sha1_mb_hmac_counters(const SHA1_INFO *inner, const SHA1_INFO *outer,
+                           uint64_t counter, int count,
+                           uint8_t (*digests)[SHA1_DIGEST_LENGTH])
+  __attribute__((visibility("hidden")));
+
+#endif
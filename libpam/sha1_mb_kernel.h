@@ -0,0 +1,81 @@
+// Multi-buffer SHA1 kernel template
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// This file is included by sha1_mb.c once for each supported vector width.
+// Before including it, define SHA1_MB_NAME (the name of the function),
+// SHA1_MB_LANES (the number of 32-bit lanes), and SHA1_MB_TARGET (the
+// compiler attribute that enables the instruction set).
+
+static SHA1_MB_TARGET void
+SHA1_MB_NAME(const SHA1_INFO *inner, const SHA1_INFO *outer, uint64_t counter,
+             uint8_t (*digests)[SHA1_DIGEST_LENGTH]) {
+  typedef uint32_t vec __attribute__((vector_size(4*SHA1_MB_LANES)));
+  const vec zero = { 0 };
+  uint32_t lane[SHA1_MB_LANES];
+  vec W[16], s[5], a, b, c, d, e, t;
+
+  // The inner hash has already absorbed the ipad block. The second and final
+  // block holds the big-endian counter, followed by the SHA1 padding for a
+  // message that is 64 + 8 bytes long.
+  for (int l = 0; l < SHA1_MB_LANES; ++l) {
+    lane[l] = (uint32_t)((counter + l) >> 32);
+  }
+  memcpy(&W[0], lane, sizeof(vec));
+  for (int l = 0; l < SHA1_MB_LANES; ++l) {
+    lane[l] = (uint32_t)(counter + l);
+  }
+  memcpy(&W[1], lane, sizeof(vec));
+  W[2] = zero + 0x80000000u;
+  for (int i = 3; i < 15; ++i) {
+    W[i] = zero;
+  }
+  W[15] = zero + (64 + 8)*8;
+  for (int i = 0; i < 5; ++i) {
+    s[i] = zero + inner->digest[i];
+  }
+  SHA1_MB_COMPRESS(s, W);
+
+  // The outer hash has already absorbed the opad block. Its final block holds
+  // the 20-byte inner digest, followed by the padding for 64 + 20 bytes.
+  for (int i = 0; i < 5; ++i) {
+    W[i] = s[i];
+  }
+  W[5] = zero + 0x80000000u;
+  for (int i = 6; i < 15; ++i) {
+    W[i] = zero;
+  }
+  W[15] = zero + (64 + SHA1_DIGEST_LENGTH)*8;
+  for (int i = 0; i < 5; ++i) {
+    s[i] = zero + outer->digest[i];
+  }
+  SHA1_MB_COMPRESS(s, W);
+
+  // Transpose the state words back into one big-endian digest per lane.
+  for (int i = 0; i < 5; ++i) {
+    memcpy(lane, &s[i], sizeof(vec));
+    for (int l = 0; l < SHA1_MB_LANES; ++l) {
+      digests[l][4*i    ] = (uint8_t)(lane[l] >> 24);
+      digests[l][4*i + 1] = (uint8_t)(lane[l] >> 16);
+      digests[l][4*i + 2] = (uint8_t)(lane[l] >>  8);
+      digests[l][4*i + 3] = (uint8_t)(lane[l]      );
+    }
+  }
+
+  // Zero out all internal data structures
+  memset(lane, 0, sizeof(lane));
+  memset(W, 0, sizeof(W));
+  memset(s, 0, sizeof(s));
+}
@@ -0,0 +1,261 @@
+// SHA256 implementation (FIPS 180-4)
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string.h>
+
+#include "sha256.h"
+
+static const uint32_t K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+  0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+  0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+  0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+  0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+  0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n)   (((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MAJ(x, y, z) (((x) & (y)) | ((z) & ((x) | (y))))
+#define S0(x)       (ROR(x,  2) ^ ROR(x, 13) ^ ROR(x, 22))
+#define S1(x)       (ROR(x,  6) ^ ROR(x, 11) ^ ROR(x, 25))
+#define s0(x)       (ROR(x,  7) ^ ROR(x, 18) ^ ((x) >>  3))
+#define s1(x)       (ROR(x, 17) ^ ROR(x, 19) ^ ((x) >> 10))
+
+// The portable compression function. "block" holds sixteen message words in
+// host byte order.
+static void sha256_compress_generic(uint32_t *digest, const uint32_t *block) {
+  uint32_t W[64];
+  for (int i = 0; i < 16; ++i) {
+    W[i] = block[i];
+  }
+  for (int i = 16; i < 64; ++i) {
+    W[i] = s1(W[i-2]) + W[i-7] + s0(W[i-15]) + W[i-16];
+  }
+  uint32_t a = digest[0], b = digest[1], c = digest[2], d = digest[3];
+  uint32_t e = digest[4], f = digest[5], g = digest[6], h = digest[7];
+  for (int i = 0; i < 64; ++i) {
+    uint32_t t1 = h + S1(e) + CH(e, f, g) + K[i] + W[i];
+    uint32_t t2 = S0(a) + MAJ(a, b, c);
+    h = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+  digest[0] += a; digest[1] += b; digest[2] += c; digest[3] += d;
+  digest[4] += e; digest[5] += f; digest[6] += g; digest[7] += h;
+  memset(W, 0, sizeof(W));
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) &&                             \
+    (defined(__clang__) || __GNUC__ >= 5)
+#define HAS_SHA_NI
+#include <cpuid.h>
+#include <immintrin.h>
+
+// Four rounds using the x86 SHA extensions. Each instruction computes two
+// rounds, and the second one needs the upper half of the round input.
+#define NI_ROUNDS(M, i)                                                       \
+  MSG = _mm_add_epi32(M, _mm_loadu_si128((const __m128i *)(K + 4*(i))));     \
+  STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);                        \
+  MSG = _mm_shuffle_epi32(MSG, 0x0E);                                         \
+  STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG)
+
+// Message schedule: completes the words in "NEXT" from the current and the
+// previous words, and starts on the words that come after "NEXT".
+#define NI_MSG2(CUR, PREV, NEXT)                                              \
+  NEXT = _mm_sha256msg2_epu32(                                                \
+           _mm_add_epi32(NEXT, _mm_alignr_epi8(CUR, PREV, 4)), CUR)
+#define NI_MSG1(CUR, PREV)  PREV = _mm_sha256msg1_epu32(PREV, CUR)
+
+static __attribute__((target("sha,sse4.1"))) void
+sha256_compress_sha_ni(uint32_t *digest, const uint32_t *block) {
+  __m128i STATE0, STATE1, ABEF_SAVE, CDGH_SAVE, MSG, TMP;
+  __m128i MSG0, MSG1, MSG2, MSG3;
+
+  // The instructions expect the state as "ABEF" and "CDGH".
+  TMP = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)digest), 0xB1);
+  STATE1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)digest + 1),
+                             0x1B);
+  STATE0 = _mm_alignr_epi8(TMP, STATE1, 8);
+  STATE1 = _mm_blend_epi16(STATE1, TMP, 0xF0);
+  ABEF_SAVE = STATE0;
+  CDGH_SAVE = STATE1;
+
+  MSG0 = _mm_loadu_si128((const __m128i *)block);
+  MSG1 = _mm_loadu_si128((const __m128i *)block + 1);
+  MSG2 = _mm_loadu_si128((const __m128i *)block + 2);
+  MSG3 = _mm_loadu_si128((const __m128i *)block + 3);
+
+  NI_ROUNDS(MSG0,  0);
+  NI_ROUNDS(MSG1,  1); NI_MSG1(MSG1, MSG0);
+  NI_ROUNDS(MSG2,  2); NI_MSG1(MSG2, MSG1);
+  NI_ROUNDS(MSG3,  3); NI_MSG2(MSG3, MSG2, MSG0); NI_MSG1(MSG3, MSG2);
+  NI_ROUNDS(MSG0,  4); NI_MSG2(MSG0, MSG3, MSG1); NI_MSG1(MSG0, MSG3);
+  NI_ROUNDS(MSG1,  5); NI_MSG2(MSG1, MSG0, MSG2); NI_MSG1(MSG1, MSG0);
+  NI_ROUNDS(MSG2,  6); NI_MSG2(MSG2, MSG1, MSG3); NI_MSG1(MSG2, MSG1);
+  NI_ROUNDS(MSG3,  7); NI_MSG2(MSG3, MSG2, MSG0); NI_MSG1(MSG3, MSG2);
+  NI_ROUNDS(MSG0,  8); NI_MSG2(MSG0, MSG3, MSG1); NI_MSG1(MSG0, MSG3);
+  NI_ROUNDS(MSG1,  9); NI_MSG2(MSG1, MSG0, MSG2); NI_MSG1(MSG1, MSG0);
+  NI_ROUNDS(MSG2, 10); NI_MSG2(MSG2, MSG1, MSG3); NI_MSG1(MSG2, MSG1);
+  NI_ROUNDS(MSG3, 11); NI_MSG2(MSG3, MSG2, MSG0); NI_MSG1(MSG3, MSG2);
+  NI_ROUNDS(MSG0, 12); NI_MSG2(MSG0, MSG3, MSG1); NI_MSG1(MSG0, MSG3);
+  NI_ROUNDS(MSG1, 13); NI_MSG2(MSG1, MSG0, MSG2);
+  NI_ROUNDS(MSG2, 14); NI_MSG2(MSG2, MSG1, MSG3);
+  NI_ROUNDS(MSG3, 15);
+
+  STATE0 = _mm_add_epi32(STATE0, ABEF_SAVE);
+  STATE1 = _mm_add_epi32(STATE1, CDGH_SAVE);
+
+  // Convert back to "ABCD" and "EFGH".
+  TMP = _mm_shuffle_epi32(STATE0, 0x1B);
+  STATE1 = _mm_shuffle_epi32(STATE1, 0xB1);
+  _mm_storeu_si128((__m128i *)digest, _mm_blend_epi16(TMP, STATE1, 0xF0));
+  _mm_storeu_si128((__m128i *)digest + 1, _mm_alignr_epi8(STATE1, TMP, 8));
+}
+
+static int has_sha_ni(void) {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1) ||
+      __get_cpuid_max(0, 0) < 7) {
+    return 0;
+  }
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+  return !!(ebx & (1 << 29));
+}
+#endif
+
+static void (*sha256_compress)(uint32_t *digest, const uint32_t *block) =
+  sha256_compress_generic;
+static const char *sha256_compress_name = "generic";
+
+// Checks a hardware implementation against the portable one.
+static int sha256_self_test(void (*compress)(uint32_t *, const uint32_t *)) {
+  uint32_t block[16], expected[8], actual[8];
+  for (int i = 0; i < 16; ++i) {
+    block[i] = 0x9e3779b9u * (i + 1);
+  }
+  for (int i = 0; i < 8; ++i) {
+    expected[i] = actual[i] = K[i];
+  }
+  for (int i = 0; i < 4; ++i) {
+    sha256_compress_generic(expected, block);
+    compress(actual, block);
+    for (int j = 0; j < 16; ++j) {
+      block[j] ^= expected[j % 8];
+    }
+  }
+  return !memcmp(expected, actual, sizeof(expected));
+}
+
+static void __attribute__((constructor)) sha256_select(void) {
+#ifdef HAS_SHA_NI
+  if (has_sha_ni() && sha256_self_test(sha256_compress_sha_ni)) {
+    sha256_compress = sha256_compress_sha_ni;
+    sha256_compress_name = "sha-ni";
+  }
+#endif
+}
+
+const char *sha256_backend(void) {
+  return sha256_compress_name;
+}
+
+static void sha256_transform(SHA256_INFO *sha256_info) {
+  uint32_t W[16];
+  const uint8_t *dp = sha256_info->data;
+  for (int i = 0; i < 16; ++i, dp += 4) {
+    W[i] = ((uint32_t)dp[0] << 24) | ((uint32_t)dp[1] << 16) |
+           ((uint32_t)dp[2] <<  8) |  (uint32_t)dp[3];
+  }
+  sha256_compress(sha256_info->digest, W);
+  memset(W, 0, sizeof(W));
+}
+
+void sha256_init(SHA256_INFO *sha256_info) {
+  static const uint32_t H[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  memcpy(sha256_info->digest, H, sizeof(H));
+  sha256_info->count = 0;
+  sha256_info->local = 0;
+}
+
+void sha256_update(SHA256_INFO *sha256_info, const uint8_t *buffer,
+                   int count) {
+  sha256_info->count += count;
+  if (sha256_info->local) {
+    int i = SHA256_BLOCKSIZE - sha256_info->local;
+    if (i > count) {
+      i = count;
+    }
+    memcpy(sha256_info->data + sha256_info->local, buffer, i);
+    count -= i;
+    buffer += i;
+    sha256_info->local += i;
+    if (sha256_info->local < SHA256_BLOCKSIZE) {
+      return;
+    }
+    sha256_transform(sha256_info);
+  }
+  while (count >= SHA256_BLOCKSIZE) {
+    memcpy(sha256_info->data, buffer, SHA256_BLOCKSIZE);
+    buffer += SHA256_BLOCKSIZE;
+    count -= SHA256_BLOCKSIZE;
+    sha256_transform(sha256_info);
+  }
+  memcpy(sha256_info->data, buffer, count);
+  sha256_info->local = count;
+}
+
+void sha256_final(SHA256_INFO *sha256_info,
+                  uint8_t digest[SHA256_DIGEST_LENGTH]) {
+  uint64_t bits = sha256_info->count << 3;
+  int count = sha256_info->local;
+  sha256_info->data[count++] = 0x80;
+  if (count > SHA256_BLOCKSIZE - 8) {
+    memset(sha256_info->data + count, 0, SHA256_BLOCKSIZE - count);
+    sha256_transform(sha256_info);
+    count = 0;
+  }
+  memset(sha256_info->data + count, 0, SHA256_BLOCKSIZE - 8 - count);
+  for (int i = 0; i < 8; ++i) {
+    sha256_info->data[SHA256_BLOCKSIZE - 1 - i] = (uint8_t)(bits >> 8*i);
+  }
+  sha256_transform(sha256_info);
+  for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
+    digest[i] = (uint8_t)(sha256_info->digest[i/4] >> (24 - 8*(i%4)));
+  }
+}
+
+void sha256_final_words(const SHA256_INFO *sha256_info, const uint32_t *words,
+                        int count, uint32_t digest[8]) {
+  uint64_t bits = (sha256_info->count + 4*count) << 3;
+  uint32_t W[16] = { 0 };
+  for (int i = 0; i < count; ++i) {
+    W[i] = words[i];
+  }
+  W[count] = 0x80000000u;
+  W[14] = (uint32_t)(bits >> 32);
+  W[15] = (uint32_t)bits;
+  memcpy(digest, sha256_info->digest, sizeof(sha256_info->digest));
+  sha256_compress(digest, W);
+  memset(W, 0, sizeof(W));
+}
@@ -0,0 +1,51 @@
+// SHA256 header file
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SHA256_H__
+#define SHA256_H__
+
+#include <stdint.h>
+
+#define SHA256_BLOCKSIZE     64
+#define SHA256_DIGEST_LENGTH 32
+
+typedef struct {
+  uint32_t digest[8];
+  uint64_t count;
+  uint8_t  data[SHA256_BLOCKSIZE];
+  int      local;
+} SHA256_INFO;
+
+void sha256_init(SHA256_INFO *sha256_info)
+  __attribute__((visibility("hidden")));
+void sha256_update(SHA256_INFO *sha256_info, const uint8_t *buffer, int count)
+  __attribute__((visibility("hidden")));
+void sha256_final(SHA256_INFO *sha256_info,
+                  uint8_t digest[SHA256_DIGEST_LENGTH])
+  __attribute__((visibility("hidden")));
+
+// Finishes a message that ends in "count" (at most 13) 32-bit big-endian
+// words, after all previous calls to sha256_update() added whole blocks.
+// Works like sha1_final_words().
+void sha256_final_words(const SHA256_INFO *sha256_info, const uint32_t *words,
+                        int count, uint32_t digest[8])
+  __attribute__((visibility("hidden")));
+
+// Returns the name of the compression function that was selected at load
+// time: "sha-ni" or "generic".
+const char *sha256_backend(void) __attribute__((visibility("hidden")));
+
+#endif
@@ -0,0 +1,167 @@
+// SHA512 implementation (FIPS 180-4)
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string.h>
+
+#include "sha512.h"
+
+static const uint64_t K[80] = {
+  0x428a2f98d728ae22ull, 0x7137449123ef65cdull, 0xb5c0fbcfec4d3b2full,
+  0xe9b5dba58189dbbcull, 0x3956c25bf348b538ull, 0x59f111f1b605d019ull,
+  0x923f82a4af194f9bull, 0xab1c5ed5da6d8118ull, 0xd807aa98a3030242ull,
+  0x12835b0145706fbeull, 0x243185be4ee4b28cull, 0x550c7dc3d5ffb4e2ull,
+  0x72be5d74f27b896full, 0x80deb1fe3b1696b1ull, 0x9bdc06a725c71235ull,
+  0xc19bf174cf692694ull, 0xe49b69c19ef14ad2ull, 0xefbe4786384f25e3ull,
+  0x0fc19dc68b8cd5b5ull, 0x240ca1cc77ac9c65ull, 0x2de92c6f592b0275ull,
+  0x4a7484aa6ea6e483ull, 0x5cb0a9dcbd41fbd4ull, 0x76f988da831153b5ull,
+  0x983e5152ee66dfabull, 0xa831c66d2db43210ull, 0xb00327c898fb213full,
+  0xbf597fc7beef0ee4ull, 0xc6e00bf33da88fc2ull, 0xd5a79147930aa725ull,
+  0x06ca6351e003826full, 0x142929670a0e6e70ull, 0x27b70a8546d22ffcull,
+  0x2e1b21385c26c926ull, 0x4d2c6dfc5ac42aedull, 0x53380d139d95b3dfull,
+  0x650a73548baf63deull, 0x766a0abb3c77b2a8ull, 0x81c2c92e47edaee6ull,
+  0x92722c851482353bull, 0xa2bfe8a14cf10364ull, 0xa81a664bbc423001ull,
+  0xc24b8b70d0f89791ull, 0xc76c51a30654be30ull, 0xd192e819d6ef5218ull,
+  0xd69906245565a910ull, 0xf40e35855771202aull, 0x106aa07032bbd1b8ull,
+  0x19a4c116b8d2d0c8ull, 0x1e376c085141ab53ull, 0x2748774cdf8eeb99ull,
+  0x34b0bcb5e19b48a8ull, 0x391c0cb3c5c95a63ull, 0x4ed8aa4ae3418acbull,
+  0x5b9cca4f7763e373ull, 0x682e6ff3d6b2b8a3ull, 0x748f82ee5defb2fcull,
+  0x78a5636f43172f60ull, 0x84c87814a1f0ab72ull, 0x8cc702081a6439ecull,
+  0x90befffa23631e28ull, 0xa4506cebde82bde9ull, 0xbef9a3f7b2c67915ull,
+  0xc67178f2e372532bull, 0xca273eceea26619cull, 0xd186b8c721c0c207ull,
+  0xeada7dd6cde0eb1eull, 0xf57d4f7fee6ed178ull, 0x06f067aa72176fbaull,
+  0x0a637dc5a2c898a6ull, 0x113f9804bef90daeull, 0x1b710b35131c471bull,
+  0x28db77f523047d84ull, 0x32caab7b40c72493ull, 0x3c9ebe0a15c9bebcull,
+  0x431d67c49c100d4cull, 0x4cc5d4becb3e42b6ull, 0x597f299cfc657e2aull,
+  0x5fcb6fab3ad6faecull, 0x6c44198c4a475817ull
+};
+
+#define ROR(x, n)    (((x) >> (n)) | ((x) << (64 - (n))))
+#define CH(x, y, z)  ((z) ^ ((x) & ((y) ^ (z))))
+#define MAJ(x, y, z) (((x) & (y)) | ((z) & ((x) | (y))))
+#define S0(x)        (ROR(x, 28) ^ ROR(x, 34) ^ ROR(x, 39))
+#define S1(x)        (ROR(x, 14) ^ ROR(x, 18) ^ ROR(x, 41))
+#define s0(x)        (ROR(x,  1) ^ ROR(x,  8) ^ ((x) >> 7))
+#define s1(x)        (ROR(x, 19) ^ ROR(x, 61) ^ ((x) >> 6))
+
+// "block" holds sixteen message words in host byte order. There is no
+// hardware support for SHA512 on common CPUs, but on 64-bit systems the
+// compiler does a good job at scheduling the plain C code.
+static void sha512_compress(uint64_t *digest, const uint64_t *block) {
+  uint64_t W[80];
+  for (int i = 0; i < 16; ++i) {
+    W[i] = block[i];
+  }
+  for (int i = 16; i < 80; ++i) {
+    W[i] = s1(W[i-2]) + W[i-7] + s0(W[i-15]) + W[i-16];
+  }
+  uint64_t a = digest[0], b = digest[1], c = digest[2], d = digest[3];
+  uint64_t e = digest[4], f = digest[5], g = digest[6], h = digest[7];
+  for (int i = 0; i < 80; ++i) {
+    uint64_t t1 = h + S1(e) + CH(e, f, g) + K[i] + W[i];
+    uint64_t t2 = S0(a) + MAJ(a, b, c);
+    h = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+  digest[0] += a; digest[1] += b; digest[2] += c; digest[3] += d;
+  digest[4] += e; digest[5] += f; digest[6] += g; digest[7] += h;
+  memset(W, 0, sizeof(W));
+}
+
+static void sha512_transform(SHA512_INFO *sha512_info) {
+  uint64_t W[16];
+  const uint8_t *dp = sha512_info->data;
+  for (int i = 0; i < 16; ++i) {
+    W[i] = 0;
+    for (int j = 0; j < 8; ++j) {
+      W[i] = (W[i] << 8) | *dp++;
+    }
+  }
+  sha512_compress(sha512_info->digest, W);
+  memset(W, 0, sizeof(W));
+}
+
+void sha512_init(SHA512_INFO *sha512_info) {
+  static const uint64_t H[8] = {
+    0x6a09e667f3bcc908ull, 0xbb67ae8584caa73bull, 0x3c6ef372fe94f82bull,
+    0xa54ff53a5f1d36f1ull, 0x510e527fade682d1ull, 0x9b05688c2b3e6c1full,
+    0x1f83d9abfb41bd6bull, 0x5be0cd19137e2179ull
+  };
+  memcpy(sha512_info->digest, H, sizeof(H));
+  sha512_info->count = 0;
+  sha512_info->local = 0;
+}
+
+void sha512_update(SHA512_INFO *sha512_info, const uint8_t *buffer,
+                   int count) {
+  sha512_info->count += count;
+  if (sha512_info->local) {
+    int i = SHA512_BLOCKSIZE - sha512_info->local;
+    if (i > count) {
+      i = count;
+    }
+    memcpy(sha512_info->data + sha512_info->local, buffer, i);
+    count -= i;
+    buffer += i;
+    sha512_info->local += i;
+    if (sha512_info->local < SHA512_BLOCKSIZE) {
+      return;
+    }
+    sha512_transform(sha512_info);
+  }
+  while (count >= SHA512_BLOCKSIZE) {
+    memcpy(sha512_info->data, buffer, SHA512_BLOCKSIZE);
+    buffer += SHA512_BLOCKSIZE;
+    count -= SHA512_BLOCKSIZE;
+    sha512_transform(sha512_info);
+  }
+  memcpy(sha512_info->data, buffer, count);
+  sha512_info->local = count;
+}
+
+void sha512_final(SHA512_INFO *sha512_info,
+                  uint8_t digest[SHA512_DIGEST_LENGTH]) {
+  // Messages are never longer than 2^61 bytes. So, the upper half of the
+  // 128-bit length field is always zero.
+  uint64_t bits = sha512_info->count << 3;
+  int count = sha512_info->local;
+  sha512_info->data[count++] = 0x80;
+  if (count > SHA512_BLOCKSIZE - 16) {
+    memset(sha512_info->data + count, 0, SHA512_BLOCKSIZE - count);
+    sha512_transform(sha512_info);
+    count = 0;
+  }
+  memset(sha512_info->data + count, 0, SHA512_BLOCKSIZE - 8 - count);
+  for (int i = 0; i < 8; ++i) {
+    sha512_info->data[SHA512_BLOCKSIZE - 1 - i] = (uint8_t)(bits >> 8*i);
+  }
+  sha512_transform(sha512_info);
+  for (int i = 0; i < SHA512_DIGEST_LENGTH; ++i) {
+    digest[i] = (uint8_t)(sha512_info->digest[i/8] >> (56 - 8*(i%8)));
+  }
+}
+
+void sha512_final_words(const SHA512_INFO *sha512_info, const uint64_t *words,
+                        int count, uint64_t digest[8]) {
+  uint64_t W[16] = { 0 };
+  for (int i = 0; i < count; ++i) {
+    W[i] = words[i];
+  }
+  W[count] = 0x8000000000000000ull;
+  W[15] = (sha512_info->count + 8*count) << 3;
+  memcpy(digest, sha512_info->digest, sizeof(sha512_info->digest));
+  sha512_compress(digest, W);
+  memset(W, 0, sizeof(W));
+}
@@ -0,0 +1,47 @@
+// SHA512 header file
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SHA512_H__
+#define SHA512_H__
+
+#include <stdint.h>
+
+#define SHA512_BLOCKSIZE     128
+#define SHA512_DIGEST_LENGTH 64
+
+typedef struct {
+  uint64_t digest[8];
+  uint64_t count;
+  uint8_t  data[SHA512_BLOCKSIZE];
+  int      local;
+} SHA512_INFO;
+
+void sha512_init(SHA512_INFO *sha512_info)
+  __attribute__((visibility("hidden")));
+void sha512_update(SHA512_INFO *sha512_info, const uint8_t *buffer, int count)
+  __attribute__((visibility("hidden")));
+void sha512_final(SHA512_INFO *sha512_info,
+                  uint8_t digest[SHA512_DIGEST_LENGTH])
+  __attribute__((visibility("hidden")));
+
+// Finishes a message that ends in "count" (at most 13) 64-bit big-endian
+// words, after all previous calls to sha512_update() added whole blocks.
+// Works like sha1_final_words().
+void sha512_final_words(const SHA512_INFO *sha512_info, const uint64_t *words,
+                        int count, uint64_t digest[8])
+  __attribute__((visibility("hidden")));
+
+#endif